@@ -0,0 +1,121 @@
+#include "AdmissionControl.h"
+
+#include <sstream>
+
+AdmissionControl::AdmissionControl() : AdmissionControl(AdmissionConfig())
+{
+}
+
+AdmissionControl::AdmissionControl(const AdmissionConfig& config)
+{
+    configure(config);
+}
+
+void AdmissionControl::configure(const AdmissionConfig& newConfig)
+{
+    config = newConfig;
+    globalBucket.configure(config.globalAcceptRate, config.globalAcceptBurst);
+    for (auto& entry : sources)
+    {
+        entry.second.acceptBucket.configure(config.perIpAcceptRate, config.perIpAcceptBurst);
+    }
+}
+
+const AdmissionConfig& AdmissionControl::getConfig() const
+{
+    return config;
+}
+
+AdmissionControl::SourceState& AdmissionControl::sourceFor(u_long address)
+{
+    auto it = sources.find(address);
+    if (it == sources.end())
+    {
+        it = sources.emplace(address, SourceState()).first;
+        it->second.acceptBucket.configure(config.perIpAcceptRate, config.perIpAcceptBurst);
+    }
+    return it->second;
+}
+
+AdmissionVerdict AdmissionControl::admit(u_long address)
+{
+    SourceState& source = sourceFor(address);
+
+    // Cheapest checks first, and per-source limits before the global one,
+    // so a single noisy address can't drain the tokens everybody else shares.
+    if (config.maxConnectionsPerIp > 0 && source.activeConnections >= config.maxConnectionsPerIp)
+    {
+        stats.rejectedIpCap++;
+        return REJECT_IP_CAP;
+    }
+    if (!source.acceptBucket.tryConsume())
+    {
+        stats.rejectedIpRate++;
+        return REJECT_IP_RATE;
+    }
+    if (!globalBucket.tryConsume())
+    {
+        stats.rejectedGlobalRate++;
+        return REJECT_GLOBAL_RATE;
+    }
+
+    source.activeConnections++;
+    stats.accepted++;
+    return ADMIT;
+}
+
+void AdmissionControl::release(u_long address)
+{
+    auto it = sources.find(address);
+    if (it != sources.end() && it->second.activeConnections > 0)
+    {
+        it->second.activeConnections--;
+    }
+}
+
+void AdmissionControl::adopt(u_long address)
+{
+    // A connection accepted by the process we took over from, counted without rate checks
+    sourceFor(address).activeConnections++;
+}
+
+void AdmissionControl::recordServerFull(u_long address)
+{
+    // The connection passed admission but found no free slot, so give its slot back.
+    release(address);
+    stats.accepted--;
+    stats.rejectedServerFull++;
+}
+
+void AdmissionControl::prune()
+{
+    // Forget sources with no sessions whose bucket has fully refilled; they behave exactly like new ones.
+    for (auto it = sources.begin(); it != sources.end();)
+    {
+        if (it->second.activeConnections == 0 && it->second.acceptBucket.isFull())
+        {
+            it = sources.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+const AdmissionStats& AdmissionControl::getStats() const
+{
+    return stats;
+}
+
+std::string AdmissionControl::report() const
+{
+    std::ostringstream out;
+    out << "admission: accepted=" << stats.accepted
+        << " rejected_global_rate=" << stats.rejectedGlobalRate
+        << " rejected_ip_rate=" << stats.rejectedIpRate
+        << " rejected_ip_cap=" << stats.rejectedIpCap
+        << " rejected_full=" << stats.rejectedServerFull
+        << " tracked_sources=" << sources.size();
+    return out.str();
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <winsock2.h>
+#include "TokenBucket.h"
+
+// Tunables for the accept path. A rate of zero disables that limit, a cap of zero disables the cap.
+struct AdmissionConfig {
+    double globalAcceptRate = 50.0;     // new connections per second, all sources combined
+    double globalAcceptBurst = 100.0;
+    double perIpAcceptRate = 2.0;       // new connections per second from a single address
+    double perIpAcceptBurst = 5.0;
+    int maxConnectionsPerIp = 8;        // concurrent sessions from a single address
+};
+
+struct AdmissionStats {
+    unsigned long long accepted = 0;
+    unsigned long long rejectedGlobalRate = 0;
+    unsigned long long rejectedIpRate = 0;
+    unsigned long long rejectedIpCap = 0;
+    unsigned long long rejectedServerFull = 0;
+};
+
+enum AdmissionVerdict {
+    ADMIT = 0,
+    REJECT_GLOBAL_RATE = 1,
+    REJECT_IP_RATE = 2,
+    REJECT_IP_CAP = 3,
+};
+
+// Decides whether a new connection may be accepted, before the server spends anything on it.
+class AdmissionControl {
+public:
+    AdmissionControl();
+    explicit AdmissionControl(const AdmissionConfig& config);
+    void configure(const AdmissionConfig& config);
+    const AdmissionConfig& getConfig() const;
+    AdmissionVerdict admit(u_long address);
+    void release(u_long address);
+    void adopt(u_long address);
+    void recordServerFull(u_long address);
+    void prune();
+    const AdmissionStats& getStats() const;
+    std::string report() const;
+private:
+    struct SourceState {
+        TokenBucket acceptBucket;
+        int activeConnections = 0;
+    };
+    SourceState& sourceFor(u_long address);
+    AdmissionConfig config;
+    AdmissionStats stats;
+    TokenBucket globalBucket;
+    std::unordered_map<u_long, SourceState> sources;
+};
@@ -0,0 +1,71 @@
+#include "AllocationCounter.h"
+
+#ifdef CPPCHAT_COUNT_ALLOCATIONS
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+namespace {
+std::atomic<uint64_t> allocations(0);
+}
+
+void* operator new(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    void* memory = std::malloc(size == 0 ? 1 : size);
+    if (memory == NULL)
+    {
+        throw std::bad_alloc();
+    }
+    return memory;
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void* memory) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete[](void* memory) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete[](void* memory, size_t) noexcept
+{
+    std::free(memory);
+}
+
+bool allocationCountingEnabled()
+{
+    return true;
+}
+
+uint64_t allocationCount()
+{
+    return allocations.load(std::memory_order_relaxed);
+}
+
+#else
+
+bool allocationCountingEnabled()
+{
+    return false;
+}
+
+uint64_t allocationCount()
+{
+    return 0;
+}
+
+#endif
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <cstdint>
+
+// Process-wide count of operator new calls, compiled in only with CPPCHAT_COUNT_ALLOCATIONS.
+// Reading it before and after a burst of traffic shows how many allocations the message
+// path costs; $stats reports it when enabled.
+bool allocationCountingEnabled();
+uint64_t allocationCount();
@@ -0,0 +1,388 @@
+#include "Benchmark.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <ws2tcpip.h>
+#include <afunix.h>
+
+#define _WINSOCK_DEPRECATED_NO_WARNINGS
+#pragma warning(disable: 4996)
+
+namespace {
+const int ALLOCATION_CHECK_WINDOW = 8;     // messages in flight during the allocation check
+
+long long nowNanoseconds()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+}
+
+Benchmark::Benchmark(const BenchmarkConfig& config) : config(config), delivered(0)
+{
+    WSADATA wsaData;
+    int result = WSAStartup(MAKEWORD(2, 2), &wsaData);
+    if (result != 0)
+    {
+        throw std::runtime_error("WSAStartup failed: " + std::to_string(result));
+    }
+}
+
+Benchmark::~Benchmark()
+{
+    for (auto& connection : connections)
+    {
+        connection->shared.reset();
+        closesocket(connection->socket);
+    }
+    WSACleanup();
+}
+
+BenchmarkResult Benchmark::run()
+{
+    if (config.connections < 2)
+    {
+        throw std::runtime_error("The benchmark needs at least two connections");
+    }
+    // Registered one after the other, so every registration reply is read before presence traffic starts.
+    for (int i = 0; i < config.connections; i++)
+    {
+        connections.emplace_back(connectAndRegister("bench" + std::to_string(i)));
+    }
+
+    BenchmarkResult result;
+    std::vector<double> all;
+    auto start = std::chrono::steady_clock::now();
+    result.sent = relayBurst(all, 0);
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    double total = 0;
+    for (double latency : all)
+    {
+        total += latency;
+        result.maxLatencyMs = (std::max)(result.maxLatencyMs, latency);
+    }
+    result.delivered = all.size();
+    if (result.delivered > 0)
+    {
+        result.meanLatencyMs = total / result.delivered;
+        // Nearest rank
+        size_t median = (all.size() - 1) / 2;
+        std::nth_element(all.begin(), all.begin() + median, all.end());
+        result.p50LatencyMs = all[median];
+        size_t tail = static_cast<size_t>(std::ceil(all.size() * 0.99)) - 1;
+        std::nth_element(all.begin(), all.begin() + tail, all.end());
+        result.p99LatencyMs = all[tail];
+    }
+    if (result.seconds > 0)
+    {
+        result.deliveredPerSecond = result.delivered / result.seconds;
+    }
+    queryServerMode(*connections[0], result);
+
+    if (config.checkAllocations)
+    {
+        // The run above was the warm-up: the arena, the buffers and the socket windows have
+        // all grown to size, the same burst again should find everything in place
+        long long before = queryAllocations(*connections[0]);
+        if (before < 0)
+        {
+            throw std::runtime_error("The server doesn't count allocations, build it with CPPCHAT_COUNT_ALLOCATIONS");
+        }
+        std::vector<double> ignored;
+        relayBurst(ignored, ALLOCATION_CHECK_WINDOW);
+        long long after = queryAllocations(*connections[0]);
+        if (ignored.size() != static_cast<size_t>(config.messages) * (connections.size() - 1) || after < 0)
+        {
+            throw std::runtime_error("The allocation check's burst wasn't relayed in full");
+        }
+        result.allocations = after - before;
+    }
+    return result;
+}
+
+unsigned long long Benchmark::relayBurst(std::vector<double>& all, int window)
+{
+    // With a window, no more than that many messages are sent ahead of the slowest receiver
+    std::vector<std::vector<double>> latencies(connections.size() - 1);
+    unsigned long long receivers = connections.size() - 1;
+    delivered = 0;
+    std::vector<std::thread> receiving;
+    for (size_t i = 1; i < connections.size(); i++)
+    {
+        receiving.emplace_back(&Benchmark::receiveFanOut, this, connections[i].get(), std::ref(latencies[i - 1]));
+    }
+
+    // Pipelined: the sender never waits for its messages to come back
+    unsigned long long sent = 0;
+    std::string padding(static_cast<size_t>((std::max)(config.payloadSize, 0)), 'x');
+    auto start = std::chrono::steady_clock::now();
+    for (int sequence = 0; sequence < config.messages; sequence++)
+    {
+        if (config.messagesPerSecond > 0)
+        {
+            // The timestamp is taken after the wait, a late wakeup here isn't counted as latency
+            std::this_thread::sleep_until(start + std::chrono::nanoseconds(static_cast<long long>(sequence * 1e9 / config.messagesPerSecond)));
+        }
+        while (window > 0 && sequence >= window && delivered < (sequence - window + 1) * receivers)
+        {
+            std::this_thread::yield();
+        }
+        std::string message = "$chat " + std::to_string(sequence) + " " + std::to_string(nowNanoseconds()) + " " + padding;
+        uint32_t messageSize = static_cast<uint32_t>(message.size());
+        std::string frame(reinterpret_cast<const char*>(&messageSize), sizeof(messageSize));
+        frame += message;
+        if (!sendAll(*connections[0], frame.data(), static_cast<int>(frame.size())))
+        {
+            break;
+        }
+        sent++;
+    }
+    for (auto& receiver : receiving)
+    {
+        receiver.join();
+    }
+    for (const auto& samples : latencies)
+    {
+        all.insert(all.end(), samples.begin(), samples.end());
+    }
+    return sent;
+}
+
+Benchmark::Connection* Benchmark::connectAndRegister(const std::string& username)
+{
+    std::unique_ptr<Connection> connection(new Connection());
+    connection->socket = openSocket();
+    // Raw "SV_SUCCESS\0" on accept and raw "SV_SUCCESS" on register, as the server sends them
+    char reply[11];
+    std::string registerCommand = "$register " + username;
+    uint32_t commandSize = static_cast<uint32_t>(registerCommand.size());
+    std::string frame(reinterpret_cast<const char*>(&commandSize), sizeof(commandSize));
+    frame += registerCommand;
+    if (!receiveAll(*connection, reply, 11) || memcmp(reply + sizeof(uint32_t), "SV_FULL", 7) == 0
+        || (config.transport == "shm" && !attachShared(*connection))
+        || !sendAll(*connection, frame.data(), static_cast<int>(frame.size())) || !receiveAll(*connection, reply, 10))
+    {
+        closesocket(connection->socket);
+        throw std::runtime_error("Server refused connection " + username + ", is it started with enough --max-clients?");
+    }
+    // Stop waiting if the fan-out stalls
+    DWORD timeoutMs = 10000;
+    setsockopt(connection->socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeoutMs, sizeof(timeoutMs));
+    return connection.release();
+}
+
+SOCKET Benchmark::openSocket()
+{
+    bool local = config.transport == "local" || config.transport == "shm";
+    SOCKET socket = local ? ::socket(AF_UNIX, SOCK_STREAM, 0) : ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (socket == INVALID_SOCKET)
+    {
+        throw std::runtime_error("Failed to create socket: " + std::to_string(WSAGetLastError()));
+    }
+    int result = SOCKET_ERROR;
+    if (local)
+    {
+        std::string path = localSocketPath(config.port);
+        sockaddr_un serverAddress{};
+        serverAddress.sun_family = AF_UNIX;
+        memcpy(serverAddress.sun_path, path.c_str(), (std::min)(path.size(), sizeof(serverAddress.sun_path) - 1));
+        result = connect(socket, (SOCKADDR*)&serverAddress, sizeof(serverAddress));
+    }
+    else
+    {
+        sockaddr_in serverAddress{};
+        serverAddress.sin_family = AF_INET;
+        serverAddress.sin_addr.s_addr = inet_addr(config.serverIP.c_str());
+        serverAddress.sin_port = htons(static_cast<u_short>(atoi(config.port.c_str())));
+        result = connect(socket, (SOCKADDR*)&serverAddress, sizeof(serverAddress));
+    }
+    if (result == SOCKET_ERROR)
+    {
+        closesocket(socket);
+        throw std::runtime_error("Failed to connect to server: " + std::to_string(WSAGetLastError()));
+    }
+    return socket;
+}
+
+bool Benchmark::attachShared(Connection& connection)
+{
+    // Nothing else is going on before registration, the reply is the next frame
+    std::string reply;
+    if (!sendCommand(connection, "$shm attach") || !receiveFrame(connection, reply) || reply.find("SHM ") != 0)
+    {
+        return false;
+    }
+    connection.shared.reset(new SharedChannel());
+    connection.shared->setDoorbell(connection.socket);
+    return connection.shared->open(reply.substr(4));
+}
+
+void Benchmark::receiveFanOut(Connection* connection, std::vector<double>& latencies)
+{
+    // "\nCHAT (bench0): <sequence> <sent at> <padding>", anything else is presence traffic
+    const std::string marker = "CHAT (bench0): ";
+    latencies.reserve(static_cast<size_t>(config.messages));
+    std::string frame;
+    while (latencies.size() < static_cast<size_t>(config.messages) && receiveFrame(*connection, frame))
+    {
+        size_t position = frame.find(marker);
+        if (position == std::string::npos)
+        {
+            continue;
+        }
+        char* field = NULL;
+        std::strtoull(frame.c_str() + position + marker.size(), &field, 10);
+        long long sentAt = std::strtoll(field, NULL, 10);
+        latencies.push_back((nowNanoseconds() - sentAt) / 1e6);
+        delivered++;
+    }
+}
+
+void Benchmark::queryServerMode(Connection& connection, BenchmarkResult& result)
+{
+    result.serverEngine = "unknown";
+    if (!sendCommand(connection, "$stats"))
+    {
+        return;
+    }
+    // Skip the presence events queued up on the sender's connection
+    std::string reply;
+    while (receiveFrame(connection, reply))
+    {
+        if (reply.find("STATS") != 0)
+        {
+            continue;
+        }
+        size_t position = reply.find("io: engine=");
+        if (position != std::string::npos)
+        {
+            position += 11;
+            result.serverEngine = reply.substr(position, reply.find_first_of(" \n", position) - position);
+        }
+        position = reply.find("busy_poll: spin_us=");
+        if (position != std::string::npos)
+        {
+            result.serverSpinMicroseconds = atoi(reply.c_str() + position + 19);
+        }
+        return;
+    }
+}
+
+long long Benchmark::queryAllocations(Connection& connection)
+{
+    // "ALLOCATIONS <count>", or an error from a server that doesn't count them
+    if (!sendCommand(connection, "$allocations"))
+    {
+        return -1;
+    }
+    std::string reply;
+    while (receiveFrame(connection, reply))
+    {
+        if (reply.find("ALLOCATIONS ") == 0)
+        {
+            return std::strtoll(reply.c_str() + 12, NULL, 10);
+        }
+        if (reply.find("ERROR") == 0)
+        {
+            return -1;
+        }
+    }
+    return -1;
+}
+
+bool Benchmark::sendCommand(Connection& connection, const std::string& command)
+{
+    uint32_t commandSize = static_cast<uint32_t>(command.size());
+    std::string frame(reinterpret_cast<const char*>(&commandSize), sizeof(commandSize));
+    frame += command;
+    return sendAll(connection, frame.data(), static_cast<int>(frame.size()));
+}
+
+bool Benchmark::sendAll(Connection& connection, const char* data, int size)
+{
+    if (connection.shared)
+    {
+        return connection.shared->send(data, size);
+    }
+    while (size > 0)
+    {
+        int sent = send(connection.socket, data, size, 0);
+        if (sent == SOCKET_ERROR)
+        {
+            return false;
+        }
+        data += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+bool Benchmark::receiveAll(Connection& connection, char* data, int size)
+{
+    while (size > 0)
+    {
+        int received = 0;
+        if (connection.shared)
+        {
+            // Same 10 second give-up as the sockets
+            if (!connection.shared->hasData() && !connection.shared->waitForData(NULL, 10000))
+            {
+                return false;
+            }
+            received = static_cast<int>(connection.shared->receive(data, size));
+        }
+        else
+        {
+            received = recv(connection.socket, data, size, 0);
+        }
+        if (received <= 0)
+        {
+            return false;
+        }
+        data += received;
+        size -= received;
+    }
+    return true;
+}
+
+bool Benchmark::receiveFrame(Connection& connection, std::string& frame)
+{
+    uint32_t frameSize = 0;
+    if (!receiveAll(connection, reinterpret_cast<char*>(&frameSize), sizeof(frameSize)))
+    {
+        return false;
+    }
+    frame.resize(frameSize);
+    return frameSize == 0 || receiveAll(connection, &frame[0], static_cast<int>(frameSize));
+}
+
+std::string Benchmark::formatResult(const BenchmarkConfig& config, const BenchmarkResult& result)
+{
+    std::ostringstream out;
+    out << "engine=" << result.serverEngine
+        << " busy_poll_us=" << result.serverSpinMicroseconds
+        << " transport=" << config.transport
+        << " connections=" << config.connections
+        << " payload=" << config.payloadSize << "B"
+        << " rate=" << (config.messagesPerSecond > 0 ? std::to_string(config.messagesPerSecond) : std::string("max"))
+        << " sent=" << result.sent
+        << " delivered=" << result.delivered << "/" << result.sent * (config.connections - 1)
+        << " seconds=" << result.seconds
+        << " delivered_per_second=" << static_cast<unsigned long long>(result.deliveredPerSecond)
+        << " latency_mean_ms=" << result.meanLatencyMs
+        << " latency_p50_ms=" << result.p50LatencyMs
+        << " latency_p99_ms=" << result.p99LatencyMs
+        << " latency_max_ms=" << result.maxLatencyMs;
+    if (config.checkAllocations)
+    {
+        out << " server_allocations=" << result.allocations;
+    }
+    return out.str();
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <winsock2.h>
+#include "SharedChannel.h"
+
+#pragma comment(lib, "Ws2_32.lib")
+
+struct BenchmarkConfig {
+    std::string serverIP = "127.0.0.1";
+    std::string port = "5000";
+    int connections = 3;        // the first one sends, every other one receives the fan-out
+    int messages = 10000;
+    int payloadSize = 64;
+    int messagesPerSecond = 0;  // paced sending, 0 for back to back; latency then isn't queueing
+    std::string transport = "tcp";  // tcp, local (the server's local socket) or shm (shared memory over it)
+    bool checkAllocations = false;  // relay the burst a second time and count the server's allocations
+};
+
+struct BenchmarkResult {
+    double seconds = 0;
+    unsigned long long sent = 0;
+    unsigned long long delivered = 0;
+    double deliveredPerSecond = 0;
+    double meanLatencyMs = 0;
+    double maxLatencyMs = 0;
+    double p50LatencyMs = 0;
+    double p99LatencyMs = 0;
+    std::string serverEngine;
+    int serverSpinMicroseconds = 0;     // the server's busy poll budget, 0 when it parks right away
+    long long allocations = -1;         // server heap allocations during the checked burst, -1 if not counted
+};
+
+// Chat fan-out load generator. Drives one server over plain sockets, so the same run can
+// be repeated against each I/O engine on the same machine and compared. The server needs
+// room for every connection and no per-session rate limits, or those are what gets measured.
+// The transport can be switched too, to compare TCP with the same-host ones. Paced, the
+// percentiles show what a message waits for the server to wake up, with and without busy poll.
+// The allocation check relays the burst once more, with everything warmed up by the first one,
+// against a server built with CPPCHAT_COUNT_ALLOCATIONS: in steady state a relayed chat
+// message must cost it no heap allocation at all. Steady means no backlog anywhere, so that
+// burst keeps only a few messages in flight.
+class Benchmark {
+public:
+    Benchmark(const BenchmarkConfig& config);
+    ~Benchmark();
+    BenchmarkResult run();
+    static std::string formatResult(const BenchmarkConfig& config, const BenchmarkResult& result);
+private:
+    struct Connection {
+        SOCKET socket = INVALID_SOCKET;
+        std::unique_ptr<SharedChannel> shared;
+    };
+    Connection* connectAndRegister(const std::string& username);
+    SOCKET openSocket();
+    bool attachShared(Connection& connection);
+    unsigned long long relayBurst(std::vector<double>& latencies, int window);
+    void receiveFanOut(Connection* connection, std::vector<double>& latencies);
+    void queryServerMode(Connection& connection, BenchmarkResult& result);
+    long long queryAllocations(Connection& connection);
+    static bool sendAll(Connection& connection, const char* data, int size);
+    static bool receiveAll(Connection& connection, char* data, int size);
+    static bool receiveFrame(Connection& connection, std::string& frame);
+    static bool sendCommand(Connection& connection, const std::string& command);
+    BenchmarkConfig config;
+    std::vector<std::unique_ptr<Connection>> connections;
+    std::atomic<unsigned long long> delivered;     // by all receivers, in the current burst
+};
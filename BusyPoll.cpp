@@ -0,0 +1,95 @@
+#include "BusyPoll.h"
+
+#include <sstream>
+
+BusyPoll::BusyPoll() : pinned(false)
+{
+}
+
+void BusyPoll::configure(const BusyPollConfig& newConfig)
+{
+    config = newConfig;
+}
+
+bool BusyPoll::isEnabled() const
+{
+    return config.spinMicroseconds > 0;
+}
+
+bool BusyPoll::pinCurrentThread()
+{
+    if (config.cores.empty())
+    {
+        return true;
+    }
+    // One processor group only, which is every core on machines with up to 64
+    DWORD_PTR mask = 0;
+    for (int core : config.cores)
+    {
+        if (core < 0 || core >= static_cast<int>(sizeof(DWORD_PTR) * 8))
+        {
+            return false;
+        }
+        mask |= static_cast<DWORD_PTR>(1) << core;
+    }
+    pinned = SetThreadAffinityMask(GetCurrentThread(), mask) != 0;
+    return pinned;
+}
+
+bool BusyPoll::isSpinning(std::chrono::steady_clock::time_point now) const
+{
+    return isEnabled() && now - lastActive < std::chrono::microseconds(config.spinMicroseconds);
+}
+
+void BusyPoll::recordWait(bool polled, bool active, std::chrono::steady_clock::time_point now)
+{
+    if (polled)
+    {
+        stats.polls++;
+        stats.hits += active ? 1 : 0;
+    }
+    else
+    {
+        stats.parks++;
+    }
+    if (active)
+    {
+        lastActive = now;
+    }
+}
+
+void BusyPoll::applyTo(SOCKET socket) const
+{
+#ifdef SO_BUSY_POLL
+    if (isEnabled())
+    {
+        int spin = config.spinMicroseconds;
+        setsockopt(socket, SOL_SOCKET, SO_BUSY_POLL, (const char*)&spin, sizeof(spin));
+    }
+#else
+    (void)socket;
+#endif
+}
+
+const BusyPollStats& BusyPoll::getStats() const
+{
+    return stats;
+}
+
+std::string BusyPoll::report() const
+{
+    std::ostringstream out;
+    out << "spin_us=" << config.spinMicroseconds << " cores=";
+    if (!pinned)
+    {
+        out << "any";
+    }
+    for (size_t i = 0; pinned && i < config.cores.size(); i++)
+    {
+        out << (i > 0 ? "," : "") << config.cores[i];
+    }
+    out << " polls=" << stats.polls
+        << " hits=" << stats.hits
+        << " parks=" << stats.parks;
+    return out.str();
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include <winsock2.h>
+#include <windows.h>
+
+// Low-latency mode for the server loop. Off by default: the loop parks in select() or on the
+// completion event as soon as it runs out of work, and every message after a quiet spell pays
+// for a kernel wakeup. With a spin budget, the loop keeps polling without blocking for that long
+// after the last event (select() with a zero timeout, or dequeuing RIO completions with no
+// kernel transition at all) and only parks once the budget has passed with nothing to do.
+// That costs a core while traffic flows, so it goes with pinning the loop to a core of its own.
+struct BusyPollConfig {
+    int spinMicroseconds = 0;   // polling after the last event before parking, 0 to park at once
+    std::vector<int> cores;     // CPUs the loop thread may run on, empty for any
+};
+
+struct BusyPollStats {
+    unsigned long long polls = 0;   // waits that didn't block
+    unsigned long long hits = 0;    // of those, the ones that found work, each a wakeup saved
+    unsigned long long parks = 0;   // waits that blocked
+};
+
+class BusyPoll {
+public:
+    BusyPoll();
+    void configure(const BusyPollConfig& config);
+    bool isEnabled() const;
+    // Restricts the calling thread to the configured cores, false if that was refused
+    bool pinCurrentThread();
+    // Whether the next wait should only poll
+    bool isSpinning(std::chrono::steady_clock::time_point now) const;
+    void recordWait(bool polled, bool active, std::chrono::steady_clock::time_point now);
+    // SO_BUSY_POLL on stacks that have it, so the socket layer spins too; Winsock has no such option
+    void applyTo(SOCKET socket) const;
+    const BusyPollStats& getStats() const;
+    std::string report() const;
+private:
+    BusyPollConfig config;
+    BusyPollStats stats;
+    std::chrono::steady_clock::time_point lastActive;
+    bool pinned;
+};
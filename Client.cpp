@@ -6,6 +6,11 @@
 #include <iostream>
 #include <fstream>
 #include <vector>
+#include <sstream>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <afunix.h>
 
 #define _WINSOCK_DEPRECATED_NO_WARNINGS
 #pragma warning(disable: 4996)
@@ -46,6 +51,18 @@ Client::Client() : logFileName("client_log.txt")
     }
 
     connected = false;
+    rosterVersion = 0;
+    ownChangePending = false;
+    tlsEnabled = false;
+    tlsVerifyServer = true;
+    nextFileRef = 0;
+    nextRequestId = 0;
+    multicastSocket = INVALID_SOCKET;
+    multicastMemberId = 0;
+    multicastRunning = false;
+    hangUpEvent = WSA_INVALID_EVENT;
+    compressionWanted = true;
+    compressing = false;
 }
 
 Client::~Client() 
@@ -105,6 +122,20 @@ void Client::listenForUdpBroadcast()
     std::string receivedServerIP = broadcastMessage.substr(0, separatorPos);
     std::string receivedServerPort = broadcastMessage.substr(separatorPos + 1);
 
+    // A trailing ":tls" means the server only speaks TLS. Anyone can send a beacon, so one
+    // without it can't talk a client that was told to use TLS into plaintext.
+    size_t tlsPos = receivedServerPort.find(":tls");
+    if (tlsPos != std::string::npos)
+    {
+        receivedServerPort.erase(tlsPos);
+        tlsEnabled = true;
+    }
+    else if (tlsEnabled)
+    {
+        closesocket(udpClientSocket);
+        throw std::runtime_error("Server at " + receivedServerIP + ":" + receivedServerPort + " doesn't offer TLS, not connecting in plaintext");
+    }
+
     // Connect to the server using the received IP and port.
     connectToServer(receivedServerIP.c_str(), receivedServerPort.c_str());
     closesocket(udpClientSocket);
@@ -125,88 +156,337 @@ void Client::connectToServer(const char* serverIP, const char* port)
     }
 
     connected = true;
+    if (tlsEnabled)
+    {
+        performTlsHandshake(serverIP);
+    }
+    receiveGreeting();
+    if (compressionWanted && decompressor.isAvailable())
+    {
+        negotiateCompression();
+    }
 }
 
-void Client::registerUser(std::string username)
+void Client::connectLocal(const char* port, bool sharedMemory)
 {
-    if (!connected)
+    // The socket made by the constructor is TCP, this one goes to the server's socket file
+    closesocket(clientSocket);
+    clientSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (clientSocket == INVALID_SOCKET)
     {
-        throw std::runtime_error("Client is not connected to server");
+        throw std::runtime_error("Failed to create local socket: " + std::to_string(WSAGetLastError()));
     }
-
-    // Save the provided username.
-    this->username = username;
-
-    // Create the register command string.
-    std::string registerCommand = "$register " + username;
-
-    // Send the size of the command first.
-    int commandSize = static_cast<int>(registerCommand.length());
-    int result = send(clientSocket, reinterpret_cast<char*>(&commandSize), sizeof(commandSize), 0);
-    if (result == SOCKET_ERROR)
+    std::string path = localSocketPath(port);
+    sockaddr_un serverAddress{};
+    serverAddress.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(serverAddress.sun_path))
+    {
+        throw std::runtime_error("Local socket path is too long: " + path);
+    }
+    memcpy(serverAddress.sun_path, path.c_str(), path.size());
+    if (connect(clientSocket, (SOCKADDR*)&serverAddress, sizeof(serverAddress)) == SOCKET_ERROR)
+    {
+        throw std::runtime_error("Failed to connect to the local socket " + path + ": " + std::to_string(WSAGetLastError()));
+    }
+    connected = true;
+    receiveGreeting();
+    if (sharedMemory)
     {
-        throw std::runtime_error("Failed to send command size: " + std::to_string(WSAGetLastError()));
+        attachShared();
     }
+}
 
-    // Send the register command to the server.
-    result = send(clientSocket, registerCommand.c_str(), commandSize, 0);
-    if (result == SOCKET_ERROR)
+void Client::attachShared()
+{
+    // Nothing else is in flight yet, so the reply is the last frame that comes over the socket
+    std::string reply;
+    if (!sendFrame("$shm attach"))
+    {
+        closeConnection();
+        throw std::runtime_error("Failed to send command: " + std::to_string(WSAGetLastError()));
+    }
+    do
+    {
+        if (!receiveFrame(reply))
+        {
+            closeConnection();
+            throw std::runtime_error("The server closed the connection");
+        }
+    } while (reply.find("SHM ") != 0 && reply.find("ERROR ") != 0);
+    if (reply.find("ERROR ") == 0)
     {
-        throw std::runtime_error("Failed to send register command: " + std::to_string(WSAGetLastError()));
+        show("[Shared memory] " + reply.substr(6) + ", staying on the local socket\n");
+        return;
+    }
+    // The server writes to the rings from now on, there is no going back to the socket
+    std::unique_ptr<SharedChannel> channel(new SharedChannel());
+    hangUpEvent = WSACreateEvent();
+    if (!channel->open(reply.substr(4)) || WSAEventSelect(clientSocket, hangUpEvent, FD_CLOSE) == SOCKET_ERROR)
+    {
+        closeConnection();
+        throw std::runtime_error("Failed to open the server's shared memory: " + std::to_string(GetLastError()));
     }
+    channel->setDoorbell(clientSocket);
+    shared = std::move(channel);
+}
 
-    // Receive server response.
-    char responseBuffer[256];
-    result = recv(clientSocket, responseBuffer, sizeof(responseBuffer), 0);
-    if (result == SOCKET_ERROR)
+void Client::negotiateCompression()
+{
+    // Like $shm attach, nothing else is in flight yet. Not asked for over the local socket,
+    // where compressing would only cost time.
+    std::string reply;
+    if (!sendFrame("$compress " + std::string(COMPRESS_ALGORITHM_NAME)))
     {
-        throw std::runtime_error("Failed to receive server response: " + std::to_string(WSAGetLastError()));
+        closeConnection();
+        throw std::runtime_error("Failed to send command: " + std::to_string(WSAGetLastError()));
     }
+    do
+    {
+        if (!receiveFrame(reply))
+        {
+            closeConnection();
+            throw std::runtime_error("The server closed the connection");
+        }
+    } while (reply.find("COMPRESS ") != 0 && reply.find("ERROR ") != 0);
+    compressing = reply.find("COMPRESS " + std::string(COMPRESS_ALGORITHM_NAME)) == 0;
+}
 
-    // Check server response.
-    std::string response(responseBuffer, result);
-    std::string success = "SV_SUCCESS\0";
-    std::string serverFullMessage = "SV_FULL\0";
-    if (response.back() == '\n')
+void Client::setCompression(bool enabled)
+{
+    compressionWanted = enabled;
+}
+
+bool Client::isCompressing() const
+{
+    return compressing;
+}
+
+void Client::receiveGreeting()
+{
+    // The greeting is an unframed "SV_SUCCESS\0", or a framed SV_FULL; both are 11 bytes.
+    char greeting[11];
+    if (!receiveAll(greeting, sizeof(greeting)))
     {
-        response.pop_back();
+        closeConnection();
+        throw std::runtime_error("The server closed the connection, it may be full");
     }
-    if (response == "SV_FULL")
+    if (memcmp(greeting + sizeof(uint32_t), "SV_FULL", 7) == 0)
     {
         closeConnection();
         throw std::runtime_error("Server is full. Please try again later.");
     }
-    else if (response != success)
+    if (memcmp(greeting, "SV_SUCCESS", 10) != 0)
+    {
+        closeConnection();
+        throw std::runtime_error("Unexpected greeting from server");
+    }
+}
+
+void Client::enableTls(bool verifyServer)
+{
+    tlsEnabled = true;
+    tlsVerifyServer = verifyServer;
+}
+
+bool Client::isTlsEnabled() const
+{
+    return tlsEnabled;
+}
+
+void Client::performTlsHandshake(const char* serverName)
+{
+    // The server name is what the certificate is checked against, so it must appear in its subject or SAN.
+    tls.reset(new TlsChannel(TlsCredentials::forClient(tlsVerifyServer), serverName));
+    std::string toSend;
+    TlsResult result = tls->startHandshake(toSend);
+    char buffer[16 * 1024];
+    while (result == TLS_OK)
     {
-        bool areEqual = true;
-        bool serverFull = true;
-        for (size_t i = 0; i < response.length(); i++)//loop to fix the server success message because the server sends it with garbage at the end
+        if (!toSend.empty())
         {
-            if (response[i] != success[i])
+            if (send(clientSocket, toSend.data(), static_cast<int>(toSend.size()), 0) == SOCKET_ERROR)
             {
-                areEqual = false;
-                break;
+                throw std::runtime_error("Failed to send TLS handshake: " + std::to_string(WSAGetLastError()));
             }
+            toSend.clear();
         }
-        for (size_t i = 0; i < response.length(); i++)//loop to fix the server full message because the server sends it with garbage at the end
+        if (tls->isEstablished())
         {
-            if (response[i] != serverFullMessage[i])
+            return;
+        }
+        int nbytes = recv(clientSocket, buffer, sizeof(buffer), 0);
+        if (nbytes <= 0)
+        {
+            throw std::runtime_error("Connection closed during TLS handshake: " + std::to_string(WSAGetLastError()));
+        }
+        // Anything after the final handshake flight is already application data.
+        result = tls->receive(buffer, nbytes, toSend, tlsPlaintext);
+    }
+    closeConnection();
+    throw std::runtime_error(tlsVerifyServer
+        ? "TLS handshake failed. Is the server certificate trusted and issued for this address?"
+        : "TLS handshake failed");
+}
+
+int Client::transmit(const char* data, int size)
+{
+    if (shared)
+    {
+        return shared->send(data, size) ? size : SOCKET_ERROR;
+    }
+    if (!tls)
+    {
+        return send(clientSocket, data, size, 0);
+    }
+    std::string records;
+    if (!tls->encrypt(data, size, records))
+    {
+        return SOCKET_ERROR;
+    }
+    int result = send(clientSocket, records.data(), static_cast<int>(records.size()), 0);
+    return result == SOCKET_ERROR ? SOCKET_ERROR : size;
+}
+
+int Client::receiveSome(char* buffer, int size)
+{
+    if (shared)
+    {
+        // Until the server writes, or hangs up with nothing left in the ring
+        size_t count = 0;
+        while ((count = shared->receive(buffer, size)) == 0)
+        {
+            if (shared->hasFailed())
+            {
+                return SOCKET_ERROR;
+            }
+            WSANETWORKEVENTS events;
+            if (!shared->waitForData(hangUpEvent, INFINITE)
+                && WSAEnumNetworkEvents(clientSocket, hangUpEvent, &events) == 0 && (events.lNetworkEvents & FD_CLOSE))
             {
-                serverFull = false;
-                break;
+                return 0;
             }
         }
-        if (serverFull)
+        return static_cast<int>(count);
+    }
+    if (!tls)
+    {
+        return recv(clientSocket, buffer, size, 0);
+    }
+    // Decrypt until there is plaintext to hand out.
+    char cipher[16 * 1024];
+    while (tlsPlaintext.empty())
+    {
+        int nbytes = recv(clientSocket, cipher, sizeof(cipher), 0);
+        if (nbytes <= 0)
+        {
+            return nbytes;
+        }
+        std::string toSend;
+        TlsResult result = tls->receive(cipher, nbytes, toSend, tlsPlaintext);
+        if (!toSend.empty())
         {
-			closeConnection();
-			throw std::runtime_error("Server is full. Please try again later.");
-		}
-        else if (!areEqual)
+            send(clientSocket, toSend.data(), static_cast<int>(toSend.size()), 0);
+        }
+        if (result == TLS_CLOSED && tlsPlaintext.empty())
         {
-            throw std::runtime_error("Failed to register user: " + response);
+            return 0;
+        }
+        if (result == TLS_FAILED)
+        {
+            return SOCKET_ERROR;
         }
     }
+    int count = (std::min)(size, static_cast<int>(tlsPlaintext.size()));
+    memcpy(buffer, tlsPlaintext.data(), count);
+    tlsPlaintext.erase(0, count);
+    return count;
+}
 
+bool Client::waitReadable(int timeoutMs)
+{
+    if (shared)
+    {
+        if (shared->hasData() || shared->waitForData(hangUpEvent, static_cast<DWORD>(timeoutMs)))
+        {
+            return true;
+        }
+        // Woken by the hang-up rather than the timeout: let the read find it closed
+        WSANETWORKEVENTS events;
+        if (WSAEnumNetworkEvents(clientSocket, hangUpEvent, &events) == 0 && (events.lNetworkEvents & FD_CLOSE))
+        {
+            failPendingRequests();
+            throw std::runtime_error("Failed to receive message: connection closed");
+        }
+        return false;
+    }
+    if (!tlsPlaintext.empty())
+    {
+        return true;
+    }
+    fd_set readable;
+    FD_ZERO(&readable);
+    FD_SET(clientSocket, &readable);
+    timeval timeout = { timeoutMs / 1000, (timeoutMs % 1000) * 1000 };
+    return select(static_cast<int>(clientSocket) + 1, &readable, NULL, NULL, &timeout) > 0;
+}
+
+bool Client::receiveAll(char* buffer, int size)
+{
+    // TLS records (and TCP segments) can split a frame anywhere.
+    int received = 0;
+    while (received < size)
+    {
+        int nbytes = receiveSome(buffer + received, size - received);
+        if (nbytes <= 0)
+        {
+            return false;
+        }
+        received += nbytes;
+    }
+    return true;
+}
+
+void Client::registerUser(std::string username)
+{
+    if (!connected)
+    {
+        throw std::runtime_error("Client is not connected to server");
+    }
+
+    // Save the provided username.
+    std::string previousName = this->username;
+    this->username = username;
+
+    // Sent tagged, so the answer is an ordinary frame carrying our id. Nothing else reads
+    // the socket before registration, so frames are read here until it arrives.
+    std::future<RequestReply> pending = request("$register " + username);
+    std::string frame;
+    while (pending.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+    {
+        if (!receiveFrame(frame))
+        {
+            failPendingRequests();
+            throw std::runtime_error("Failed to receive server response: " + std::to_string(WSAGetLastError()));
+        }
+        completeRequest(frame);
+    }
+
+    // Check server response.
+    RequestReply reply = pending.get();
+    if (reply.kind == "SV_FULL")
+    {
+        closeConnection();
+        throw std::runtime_error("Server is full. Please try again later.");
+    }
+    else if (reply.kind != "SV_SUCCESS")
+    {
+        throw std::runtime_error("Failed to register user: " + reply.body);
+    }
+    expectOwnChange(previousName, username);
+
+    // PRESENCE events only apply on top of a known version, so start from a snapshot; the
+    // receiver thread applies the answer
+    requestList();
 }
 
 void Client::executeCommand(std::string command) 
@@ -216,21 +496,47 @@ void Client::executeCommand(std::string command)
         throw std::runtime_error("Client is not connected to server");
     }
 
-    // Send command size to server first
-    int commandSize = static_cast<int>(command.length());
-    int result = send(clientSocket, reinterpret_cast<char*>(&commandSize), sizeof(commandSize), 0);
-    if (result == SOCKET_ERROR)
+    // A new name is answered with a tagged reply, which the receiver thread matches to it
+    if (command.find("$register ") == 0)
+    {
+        std::string newName = command.substr(10);
+        request(command, [this, newName](const RequestReply& reply)
+            {
+                if (reply.kind == "SV_SUCCESS")
+                {
+                    expectOwnChange(username, newName);
+                    username = newName;
+                }
+                show((reply.kind == "SV_SUCCESS" ? "[Registered] " + newName : "[Not registered] " + reply.kind + " " + reply.body) + "\n");
+            });
+        show("[Executed] " + command + "\n");
+        return;
+    }
+
+    // Chat moves to the multicast group once the server has answered with its address
+    if (command == "$multicast" || command == "$multicast join")
     {
-        throw std::runtime_error("Failed to send command size: " + std::to_string(WSAGetLastError()));
+        joinMulticast();
+        show("[Executed] " + command + "\n");
+        return;
+    }
+    if (command == "$multicast leave")
+    {
+        stopMulticast();
+    }
+
+    // Ask only for the roster changes we haven't seen yet
+    if (command == "$getlist" && rosterVersion != 0)
+    {
+        command += " " + std::to_string(rosterVersion);
     }
 
-    // Send command to server
-    result = send(clientSocket, command.c_str(), commandSize, 0);
-    if (result == SOCKET_ERROR)
+    // Send command size and command to server
+    if (!sendFrame(command))
     {
         throw std::runtime_error("Failed to send command: " + std::to_string(WSAGetLastError()));
     }
-    std::cout << "[Executed] " << command << std::endl;
+    show("[Executed] " + command + "\n");
 }
 
 void Client::sendMessage(std::string message) 
@@ -242,21 +548,12 @@ void Client::sendMessage(std::string message)
 
     std::string chatCommand = "$chat " + message;
 
-    // Send message size to server first
-    int messageSize = static_cast<int>(chatCommand.length());
-    int result = send(clientSocket, reinterpret_cast<char*>(&messageSize), sizeof(messageSize), 0);
-    if (result == SOCKET_ERROR)
-    {
-        throw std::runtime_error("Failed to send message size: " + std::to_string(WSAGetLastError()));
-    }
-
-    // Send message to server
-    result = send(clientSocket, chatCommand.c_str(), messageSize, 0);
-    if (result == SOCKET_ERROR)
+    // Send message size and message to server
+    if (!sendFrame(chatCommand))
     {
         throw std::runtime_error("Failed to send chat message: " + std::to_string(WSAGetLastError()));
     }
-    std::cout<<"[Sent out] " << message << std::endl;
+    show("[Sent out] " + message + "\n");
 }
 
 void Client::closeConnection() 
@@ -265,18 +562,59 @@ void Client::closeConnection()
     {
         return;
     }
-    // Shutdown the connection.
+    stopFileTransfers();
+    stopMulticast();
+    failPendingRequests();
+    // Say goodbye at the TLS level first, then shutdown the connection.
+    if (tls)
+    {
+        std::string closeNotify;
+        tls->close(closeNotify);
+        send(clientSocket, closeNotify.data(), static_cast<int>(closeNotify.size()), 0);
+    }
     int result = shutdown(clientSocket, SD_SEND);
     if (result == SOCKET_ERROR) 
     {
         throw std::runtime_error("Failed to shutdown connection: " + std::to_string(WSAGetLastError()));
     }
-    std::cout << "\nDisconnected\n";
+    show("\nDisconnected\n");
     closesocket(clientSocket);
     connected = false;
+    shared.reset();
+    if (hangUpEvent != WSA_INVALID_EVENT)
+    {
+        WSACloseEvent(hangUpEvent);
+        hangUpEvent = WSA_INVALID_EVENT;
+    }
 }
 
-std::string Client::receiveMessage(bool& flag)
+void Client::setDisplay(std::function<void(std::string)> callback)
+{
+    displayCallback = std::move(callback);
+}
+
+void Client::show(std::string text)
+{
+    if (displayCallback)
+    {
+        displayCallback(std::move(text));
+    }
+    else
+    {
+        std::cout << text << std::flush;
+    }
+}
+
+std::string Client::poll(int timeoutMs, std::atomic<bool>& flag)
+{
+    if (!connected)
+    {
+        throw std::runtime_error("Client is not connected to server");
+    }
+    return waitReadable(timeoutMs) ? receiveMessage(flag) : std::string();
+}
+
+std::string Client::receiveMessage(std::atomic<bool>& flag)
 {
     if (!connected)
     {
@@ -285,37 +623,92 @@ std::string Client::receiveMessage(bool& flag)
 
     while (true)
     {
-        // Receive the size of the incoming message first.
-        int messageSize = 0;
-        int nbytes = recv(clientSocket, reinterpret_cast<char*>(&messageSize), sizeof(messageSize), 0);
-        if (nbytes <= 0)
+        // Receive the next size-prefixed message.
+        std::string message;
+        if (!receiveFrame(message))
         {
-            throw std::runtime_error("Failed to receive message size: " + std::to_string(WSAGetLastError()));
+            failPendingRequests();
+            throw std::runtime_error("Failed to receive message: " + std::to_string(WSAGetLastError()));
         }
 
-        // Allocate a buffer of the appropriate size to receive the message.
-        char* buffer = new char[messageSize];
-        nbytes = recv(clientSocket, buffer, messageSize, 0);
-        if (nbytes <= 0)
+        // Replies to pipelined requests go to whoever asked, not to the screen
+        if (completeRequest(message))
         {
-            delete[] buffer;
-            throw std::runtime_error("Failed to receive message: " + std::to_string(WSAGetLastError()));
+            return "";
         }
-
-        // Convert the received message to a string and return it if valid.
-        std::string message(buffer, messageSize);
-        delete[] buffer;
         if (message.find("SV_SUCCESS") == 0 || message.find("SV_FULL") == 0)
         {
-            return message;
+            return message + "\n";
         }
-        else if (message.find("CHAT") == 0)
-        {   // If the message is a chat message, print it to the console. And delete the current line
-            return ("\033[2K\r" + message + "\nEnter command or message: ");
+        else if (message.find("CHAT") == 0 || message.find("\nCHAT") == 0)
+        {   // If the message is a chat message, print it to the console; $chat relays start with a line break of their own
+            return message.substr(message[0] == '\n' ? 1 : 0) + "\n";
         }
         else if (message.find("LIST") == 0)
         {
-            return ("\033[2K\r" + message.substr(5) + "\nEnter command or message: ");
+            applyListReply(message);
+            return formatRoster() + "\n";
+        }
+        else if (message.find("PRESENCE") == 0)
+        {
+            // PRESENCE <version> <change>; only applied if it follows our version, otherwise
+            // the next $getlist fills the gap with a delta.
+            char* change = NULL;
+            uint64_t version = std::strtoull(message.c_str() + 9, &change, 10);
+            PresenceEvent event;
+            if (!Roster::decodeChange(change, event))
+            {
+                return "";
+            }
+            if (rosterVersion != 0 && version == rosterVersion + 1)
+            {
+                applyPresenceChange(event);
+                rosterVersion = version;
+            }
+            // Our own join or rename comes back too, only to keep the version in step
+            if (ownChangePending && event.type == ownChange.type && event.name == ownChange.name
+                && event.previousName == ownChange.previousName)
+            {
+                ownChangePending = false;
+                return "";
+            }
+            std::string notice;
+            if (event.type == PRESENCE_JOIN)
+            {
+                notice = "* " + event.name + " joined";
+            }
+            else if (event.type == PRESENCE_LEAVE)
+            {
+                notice = "* " + event.name + " left";
+            }
+            else
+            {
+                notice = "* " + event.previousName + " is now known as " + event.name;
+            }
+            return notice + "\n";
+        }
+        else if (message.find("REPAIR") == 0)
+        {
+            return handleRepair(message);
+        }
+        else if (message.find("FILE") == 0)
+        {
+            return handleFileMessage(message);
+        }
+        else if (message.find("ERROR") == 0)
+        {
+            return "[Server error] " + message.substr(6) + "\n";
+        }
+        else if (message.find("STATS") == 0)
+        {
+            return message.substr(6) + "\n";
+        }
+        else if (message.find("LOG+ ") == 0)
+        {
+            // A long log comes in parts, each picks up where the one before stopped
+            std::ofstream logFile(logFileName, std::ios::app);
+            logFile << message.substr(5);
+            return message.substr(5);
         }
         else if (message.find("LOG") == 0)
         {
@@ -323,20 +716,20 @@ std::string Client::receiveMessage(bool& flag)
             std::ofstream logFile(logFileName, std::ios::app);
             if (!logFile.good()) {
                 std::cerr << "Error opening log file." << std::endl;
-                return "Error opening file\nEnter command or message: ";
+                return "Error opening file\n";
             }
             logFile << message.substr(4) << std::endl;
-            return ("\033[2K\r" + message.substr(4) + "\nEnter command or message: ");
+            return message.substr(4) + "\n";
         }
         else if (message.find("EXIT") == 0)
         {
             flag = true;
-            return ("\033[2K\r" + message.substr(5));
+            return message.substr(5) + "\n";
         }
         else if (message.find("SV_FULL") == 0)
         {
             flag = true;
-            return "Server is currently full";
+            return "Server is currently full\n";
         }
         else
         {
@@ -349,6 +742,618 @@ std::string Client::receiveMessage(bool& flag)
 
 
 
+bool RequestReply::succeeded() const
+{
+    return kind != "ERROR" && kind != "SV_FULL" && kind != "DISCONNECTED";
+}
+
+uint64_t Client::request(const std::string& command, ReplyCallback callback)
+{
+    if (!connected)
+    {
+        throw std::runtime_error("Client is not connected to server");
+    }
+    uint64_t id = 0;
+    {
+        // In the map before it is sent, so the reply can't arrive first
+        std::lock_guard<std::mutex> lock(requestMutex);
+        id = ++nextRequestId;
+        pendingRequests[id] = std::move(callback);
+    }
+    if (!sendFrame("@" + std::to_string(id) + " " + command))
+    {
+        std::lock_guard<std::mutex> lock(requestMutex);
+        pendingRequests.erase(id);
+        throw std::runtime_error("Failed to send request: " + std::to_string(WSAGetLastError()));
+    }
+    return id;
+}
+
+std::future<RequestReply> Client::request(const std::string& command)
+{
+    std::shared_ptr<std::promise<RequestReply>> promise = std::make_shared<std::promise<RequestReply>>();
+    std::future<RequestReply> future = promise->get_future();
+    request(command, [promise](const RequestReply& reply) { promise->set_value(reply); });
+    return future;
+}
+
+std::future<RequestReply> Client::requestList(uint64_t knownVersion)
+{
+    return request(knownVersion == 0 ? std::string("$getlist") : "$getlist " + std::to_string(knownVersion));
+}
+
+std::future<RequestReply> Client::requestLog()
+{
+    return request("$getlog");
+}
+
+std::future<RequestReply> Client::sendMessageAsync(const std::string& message)
+{
+    return request("$chat " + message);
+}
+
+size_t Client::getPendingRequests() const
+{
+    std::lock_guard<std::mutex> lock(requestMutex);
+    return pendingRequests.size();
+}
+
+bool Client::completeRequest(const std::string& frame)
+{
+    // "@<id> <reply>"; anything else is an event or an untagged reply
+    if (frame.size() < 3 || frame[0] != '@')
+    {
+        return false;
+    }
+    char* end = NULL;
+    uint64_t id = std::strtoull(frame.c_str() + 1, &end, 10);
+    if (end == frame.c_str() + 1 || *end != ' ')
+    {
+        return false;
+    }
+    ReplyCallback callback;
+    std::string parts;
+    {
+        std::lock_guard<std::mutex> lock(requestMutex);
+        auto it = pendingRequests.find(id);
+        if (it == pendingRequests.end())
+        {
+            return true;
+        }
+        if (frame.compare(end + 1 - frame.c_str(), 5, "LOG+ ") == 0)
+        {
+            // Not the answer yet, the log goes on in the next part
+            partialReplies[id].append(frame, end + 6 - frame.c_str(), std::string::npos);
+            return true;
+        }
+        callback = std::move(it->second);
+        pendingRequests.erase(it);
+        auto partial = partialReplies.find(id);
+        if (partial != partialReplies.end())
+        {
+            parts.swap(partial->second);
+            partialReplies.erase(partial);
+        }
+    }
+    std::string message(end + 1);
+    if (!parts.empty() && message.find("LOG ") == 0)
+    {
+        message.insert(4, parts);
+    }
+    size_t kindEnd = message.find_first_of(" \n");
+    RequestReply reply;
+    reply.id = id;
+    reply.kind = message.substr(0, kindEnd);
+    reply.body = kindEnd == std::string::npos ? "" : message.substr(kindEnd + 1);
+    if (reply.kind == "LIST")
+    {
+        applyListReply(message);
+    }
+    // Outside the lock, a callback may well send the next request
+    if (callback)
+    {
+        callback(reply);
+    }
+    return true;
+}
+
+void Client::failPendingRequests()
+{
+    std::map<uint64_t, ReplyCallback> failed;
+    {
+        std::lock_guard<std::mutex> lock(requestMutex);
+        failed.swap(pendingRequests);
+        partialReplies.clear();
+    }
+    for (auto& pending : failed)
+    {
+        RequestReply reply;
+        reply.id = pending.first;
+        reply.kind = "DISCONNECTED";
+        if (pending.second)
+        {
+            pending.second(reply);
+        }
+    }
+}
+
+bool Client::receiveFrame(std::string& frame)
+{
+    uint32_t frameSize = 0;
+    if (!receiveAll(reinterpret_cast<char*>(&frameSize), sizeof(frameSize)))
+    {
+        return false;
+    }
+    frame.resize(frameSize);
+    if (frameSize != 0 && !receiveAll(&frame[0], static_cast<int>(frameSize)))
+    {
+        return false;
+    }
+    // A corrupt compressed frame leaves the stream unusable, like a lost connection
+    return !compressing || !FrameDecompressor::isCompressed(frame) || decompressor.expand(frame);
+}
+
+void Client::applyListReply(const std::string& message)
+{
+    // LIST <version> SNAPSHOT|DELTA, followed by one name or change per line
+    std::istringstream reply(message.substr(5));
+    uint64_t version = 0;
+    std::string kind;
+    std::string line;
+    reply >> version >> kind;
+    std::getline(reply, line);
+    if (kind == "SNAPSHOT")
+    {
+        roster.clear();
+    }
+    while (std::getline(reply, line))
+    {
+        PresenceEvent event;
+        if (kind == "SNAPSHOT")
+        {
+            roster[line]++;
+        }
+        else if (Roster::decodeChange(line, event))
+        {
+            applyPresenceChange(event);
+        }
+    }
+    rosterVersion = version;
+}
+
+void Client::joinMulticast()
+{
+    // The reply comes in on the receiver thread, which starts listening to the group
+    request("$multicast join", [this](const RequestReply& reply)
+        {
+            if (reply.kind == "MULTICAST")
+            {
+                startMulticast(reply.body);
+            }
+            else
+            {
+                show("[Multicast] Not available: " + reply.body + "\n");
+            }
+        });
+}
+
+void Client::startMulticast(const std::string& description)
+{
+    // "<group> <port> <next sequence> <member id>"
+    std::istringstream fields(description);
+    std::string group;
+    u_short port = 0;
+    uint64_t nextSequence = 0;
+    uint32_t memberId = 0;
+    fields >> group >> port >> nextSequence >> memberId;
+    std::lock_guard<std::mutex> lock(multicastMutex);
+    if (multicastRunning || !fields)
+    {
+        return;
+    }
+
+    // Several clients on one machine share the port; the group is joined on the interface
+    // our TCP connection uses, which is the one the server multicasts on.
+    SOCKET socket = ::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    BOOL reuse = TRUE;
+    DWORD timeoutMs = MULTICAST_NACK_RETRY_MS;
+    sockaddr_in local{};
+    int localSize = sizeof(local);
+    getsockname(clientSocket, (sockaddr*)&local, &localSize);
+    ip_mreq membership{};
+    inet_pton(AF_INET, group.c_str(), &membership.imr_multiaddr);
+    membership.imr_interface.s_addr = local.sin_family == AF_INET ? local.sin_addr.s_addr : htonl(INADDR_ANY);
+    sockaddr_in bindAddress{};
+    bindAddress.sin_family = AF_INET;
+    bindAddress.sin_addr.s_addr = htonl(INADDR_ANY);
+    bindAddress.sin_port = htons(port);
+    if (socket == INVALID_SOCKET
+        || setsockopt(socket, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse)) == SOCKET_ERROR
+        || bind(socket, (sockaddr*)&bindAddress, sizeof(bindAddress)) == SOCKET_ERROR
+        || setsockopt(socket, IPPROTO_IP, IP_ADD_MEMBERSHIP, (const char*)&membership, sizeof(membership)) == SOCKET_ERROR
+        || setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeoutMs, sizeof(timeoutMs)) == SOCKET_ERROR)
+    {
+        show("[Multicast] Can't join " + group + ":" + std::to_string(port) + " (" + std::to_string(WSAGetLastError()) + ")\n");
+        if (socket != INVALID_SOCKET)
+        {
+            closesocket(socket);
+        }
+        sendFrame("$multicast leave");
+        return;
+    }
+    multicastSocket = socket;
+    multicastMemberId = memberId;
+    sequencer.start(nextSequence);
+    multicastRunning = true;
+    multicastThread = std::thread(&Client::receiveMulticast, this);
+    show("[Multicast] Chat now comes from " + group + ":" + std::to_string(port) + "\n");
+}
+
+void Client::receiveMulticast()
+{
+    std::vector<char> datagram(MULTICAST_MAX_DATAGRAM_SIZE);
+    std::vector<MulticastSequencer::Message> messages;
+    std::vector<MulticastSequencer::Message> deliver;
+    while (multicastRunning)
+    {
+        // Times out now and then, so holes that stay open are asked for again
+        int size = recv(multicastSocket, datagram.data(), static_cast<int>(datagram.size()), 0);
+        uint64_t firstSequence = 0;
+        messages.clear();
+        deliver.clear();
+        std::string display;
+        {
+            std::lock_guard<std::mutex> lock(multicastMutex);
+            if (size > 0 && MulticastSequencer::parseDatagram(datagram.data(), size, firstSequence, messages))
+            {
+                if (messages.empty())
+                {
+                    sequencer.heartbeat(firstSequence);
+                }
+                for (auto& message : messages)
+                {
+                    sequencer.receive(message.sequence, message.origin, std::move(message.text), deliver);
+                }
+                display = deliverMulticast(deliver);
+            }
+        }
+        if (!display.empty())
+        {
+            show(display);
+        }
+        requestRepairs();
+    }
+}
+
+std::string Client::deliverMulticast(const std::vector<MulticastSequencer::Message>& messages)
+{
+    // Same rules as chat over TCP, and our own messages aren't echoed back to us
+    std::string display;
+    for (const auto& message : messages)
+    {
+        if (message.origin != multicastMemberId && (message.text.find("CHAT") == 0 || message.text.find("\nCHAT") == 0))
+        {
+            display += message.text.substr(message.text[0] == '\n' ? 1 : 0) + "\n";
+        }
+    }
+    return display;
+}
+
+void Client::requestRepairs()
+{
+    uint64_t from = 0;
+    uint64_t to = 0;
+    bool missing = false;
+    {
+        std::lock_guard<std::mutex> lock(multicastMutex);
+        missing = multicastRunning && sequencer.takeNack(std::chrono::steady_clock::now(), from, to);
+    }
+    if (missing)
+    {
+        sendFrame("$nack " + std::to_string(from) + " " + std::to_string(to));
+    }
+}
+
+std::string Client::handleRepair(const std::string& message)
+{
+    // "REPAIR <sequence> <origin>\n<message>" or "REPAIR_LOST <from> <to>"
+    std::vector<MulticastSequencer::Message> deliver;
+    std::string display;
+    {
+        std::lock_guard<std::mutex> lock(multicastMutex);
+        size_t headerEnd = message.find('\n');
+        std::istringstream header(message.substr(0, headerEnd));
+        std::string kind;
+        uint64_t first = 0;
+        uint64_t second = 0;
+        header >> kind >> first >> second;
+        if (kind == "REPAIR_LOST")
+        {
+            sequencer.skip(first, second, deliver);
+        }
+        else if (kind == "REPAIR" && headerEnd != std::string::npos)
+        {
+            sequencer.receive(first, static_cast<uint32_t>(second), message.substr(headerEnd + 1), deliver);
+        }
+        display = deliverMulticast(deliver);
+    }
+    requestRepairs();
+    return display;
+}
+
+void Client::stopMulticast()
+{
+    {
+        std::lock_guard<std::mutex> lock(multicastMutex);
+        if (!multicastRunning)
+        {
+            return;
+        }
+        multicastRunning = false;
+    }
+    multicastThread.join();
+    closesocket(multicastSocket);
+    multicastSocket = INVALID_SOCKET;
+}
+
+bool Client::sendFrame(const std::string& header, const char* body, size_t bodySize)
+{
+    // Header and payload leave in one piece, whichever thread is sending.
+    uint32_t frameSize = static_cast<uint32_t>(header.size() + bodySize);
+    std::string frame(reinterpret_cast<const char*>(&frameSize), sizeof(frameSize));
+    frame.reserve(sizeof(frameSize) + frameSize);
+    frame += header;
+    frame.append(body, bodySize);
+    std::lock_guard<std::mutex> lock(sendMutex);
+    return transmit(frame.data(), static_cast<int>(frame.size())) != SOCKET_ERROR;
+}
+
+void Client::sendFile(const std::string& target, const std::string& path)
+{
+    if (!connected)
+    {
+        throw std::runtime_error("Client is not connected to server");
+    }
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file.good())
+    {
+        throw std::runtime_error("Can't open " + path);
+    }
+    uint64_t size = static_cast<uint64_t>(file.tellg());
+    std::string name = path.substr(path.find_last_of("/\\") + 1);
+
+    // Collect transfers that are over before starting another one
+    std::vector<std::unique_ptr<OutgoingFile>> finished;
+    std::unique_lock<std::mutex> lock(transferMutex);
+    for (auto it = outgoingFiles.begin(); it != outgoingFiles.end();)
+    {
+        if (it->second->finished)
+        {
+            finished.push_back(std::move(it->second));
+            it = outgoingFiles.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+    std::unique_ptr<OutgoingFile> transfer(new OutgoingFile());
+    transfer->ref = ++nextFileRef;
+    transfer->path = path;
+    transfer->size = size;
+    OutgoingFile* outgoing = transfer.get();
+    outgoingFiles[transfer->ref] = std::move(transfer);
+    if (!sendFrame("$file offer " + std::to_string(outgoing->ref) + " " + target + " " + std::to_string(size) + " " + name))
+    {
+        outgoingFiles.erase(outgoing->ref);
+        throw std::runtime_error("Failed to offer file: " + std::to_string(WSAGetLastError()));
+    }
+    outgoing->worker = std::thread(&Client::streamFile, this, outgoing);
+    lock.unlock();
+    for (auto& done : finished)
+    {
+        done->worker.join();
+    }
+    show("[Offered] " + name + " (" + std::to_string(size) + " bytes) to " + target + "\n");
+}
+
+void Client::streamFile(OutgoingFile* transfer)
+{
+    // Reads and sends one chunk at a time, only as far as the receivers have granted.
+    std::ifstream file(transfer->path, std::ios::binary);
+    std::vector<char> chunk(FILE_CHUNK_SIZE);
+    std::unique_lock<std::mutex> lock(transferMutex);
+    transferSignal.wait(lock, [&]() { return transfer->started || transfer->finished; });
+    uint64_t offset = transfer->offset;
+    while (true)
+    {
+        transferSignal.wait(lock, [&]() { return transfer->finished || offset < transfer->limit; });
+        if (transfer->finished)
+        {
+            break;
+        }
+        uint64_t end = (std::min)((std::min)(transfer->limit, transfer->size), offset + FILE_CHUNK_SIZE);
+        lock.unlock();
+
+        // Chat typed meanwhile goes out between two chunks
+        size_t count = static_cast<size_t>(end - offset);
+        file.seekg(static_cast<std::streamoff>(offset));
+        file.read(chunk.data(), count);
+        bool sent = static_cast<size_t>(file.gcount()) == count
+            && sendFrame("$file chunk " + std::to_string(transfer->ref) + " " + std::to_string(offset) + "\n", chunk.data(), count);
+        lock.lock();
+        if (!sent)
+        {
+            // The file changed under us or the connection is gone
+            sendFrame("$file cancel " + std::to_string(transfer->ref));
+            transfer->finished = true;
+            show("[File] Sending " + transfer->path + " failed\n");
+            break;
+        }
+        offset = end;
+    }
+}
+
+void Client::acceptFile(uint32_t id)
+{
+    std::lock_guard<std::mutex> lock(transferMutex);
+    auto it = incomingFiles.find(id);
+    if (it == incomingFiles.end() || it->second.accepted)
+    {
+        throw std::runtime_error("No pending file offer " + std::to_string(id));
+    }
+    IncomingFile& incoming = it->second;
+    std::string path = "received_" + incoming.name;
+
+    // A partial file from an earlier attempt is resumed where it stopped
+    std::ifstream existing(path, std::ios::binary | std::ios::ate);
+    uint64_t have = existing.good() ? static_cast<uint64_t>(existing.tellg()) : 0;
+    existing.close();
+    if (have > incoming.size)
+    {
+        have = 0;
+    }
+    incoming.file.open(path, std::ios::binary | std::ios::in | std::ios::out | (have == 0 ? std::ios::trunc : std::ios::openmode()));
+    if (!incoming.file.is_open())
+    {
+        throw std::runtime_error("Can't write " + path);
+    }
+    incoming.accepted = true;
+    incoming.written = have;
+    incoming.granted = (std::min)(incoming.size, have + FILE_RECEIVE_WINDOW);
+    sendFrame("$file accept " + std::to_string(id) + " " + std::to_string(have) + " " + std::to_string(incoming.granted));
+    show("[Accepted] " + incoming.name + (have > 0 ? ", resuming at byte " + std::to_string(have) : "") + "\n");
+}
+
+void Client::declineFile(uint32_t id)
+{
+    std::lock_guard<std::mutex> lock(transferMutex);
+    if (incomingFiles.erase(id) == 0)
+    {
+        throw std::runtime_error("No pending file offer " + std::to_string(id));
+    }
+    sendFrame("$file decline " + std::to_string(id));
+}
+
+std::string Client::handleFileMessage(const std::string& message)
+{
+    size_t headerEnd = message.find('\n');
+    std::istringstream header(message.substr(0, headerEnd));
+    std::string prefix;
+    std::string kind;
+    uint32_t id = 0;
+    header >> prefix >> kind >> id;
+    std::string notice;
+
+    std::lock_guard<std::mutex> lock(transferMutex);
+    if (kind == "CHUNK")
+    {
+        uint64_t offset = 0;
+        header >> offset;
+        auto it = incomingFiles.find(id);
+        if (it == incomingFiles.end() || !it->second.accepted || headerEnd == std::string::npos)
+        {
+            return "";
+        }
+        // Written straight to disk, then more credit once half the window is used
+        IncomingFile& incoming = it->second;
+        size_t count = message.size() - headerEnd - 1;
+        incoming.file.seekp(static_cast<std::streamoff>(offset));
+        incoming.file.write(message.data() + headerEnd + 1, count);
+        incoming.written = (std::max)(incoming.written, offset + count);
+        if (incoming.granted < incoming.size && incoming.written + FILE_RECEIVE_WINDOW / 2 > incoming.granted)
+        {
+            incoming.granted = (std::min)(incoming.size, incoming.written + FILE_RECEIVE_WINDOW);
+            sendFrame("$file window " + std::to_string(id) + " " + std::to_string(incoming.granted));
+        }
+        return "";
+    }
+    else if (kind == "OFFER")
+    {
+        IncomingFile incoming;
+        header >> incoming.from >> incoming.size;
+        std::getline(header >> std::ws, incoming.name);
+        notice = "[File] " + incoming.from + " offers " + incoming.name + " (" + std::to_string(incoming.size)
+            + " bytes). $accept " + std::to_string(id) + " or $decline " + std::to_string(id);
+        incomingFiles[id] = std::move(incoming);
+    }
+    else if (kind == "CANCEL" || kind == "DONE")
+    {
+        std::string reason;
+        header >> reason;
+        auto it = incomingFiles.find(id);
+        if (it == incomingFiles.end())
+        {
+            return "";
+        }
+        notice = kind == "DONE"
+            ? "[File] Received " + it->second.name + " from " + it->second.from + ", saved as received_" + it->second.name
+            : "[File] " + it->second.name + " from " + it->second.from + " cancelled (" + reason + ")";
+        incomingFiles.erase(it);
+    }
+    else
+    {
+        // START, WINDOW, SENT and ABORT are about a file we send, by our own ref
+        auto it = outgoingFiles.find(id);
+        if (it == outgoingFiles.end())
+        {
+            return "";
+        }
+        OutgoingFile& outgoing = *it->second;
+        uint64_t value = 0;
+        std::string reason;
+        if (kind == "START" && (header >> value))
+        {
+            outgoing.started = true;
+            outgoing.offset = value;
+            if (value > 0)
+            {
+                notice = "[File] Resuming " + outgoing.path + " at byte " + std::to_string(value);
+            }
+        }
+        else if (kind == "WINDOW" && (header >> value))
+        {
+            outgoing.limit = (std::max)(outgoing.limit, value);
+        }
+        else if (kind == "SENT")
+        {
+            outgoing.finished = true;
+            notice = "[File] Sent " + outgoing.path;
+        }
+        else if (kind == "ABORT")
+        {
+            header >> reason;
+            outgoing.finished = true;
+            notice = "[File] Sending " + outgoing.path + " stopped (" + reason + ")";
+        }
+        transferSignal.notify_all();
+    }
+    return notice.empty() ? "" : notice + "\n";
+}
+
+void Client::stopFileTransfers()
+{
+    // Incoming files keep what they have, a later offer of the same file resumes from there.
+    std::map<uint32_t, std::unique_ptr<OutgoingFile>> stopping;
+    {
+        std::lock_guard<std::mutex> lock(transferMutex);
+        for (auto& transfer : outgoingFiles)
+        {
+            transfer.second->finished = true;
+        }
+        stopping.swap(outgoingFiles);
+        incomingFiles.clear();
+    }
+    transferSignal.notify_all();
+    for (auto& transfer : stopping)
+    {
+        if (transfer.second->worker.joinable())
+        {
+            transfer.second->worker.join();
+        }
+    }
+}
+
 bool Client::isConnected() 
 {
     return connected;
@@ -369,6 +1374,54 @@ void Client::setUsername(std::string _username)
 {
 	this->username = _username;
 }
+uint64_t Client::getRosterVersion() const
+{
+    return rosterVersion;
+}
+
+void Client::expectOwnChange(const std::string& previousName, const std::string& newName)
+{
+    // The server announces nothing for a registration under the name we already have
+    ownChangePending = previousName != newName;
+    ownChange.type = previousName.empty() ? PRESENCE_JOIN : PRESENCE_RENAME;
+    ownChange.name = newName;
+    ownChange.previousName = previousName;
+}
+
+void Client::applyPresenceChange(const PresenceEvent& event)
+{
+    if (event.type == PRESENCE_LEAVE || event.type == PRESENCE_RENAME)
+    {
+        const std::string& leaving = event.type == PRESENCE_LEAVE ? event.name : event.previousName;
+        auto it = roster.find(leaving);
+        if (it != roster.end() && --it->second == 0)
+        {
+            roster.erase(it);
+        }
+    }
+    if (event.type == PRESENCE_JOIN || event.type == PRESENCE_RENAME)
+    {
+        roster[event.name]++;
+    }
+}
+
+std::string Client::formatRoster() const
+{
+    if (roster.size() <= 1)
+    {
+        return "You are all alone in this server";
+    }
+    std::string list = "Online:";
+    for (const auto& member : roster)
+    {
+        list += " " + member.first;
+        if (member.second > 1)
+        {
+            list += " (x" + std::to_string(member.second) + ")";
+        }
+    }
+    return list;
+}
 
 
 
@@ -1,33 +1,177 @@
 #pragma once
 
 #include <string>
+#include <map>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <fstream>
+#include <functional>
+#include <atomic>
+#include <future>
 #include <winsock2.h>
+#include "Roster.h"
+#include "TlsChannel.h"
+#include "FileTransfer.h"
+#include "Multicast.h"
+#include "SharedChannel.h"
+#include "Compression.h"
 
 #pragma comment(lib, "Ws2_32.lib")
 
+// Answer to a request sent with a correlation id. kind is the first word of the reply
+// (OK, LIST, LOG, STATS, SV_SUCCESS, SV_FULL, EXIT or ERROR), or DISCONNECTED when the
+// connection went away before the answer came.
+struct RequestReply {
+    uint64_t id = 0;
+    std::string kind;
+    std::string body;       // everything after the kind
+    bool succeeded() const;
+};
+typedef std::function<void(const RequestReply&)> ReplyCallback;
+
 class Client {
 public:
     Client();
     ~Client();
     void connectToServer(const char* serverIP, const char* port);
+    // Same machine as the server: its local socket, and optionally shared memory on top
+    void connectLocal(const char* port, bool sharedMemory);
     void registerUser(std::string username);
     void executeCommand(std::string command);
     void sendMessage(std::string message);
     void closeConnection();
-    std::string receiveMessage(bool& flag);
+    // Text to show for the next frame: full lines end with '\n', a log part may leave its line open
+    std::string receiveMessage(std::atomic<bool>& flag);
+    // Same, for callers without a receiver thread: waits up to timeoutMs for the next frame to
+    // start and returns "" if none did. Once one has, it is read whole.
+    std::string poll(int timeoutMs, std::atomic<bool>& flag);
     bool isConnected();
     void setSocket(SOCKET newSocket);
     SOCKET getSocket() const;
     std::string getUsername() const;
     void setUsername(std::string newUsername);
     void listenForUdpBroadcast();
+    // Where notices from the other threads go, std::cout unless set
+    void setDisplay(std::function<void(std::string)> callback);
+    uint64_t getRosterVersion() const;
+    void enableTls(bool verifyServer);
+    bool isTlsEnabled() const;
+    // Asks for compressed bulk frames when connecting over TCP, on unless turned off before
+    void setCompression(bool enabled);
+    bool isCompressing() const;
+    void sendFile(const std::string& target, const std::string& path);
+    void acceptFile(uint32_t id);
+    void declineFile(uint32_t id);
+    // Pipelined requests: each is sent right away with its own id, without waiting for the
+    // ones before it, and answered through its future or callback in whatever order the
+    // replies come. Replies are matched by whichever thread is calling receiveMessage or poll,
+    // so a single-threaded caller polls until the future is ready rather than calling get():
+    //   while (reply.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+    //       std::cout << client.poll(100, done);
+    std::future<RequestReply> request(const std::string& command);
+    uint64_t request(const std::string& command, ReplyCallback callback);
+    std::future<RequestReply> requestList(uint64_t knownVersion = 0);
+    std::future<RequestReply> requestLog();
+    std::future<RequestReply> sendMessageAsync(const std::string& message);
+    size_t getPendingRequests() const;
+    void joinMulticast();
 private:
+    // A file this client is streaming out, one worker thread each
+    struct OutgoingFile {
+        uint32_t ref = 0;
+        std::string path;
+        uint64_t size = 0;
+        bool started = false;
+        bool finished = false;
+        uint64_t offset = 0;
+        uint64_t limit = 0;
+        std::thread worker;
+    };
+    // A file offered to or being received by this client
+    struct IncomingFile {
+        std::string from;
+        std::string name;
+        uint64_t size = 0;
+        bool accepted = false;
+        std::fstream file;
+        uint64_t written = 0;
+        uint64_t granted = 0;
+    };
+    void receiveGreeting();
+    void attachShared();
+    void negotiateCompression();
+    bool sendFrame(const std::string& header, const char* body = NULL, size_t bodySize = 0);
+    bool receiveFrame(std::string& frame);
+    bool completeRequest(const std::string& frame);
+    void failPendingRequests();
+    void applyListReply(const std::string& message);
+    void startMulticast(const std::string& description);
+    void receiveMulticast();
+    std::string deliverMulticast(const std::vector<MulticastSequencer::Message>& messages);
+    void requestRepairs();
+    std::string handleRepair(const std::string& message);
+    void stopMulticast();
+    void streamFile(OutgoingFile* transfer);
+    std::string handleFileMessage(const std::string& message);
+    void stopFileTransfers();
+    int transmit(const char* data, int size);
+    int receiveSome(char* buffer, int size);
+    bool receiveAll(char* buffer, int size);
+    bool waitReadable(int timeoutMs);
+    void performTlsHandshake(const char* serverName);
+    void applyPresenceChange(const PresenceEvent& event);
+    void expectOwnChange(const std::string& previousName, const std::string& newName);
+    std::string formatRoster() const;
+    void show(std::string text);
     SOCKET clientSocket;
     SOCKET udpClientSocket;
     bool connected;
     std::string username;
+    // Local copy of the server roster, kept current by PRESENCE events
+    std::map<std::string, int> roster;
+    uint64_t rosterVersion;
+    // The PRESENCE event our last registration causes, set when the server accepts it. Only
+    // that one is ours; other sessions may register under the same name.
+    PresenceEvent ownChange;
+    bool ownChangePending;
+    // TLS, when the server advertises it or enableTls was called
+    bool tlsEnabled;
+    bool tlsVerifyServer;
+    std::unique_ptr<TlsChannel> tls;
+    std::string tlsPlaintext;
+    // Shared memory with the server, the socket then only rings its doorbell
+    std::unique_ptr<SharedChannel> shared;
+    WSAEVENT hangUpEvent;
+    // Big frames from the server may come compressed, once agreed right after the greeting
+    bool compressionWanted;
+    bool compressing;
+    FrameDecompressor decompressor;
+    // Frames from the input, receiver and transfer threads must not interleave
+    std::mutex sendMutex;
+    // File transfers, shared between the input, receiver and worker threads
+    std::mutex transferMutex;
+    std::condition_variable transferSignal;
+    std::map<uint32_t, std::unique_ptr<OutgoingFile>> outgoingFiles;
+    std::map<uint32_t, IncomingFile> incomingFiles;
+    uint32_t nextFileRef;
+    // Requests waiting for their tagged reply, by correlation id
+    mutable std::mutex requestMutex;
+    std::map<uint64_t, ReplyCallback> pendingRequests;
+    std::map<uint64_t, std::string> partialReplies;    // "LOG+" parts of a log still coming
+    uint64_t nextRequestId;
+    // Chat from the server's multicast group, with gaps repaired over TCP
+    std::mutex multicastMutex;
+    MulticastSequencer sequencer;
+    SOCKET multicastSocket;
+    uint32_t multicastMemberId;
+    bool multicastRunning;
+    std::thread multicastThread;
 
     std::string logFileName;
+    std::function<void(std::string)> displayCallback;
 };
 
 
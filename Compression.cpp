@@ -0,0 +1,226 @@
+#include "Compression.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+FrameCompressor::FrameCompressor() : handle(NULL), threshold(COMPRESS_DEFAULT_THRESHOLD), hasLast(false),
+    historyBytes(0), historyEnd(0), historyVolume(0), historyFile(0)
+{
+    if (!CreateCompressor(COMPRESS_ALGORITHM_XPRESS_HUFF, NULL, &handle))
+    {
+        handle = NULL;
+    }
+}
+
+FrameCompressor::~FrameCompressor()
+{
+    if (handle != NULL)
+    {
+        CloseCompressor(handle);
+    }
+}
+
+void FrameCompressor::setThreshold(size_t newThreshold)
+{
+    threshold = newThreshold;
+}
+
+size_t FrameCompressor::getThreshold() const
+{
+    return threshold;
+}
+
+bool FrameCompressor::isEnabled() const
+{
+    return handle != NULL && threshold != 0;
+}
+
+bool FrameCompressor::compressFrame(std::string_view header, std::string_view body, std::string& frame)
+{
+    if (!isEnabled() || body.size() < threshold)
+    {
+        return false;
+    }
+    if (!hasLast || body != lastBody)
+    {
+        lastBody.assign(body.data(), body.size());
+        if (!compressBody(body, lastCompressed))
+        {
+            lastCompressed.clear();
+        }
+        hasLast = true;
+    }
+    if (lastCompressed.empty())
+    {
+        stats.incompressible++;
+        return false;
+    }
+    buildFrame(header, body, lastCompressed, frame);
+    return true;
+}
+
+bool FrameCompressor::compressHistory(std::string_view header, uint64_t offset, std::string_view part, bool full, std::string& frame)
+{
+    if (!isEnabled() || part.size() < threshold)
+    {
+        return false;
+    }
+    auto cached = history.find(offset);
+    if (full && cached != history.end())
+    {
+        stats.historyHits++;
+        buildFrame(header, part, *cached->second, frame);
+        return true;
+    }
+    stats.historyMisses++;
+    std::shared_ptr<std::string> compressed = std::make_shared<std::string>();
+    if (!compressBody(part, *compressed))
+    {
+        stats.incompressible++;
+        return false;
+    }
+    if (full && historyBytes + compressed->size() <= COMPRESS_HISTORY_BUDGET)
+    {
+        // Once the budget is used up, the start of the log stays cached: every request reads
+        // from there, and the rest is compressed per request
+        historyBytes += compressed->size();
+        historyEnd = (std::max)(historyEnd, offset + part.size());
+        history[offset] = compressed;
+    }
+    buildFrame(header, part, *compressed, frame);
+    return true;
+}
+
+void FrameCompressor::useHistoryOf(uint32_t volume, uint64_t fileIndex, uint64_t size)
+{
+    // A file that can't be told apart from others is never trusted with the last one's parts
+    bool known = volume != 0 || fileIndex != 0;
+    if (!known || volume != historyVolume || fileIndex != historyFile || size < historyEnd)
+    {
+        dropHistory();
+        historyVolume = volume;
+        historyFile = fileIndex;
+    }
+}
+
+void FrameCompressor::dropHistory()
+{
+    history.clear();
+    historyBytes = 0;
+    historyEnd = 0;
+}
+
+const CompressionStats& FrameCompressor::getStats() const
+{
+    return stats;
+}
+
+std::string FrameCompressor::report() const
+{
+    std::ostringstream out;
+    out << "algorithm=" << COMPRESS_ALGORITHM_NAME
+        << " threshold=" << threshold
+        << " frames=" << stats.frames
+        << " bytes_in=" << stats.bytesIn
+        << " bytes_out=" << stats.bytesOut
+        << " saved=" << stats.bytesIn - stats.bytesOut
+        << " compressed=" << stats.compressed
+        << " incompressible=" << stats.incompressible
+        << " cpu_us=" << stats.nanoseconds / 1000
+        << " history_hits=" << stats.historyHits
+        << " history_misses=" << stats.historyMisses
+        << " history_bytes=" << historyBytes;
+    return out.str();
+}
+
+bool FrameCompressor::compressBody(std::string_view body, std::string& compressed)
+{
+    // Only worth it if it shrinks, so the output gets no more room than the input had
+    auto started = std::chrono::steady_clock::now();
+    compressed.resize(body.size());
+    SIZE_T compressedSize = 0;
+    bool shrunk = Compress(handle, body.data(), body.size(), &compressed[0], compressed.size(), &compressedSize) != FALSE
+        && compressedSize < body.size();
+    compressed.resize(shrunk ? compressedSize : 0);
+    stats.compressed++;
+    stats.nanoseconds += static_cast<unsigned long long>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started).count());
+    return shrunk;
+}
+
+void FrameCompressor::buildFrame(std::string_view header, std::string_view body, std::string_view compressed, std::string& frame)
+{
+    std::string prefix = "ZIP " + std::to_string(header.size()) + " ";
+    uint32_t frameSize = static_cast<uint32_t>(prefix.size() + header.size() + compressed.size());
+    frame.assign(reinterpret_cast<const char*>(&frameSize), sizeof(frameSize));
+    frame += prefix;
+    frame += header;
+    frame += compressed;
+    stats.frames++;
+    stats.bytesIn += header.size() + body.size();
+    stats.bytesOut += frameSize;
+}
+
+FrameDecompressor::FrameDecompressor() : handle(NULL)
+{
+    if (!CreateDecompressor(COMPRESS_ALGORITHM_XPRESS_HUFF, NULL, &handle))
+    {
+        handle = NULL;
+    }
+}
+
+FrameDecompressor::~FrameDecompressor()
+{
+    if (handle != NULL)
+    {
+        CloseDecompressor(handle);
+    }
+}
+
+bool FrameDecompressor::isAvailable() const
+{
+    return handle != NULL;
+}
+
+bool FrameDecompressor::isCompressed(const std::string& frame)
+{
+    return frame.compare(0, 4, "ZIP ") == 0;
+}
+
+bool FrameDecompressor::expand(std::string& frame)
+{
+    // "ZIP <header size> <header><compressed body>"
+    char* end = NULL;
+    unsigned long long headerSize = std::strtoull(frame.c_str() + 4, &end, 10);
+    size_t headerStart = end + 1 - frame.c_str();
+    if (handle == NULL || end == frame.c_str() + 4 || *end != ' ' || headerSize > frame.size() - headerStart)
+    {
+        return false;
+    }
+    const char* compressed = frame.data() + headerStart + headerSize;
+    size_t compressedSize = frame.size() - headerStart - static_cast<size_t>(headerSize);
+    // Asked with no room, the decompressor reports the expanded size from the body's header
+    SIZE_T expandedSize = 0;
+    if (Decompress(handle, compressed, compressedSize, NULL, 0, &expandedSize) == FALSE
+        && GetLastError() != ERROR_INSUFFICIENT_BUFFER)
+    {
+        return false;
+    }
+    if (expandedSize > COMPRESS_MAX_EXPANDED)
+    {
+        return false;
+    }
+    scratch.assign(frame, headerStart, static_cast<size_t>(headerSize));
+    scratch.resize(static_cast<size_t>(headerSize) + expandedSize);
+    SIZE_T written = 0;
+    if (expandedSize > 0 && (Decompress(handle, compressed, compressedSize, &scratch[static_cast<size_t>(headerSize)], expandedSize, &written) == FALSE
+        || written != expandedSize))
+    {
+        return false;
+    }
+    frame.swap(scratch);
+    return true;
+}
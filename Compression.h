@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <windows.h>
+#include <compressapi.h>
+
+#pragma comment(lib, "Cabinet.lib")
+
+// Per-connection compression, negotiated by the client right after the greeting:
+//
+//   client -> server    $compress <algorithm> ...
+//   server -> client    COMPRESS <algorithm> <threshold> | COMPRESS none
+//
+// From then on the server may send any frame of at least <threshold> bytes as
+//
+//   ZIP <header size> <header><compressed body>
+//
+// and the client reads it as <header> followed by the expanded body. The header stays plain
+// so one compressed body serves every requester: a log part is compressed once, and each
+// request only adds its own tag in front. Bodies are in the Windows Compression API's buffer
+// format, which records their expanded size.
+const char COMPRESS_ALGORITHM_NAME[] = "xpress-huff";
+const size_t COMPRESS_DEFAULT_THRESHOLD = 1024;                 // smaller frames gain too little
+const size_t COMPRESS_MAX_EXPANDED = 16 * 1024 * 1024;          // a client expands nothing bigger
+const size_t COMPRESS_HISTORY_BUDGET = 16 * 1024 * 1024;        // compressed log parts the server keeps
+
+struct CompressionStats {
+    unsigned long long frames = 0;          // sent compressed
+    unsigned long long bytesIn = 0;         // their size as they were
+    unsigned long long bytesOut = 0;        // and as they went out
+    unsigned long long compressed = 0;      // bodies actually run through the compressor
+    unsigned long long incompressible = 0;  // over the threshold but no smaller compressed, sent as they were
+    unsigned long long nanoseconds = 0;     // spent compressing
+    unsigned long long historyHits = 0;
+    unsigned long long historyMisses = 0;
+};
+
+// Server side. A frame fanned out to many sessions in a row is compressed once: the last
+// body and its result are kept, and the next session asking for the same body gets them.
+class FrameCompressor {
+public:
+    FrameCompressor();
+    ~FrameCompressor();
+    // Zero turns compression off, sessions that ask for it get "COMPRESS none"
+    void setThreshold(size_t threshold);
+    size_t getThreshold() const;
+    bool isEnabled() const;
+    // The complete ZIP frame, size included, for header + body. False when the body is under
+    // the threshold or doesn't get smaller, the frame then goes out as it was.
+    bool compressFrame(std::string_view header, std::string_view body, std::string& frame);
+    // Same for the part of the chat log at offset. A full part never changes, the log only
+    // grows, so its compressed body is cached for the next requester.
+    bool compressHistory(std::string_view header, uint64_t offset, std::string_view part, bool full, std::string& frame);
+    // The log about to be read, by volume and file index, and its size. The cache only holds
+    // for the same file grown from where it was: another file, or a shorter one, drops it.
+    void useHistoryOf(uint32_t volume, uint64_t fileIndex, uint64_t size);
+    const CompressionStats& getStats() const;
+    std::string report() const;
+private:
+    bool compressBody(std::string_view body, std::string& compressed);
+    void buildFrame(std::string_view header, std::string_view body, std::string_view compressed, std::string& frame);
+    void dropHistory();
+    COMPRESSOR_HANDLE handle;
+    size_t threshold;
+    CompressionStats stats;
+    std::string lastBody;           // the last body compressed by compressFrame...
+    std::string lastCompressed;     // ...and its result, empty if it didn't shrink
+    bool hasLast;
+    std::map<uint64_t, std::shared_ptr<const std::string>> history;    // by log offset
+    size_t historyBytes;
+    uint64_t historyEnd;
+    uint32_t historyVolume;         // the file the cached parts came from, 0 and 0 if unknown
+    uint64_t historyFile;
+};
+
+// Client side: expands ZIP frames in place.
+class FrameDecompressor {
+public:
+    FrameDecompressor();
+    ~FrameDecompressor();
+    bool isAvailable() const;
+    static bool isCompressed(const std::string& frame);
+    // False if the frame is malformed or expands past COMPRESS_MAX_EXPANDED
+    bool expand(std::string& frame);
+private:
+    DECOMPRESSOR_HANDLE handle;
+    std::string scratch;
+};
@@ -0,0 +1,141 @@
+#include "Console.h"
+
+#include <chrono>
+#include <iostream>
+
+Console::Console() : tail(new Node()), queued(0), dropped(0), running(false), lineOpen(false)
+{
+    head.store(tail);
+}
+
+Console::~Console()
+{
+    stop();
+    delete tail;
+}
+
+void Console::start()
+{
+    // Only the renderer writes to std::cout from now on; reading std::cin must not flush it
+    // from the input thread at the same time.
+    std::cin.tie(nullptr);
+    running = true;
+    renderer = std::thread(&Console::render, this);
+}
+
+void Console::stop()
+{
+    // The queue has one consumer: the renderer, then whoever stopped it
+    if (running.exchange(false))
+    {
+        renderer.join();
+        flush();
+    }
+}
+
+void Console::write(std::string text)
+{
+    if (queued.fetch_add(1) >= CONSOLE_MAX_QUEUED)
+    {
+        queued--;
+        dropped++;
+        return;
+    }
+    Node* node = new Node();
+    node->text = std::move(text);
+    push(node);
+}
+
+void Console::prompt()
+{
+    queued++;
+    Node* node = new Node();
+    node->prompt = true;
+    push(node);
+}
+
+void Console::push(Node* node)
+{
+    // Takes the head first and links the old one to us after, so a node can be briefly
+    // unreachable; the renderer then stops there and picks it up on the next tick.
+    Node* previous = head.exchange(node, std::memory_order_acq_rel);
+    previous->next.store(node, std::memory_order_release);
+}
+
+bool Console::pop(std::string& text, bool& prompt)
+{
+    Node* next = tail->next.load(std::memory_order_acquire);
+    if (next == nullptr)
+    {
+        return false;
+    }
+    text = std::move(next->text);
+    prompt = next->prompt;
+    delete tail;
+    tail = next;
+    queued--;
+    return true;
+}
+
+void Console::render()
+{
+    while (running)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(CONSOLE_FRAME_MS));
+        flush();
+    }
+}
+
+void Console::flush()
+{
+    batch.clear();
+    bool promptWanted = false;
+    bool wroteText = false;
+    std::string text;
+    bool prompt = false;
+    while (pop(text, prompt))
+    {
+        if (prompt)
+        {
+            promptWanted = true;
+            continue;
+        }
+        if (text.empty())
+        {
+            continue;
+        }
+        if (!wroteText && !lineOpen)
+        {
+            // Whatever the user was typing goes with the old prompt
+            batch += "\033[2K\r";
+        }
+        wroteText = true;
+        batch += text;
+        lineOpen = text.back() != '\n';
+    }
+    size_t skipped = dropped.exchange(0);
+    if (skipped > 0)
+    {
+        if (!wroteText && !lineOpen)
+        {
+            batch += "\033[2K\r";
+        }
+        wroteText = true;
+        batch += (lineOpen ? "\n[" : "[") + std::to_string(skipped) + " messages not shown, the terminal fell behind]\n";
+        lineOpen = false;
+    }
+    if (!wroteText && !promptWanted)
+    {
+        return;
+    }
+    // A line left open, like a log coming in parts, gets the prompt once it is finished
+    if (!lineOpen)
+    {
+        if (!wroteText)
+        {
+            batch += "\033[2K\r";
+        }
+        batch += CONSOLE_PROMPT;
+    }
+    std::cout.write(batch.data(), batch.size()).flush();
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <thread>
+
+const int CONSOLE_FRAME_MS = 16;    // pending output is written at most this often, about 60 times a second
+const char CONSOLE_PROMPT[] = "Enter command or message: ";
+const size_t CONSOLE_MAX_QUEUED = 10000;    // texts waiting for the renderer; past that they are counted, not kept
+
+// Terminal output of the interactive client. Any thread hands text to write(), which only
+// queues it; a renderer thread collects everything queued once per frame tick and writes
+// it in one go, clearing the prompt line before and drawing the prompt once after. Under a
+// busy room the receiver thread then keeps up with the socket, and the terminal does one
+// write per tick instead of one per message.
+//
+// The queue is a linked list that threads push to with an atomic exchange, and only the
+// renderer pops from, so nobody ever waits for a lock to show something. A flood the
+// terminal can't keep up with is cut short and shown as one line saying how much was left out.
+class Console {
+public:
+    Console();
+    ~Console();
+    void start();
+    // Writes what is still queued, then returns; only the first caller does, once the renderer is gone
+    void stop();
+    // Text to show as is: full lines end with '\n', text without one is continued by the next
+    void write(std::string text);
+    // Redraw the prompt, after the user's input moved the cursor to a new line
+    void prompt();
+private:
+    struct Node {
+        std::atomic<Node*> next{ nullptr };
+        std::string text;
+        bool prompt = false;
+    };
+    void push(Node* node);
+    bool pop(std::string& text, bool& prompt);
+    void render();
+    void flush();
+
+    std::atomic<Node*> head;    // last pushed, producers
+    Node* tail;                 // already consumed, renderer only
+    std::atomic<size_t> queued;
+    std::atomic<size_t> dropped;
+    std::atomic<bool> running;
+    std::thread renderer;
+    bool lineOpen;              // the last text written didn't end its line
+    std::string batch;
+};
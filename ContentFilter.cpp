@@ -0,0 +1,263 @@
+#include "ContentFilter.h"
+
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <stdexcept>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define CONTENT_FILTER_SSE2
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace {
+const uint32_t NO_STATE = UINT32_MAX;
+
+unsigned char fold(unsigned char byte)
+{
+    return byte >= 'A' && byte <= 'Z' ? static_cast<unsigned char>(byte - 'A' + 'a') : byte;
+}
+
+int lowestBit(int mask)
+{
+#ifdef _MSC_VER
+    unsigned long index = 0;
+    _BitScanForward(&index, static_cast<unsigned long>(mask));
+    return static_cast<int>(index);
+#else
+    return __builtin_ctz(static_cast<unsigned>(mask));
+#endif
+}
+}
+
+std::shared_ptr<ContentFilter> ContentFilter::load(const std::string& path)
+{
+    std::ifstream file(path);
+    if (!file)
+    {
+        throw std::runtime_error("Can't read the content filter " + path);
+    }
+    TermList terms;
+    std::string line;
+    while (std::getline(file, line))
+    {
+        while (!line.empty() && (line.back() == '\r' || line.back() == ' ' || line.back() == '\t'))
+        {
+            line.pop_back();
+        }
+        if (line.empty() || line[0] == '#')
+        {
+            continue;
+        }
+        if (line[0] == '?')
+        {
+            terms.emplace_back(line.substr(1), FILTER_FLAG);
+        }
+        else
+        {
+            terms.emplace_back(line, FILTER_BLOCK);
+        }
+    }
+    return std::make_shared<ContentFilter>(terms);
+}
+
+ContentFilter::ContentFilter(const TermList& termList) : classCount(1)
+{
+    // Input classes: one per distinct byte in the terms, upper and lower case sharing theirs
+    memset(classOf, 0, sizeof(classOf));
+    memset(startsTerm, 0, sizeof(startsTerm));
+    for (const auto& term : termList)
+    {
+        for (unsigned char byte : term.first)
+        {
+            byte = fold(byte);
+            if (classOf[byte] == 0 && classCount < 256)
+            {
+                classOf[byte] = static_cast<uint8_t>(classCount);
+                if (byte >= 'a' && byte <= 'z')
+                {
+                    classOf[byte - 'a' + 'A'] = static_cast<uint8_t>(classCount);
+                }
+                classCount++;
+            }
+        }
+    }
+
+    // The trie, with state 0 as the root
+    transitions.assign(classCount, NO_STATE);
+    actions.push_back(FILTER_PASS);
+    matched.push_back(0);
+    for (const auto& term : termList)
+    {
+        if (term.first.empty())
+        {
+            continue;
+        }
+        size_t index = terms.size();
+        terms.push_back(term.first);
+        uint32_t state = 0;
+        for (unsigned char byte : term.first)
+        {
+            uint32_t& next = transitions[state * classCount + classOf[byte]];
+            if (next == NO_STATE)
+            {
+                next = static_cast<uint32_t>(actions.size());
+                transitions.insert(transitions.end(), classCount, NO_STATE);
+                actions.push_back(FILTER_PASS);
+                matched.push_back(0);
+            }
+            state = transitions[state * classCount + classOf[byte]];
+        }
+        if (term.second > actions[state])
+        {
+            actions[state] = static_cast<uint8_t>(term.second);
+            matched[state] = static_cast<uint32_t>(index);
+        }
+        unsigned char first = fold(static_cast<unsigned char>(term.first[0]));
+        startsTerm[first] = true;
+        if (first >= 'a' && first <= 'z')
+        {
+            startsTerm[first - 'a' + 'A'] = true;
+        }
+    }
+
+    // Fail links, breadth first, folded into the table so every state has every transition.
+    // A state also reports what its fail state reports: a term can end inside a longer one.
+    std::vector<uint32_t> fail(actions.size(), 0);
+    std::deque<uint32_t> queue;
+    for (uint32_t c = 0; c < classCount; c++)
+    {
+        uint32_t& next = transitions[c];
+        if (next == NO_STATE)
+        {
+            next = 0;
+        }
+        else
+        {
+            queue.push_back(next);
+        }
+    }
+    while (!queue.empty())
+    {
+        uint32_t state = queue.front();
+        queue.pop_front();
+        for (uint32_t c = 0; c < classCount; c++)
+        {
+            uint32_t& next = transitions[state * classCount + c];
+            uint32_t fallback = transitions[fail[state] * classCount + c];
+            if (next == NO_STATE)
+            {
+                next = fallback;
+                continue;
+            }
+            fail[next] = fallback;
+            if (actions[fallback] > actions[next])
+            {
+                actions[next] = actions[fallback];
+                matched[next] = matched[fallback];
+            }
+            queue.push_back(next);
+        }
+    }
+
+    for (int byte = 0; byte < 256; byte++)
+    {
+        if (startsTerm[byte])
+        {
+            startBytes.push_back(static_cast<unsigned char>(byte));
+        }
+    }
+    if (startBytes.size() > FILTER_PREFILTER_MAX_BYTES)
+    {
+        startBytes.clear();
+    }
+}
+
+size_t ContentFilter::findCandidate(const unsigned char* text, size_t size) const
+{
+    // First position a term can start at, size if there is none
+    size_t i = 0;
+#ifdef CONTENT_FILTER_SSE2
+    __m128i needles[FILTER_PREFILTER_MAX_BYTES];
+    size_t count = startBytes.size();
+    for (size_t n = 0; n < count; n++)
+    {
+        needles[n] = _mm_set1_epi8(static_cast<char>(startBytes[n]));
+    }
+    for (; i + 16 <= size; i += 16)
+    {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + i));
+        __m128i hits = _mm_setzero_si128();
+        for (size_t n = 0; n < count; n++)
+        {
+            hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, needles[n]));
+        }
+        int mask = _mm_movemask_epi8(hits);
+        if (mask != 0)
+        {
+            return i + lowestBit(mask);
+        }
+    }
+#endif
+    for (; i < size; i++)
+    {
+        if (startsTerm[text[i]])
+        {
+            return i;
+        }
+    }
+    return size;
+}
+
+FilterVerdict ContentFilter::check(std::string_view text) const
+{
+    FilterVerdict verdict;
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(text.data());
+    size_t size = text.size();
+    bool prefilter = !startBytes.empty();
+    size_t i = prefilter ? findCandidate(bytes, size) : 0;
+    uint32_t state = 0;
+    while (i < size)
+    {
+        state = transitions[state * classCount + classOf[bytes[i]]];
+        i++;
+        if (actions[state] > verdict.action)
+        {
+            verdict.action = static_cast<FilterAction>(actions[state]);
+            verdict.term = matched[state];
+            if (verdict.action == FILTER_BLOCK)
+            {
+                break;
+            }
+        }
+        if (state == 0 && prefilter)
+        {
+            // Back at the root, nothing can match before the next start byte
+            i += findCandidate(bytes + i, size - i);
+        }
+    }
+    return verdict;
+}
+
+const std::string& ContentFilter::getTerm(size_t index) const
+{
+    return terms[index];
+}
+
+size_t ContentFilter::getTermCount() const
+{
+    return terms.size();
+}
+
+size_t ContentFilter::getStateCount() const
+{
+    return actions.size();
+}
+
+bool ContentFilter::hasPrefilter() const
+{
+    return !startBytes.empty();
+}
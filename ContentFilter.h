@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+const int FILTER_RELOAD_CHECK_SECONDS = 2;      // how often the term file is checked for changes
+const size_t FILTER_PREFILTER_MAX_BYTES = 16;   // distinct first bytes the SIMD scan handles
+
+enum FilterAction {
+    FILTER_PASS = 0,
+    FILTER_FLAG = 1,    // relayed and logged, reported on the server console
+    FILTER_BLOCK = 2,   // neither relayed nor logged, the sender gets an error
+};
+
+struct FilterVerdict {
+    FilterAction action = FILTER_PASS;
+    size_t term = 0;    // the term that decided it, an index for getTerm()
+};
+
+struct FilterStats {
+    unsigned long long checked = 0;
+    unsigned long long flagged = 0;
+    unsigned long long blocked = 0;
+    unsigned long long totalNanoseconds = 0;    // spent in check(), for the average
+    unsigned long long maxNanoseconds = 0;
+    unsigned long long reloads = 0;
+};
+
+// Banned terms compiled into an Aho-Corasick automaton, so a message is checked in one pass
+// over its bytes whatever the number of terms. Bytes that appear in no term share one input
+// class, which keeps the transition table at states x (distinct bytes + 1). Matching ignores
+// ASCII case.
+//
+// Before the automaton runs, a prefilter skips to the first byte a term can start with, 16
+// bytes at a time with SSE2 while there are few enough distinct first bytes. Most chat
+// against a short list never reaches the automaton at all.
+//
+// A compiled filter is immutable: reloading builds a new one next to it and swaps the pointer.
+class ContentFilter {
+public:
+    typedef std::vector<std::pair<std::string, FilterAction>> TermList;
+    // One term per line, "?term" only flags it, '#' starts a comment line. Throws if the
+    // file can't be read.
+    static std::shared_ptr<ContentFilter> load(const std::string& path);
+    explicit ContentFilter(const TermList& terms);
+    FilterVerdict check(std::string_view text) const;
+    const std::string& getTerm(size_t index) const;
+    size_t getTermCount() const;
+    size_t getStateCount() const;
+    bool hasPrefilter() const;
+private:
+    size_t findCandidate(const unsigned char* text, size_t size) const;
+    std::vector<std::string> terms;
+    uint8_t classOf[256];
+    uint32_t classCount;
+    std::vector<uint32_t> transitions;  // state * classCount + class
+    std::vector<uint8_t> actions;       // strongest action ending in the state, fail links included
+    std::vector<uint32_t> matched;      // the term behind it
+    std::vector<unsigned char> startBytes;  // both cases, empty when too many for the prefilter
+    bool startsTerm[256];
+};
@@ -0,0 +1,55 @@
+#include "FileTransfer.h"
+
+#include <algorithm>
+
+bool FileTransfer::hasPendingReceivers() const
+{
+    for (const auto& receiver : receivers)
+    {
+        if (!receiver.second.accepted)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool FileTransfer::hasAcceptedReceivers() const
+{
+    for (const auto& receiver : receivers)
+    {
+        if (receiver.second.accepted)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+uint64_t FileTransfer::startOffset() const
+{
+    // Start from the receiver that has the least, the others overwrite bytes they already have.
+    uint64_t offset = size;
+    for (const auto& receiver : receivers)
+    {
+        if (receiver.second.accepted)
+        {
+            offset = (std::min)(offset, receiver.second.offset);
+        }
+    }
+    return offset;
+}
+
+uint64_t FileTransfer::windowLimit() const
+{
+    // The slowest receiver sets the pace.
+    uint64_t limit = size;
+    for (const auto& receiver : receivers)
+    {
+        if (receiver.second.accepted)
+        {
+            limit = (std::min)(limit, receiver.second.limit);
+        }
+    }
+    return limit;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <string>
+
+class Session;
+
+// Streaming file transfer protocol. Files move as fixed-size chunks; the server relays
+// each chunk as it arrives and never holds more than one in memory. Receivers grant
+// credit as an absolute offset they are ready to take, the sender may only send up to
+// the lowest grant among its receivers.
+//
+// Sender -> server                         Server -> sender
+//   $file offer <ref> <user|#all> <size> <name>   FILE START <ref> <offset>
+//   $file chunk <ref> <offset>\n<bytes>           FILE WINDOW <ref> <limit>
+//   $file cancel <ref>                            FILE ABORT <ref> <reason>
+//                                                 FILE SENT <ref>
+// Receiver -> server                       Server -> receiver
+//   $file accept <id> <offset> <limit>            FILE OFFER <id> <from> <size> <name>
+//   $file window <id> <limit>                     FILE CHUNK <id> <offset>\n<bytes>
+//   $file decline <id>                            FILE CANCEL <id> <reason>
+//                                                 FILE DONE <id>
+//
+// <ref> is chosen by the sender, <id> by the server. A receiver that already has part
+// of the file accepts at that offset and the transfer resumes from there. Receivers that
+// don't answer within FILE_OFFER_TIMEOUT_SECONDS are left out.
+const uint32_t FILE_CHUNK_SIZE = 16 * 1024;
+const uint64_t FILE_RECEIVE_WINDOW = 256 * 1024;
+const int FILE_OFFER_TIMEOUT_SECONDS = 30;
+
+struct FileReceiver {
+    bool accepted = false;
+    uint64_t offset = 0;    // where this receiver wants the stream to start
+    uint64_t limit = 0;     // how far it allows the sender to go
+};
+
+struct FileTransfer {
+    uint32_t id = 0;
+    Session* sender = nullptr;
+    uint32_t senderRef = 0;
+    uint64_t size = 0;
+    std::string name;
+    std::map<Session*, FileReceiver> receivers;
+    bool started = false;
+    uint64_t nextOffset = 0;    // next byte expected from the sender
+    uint64_t grantedLimit = 0;  // last window sent to the sender
+    std::chrono::steady_clock::time_point offeredAt;
+
+    bool hasPendingReceivers() const;
+    bool hasAcceptedReceivers() const;
+    uint64_t startOffset() const;
+    uint64_t windowLimit() const;
+};
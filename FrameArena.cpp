@@ -0,0 +1,63 @@
+#include "FrameArena.h"
+
+#include <algorithm>
+#include <cstring>
+
+FrameArena::FrameArena(size_t blockSize) : current(0), used(0), blockSize(blockSize)
+{
+}
+
+char* FrameArena::allocate(size_t size)
+{
+    // Move on to the next block that fits, adding one only when none is left.
+    while (current < blocks.size() && used + size > blocks[current].size)
+    {
+        current++;
+        used = 0;
+    }
+    if (current == blocks.size())
+    {
+        Block block;
+        block.size = (std::max)(blockSize, size);
+        block.data.reset(new char[block.size]);
+        blocks.push_back(std::move(block));
+        used = 0;
+    }
+    char* memory = blocks[current].data.get() + used;
+    used += size;
+    return memory;
+}
+
+std::string_view FrameArena::frame(std::string_view a, std::string_view b, std::string_view c, std::string_view d)
+{
+    uint32_t payloadSize = static_cast<uint32_t>(a.size() + b.size() + c.size() + d.size());
+    char* memory = allocate(sizeof(payloadSize) + payloadSize);
+    char* out = memory;
+    memcpy(out, &payloadSize, sizeof(payloadSize));
+    out += sizeof(payloadSize);
+    for (std::string_view part : { a, b, c, d })
+    {
+        if (!part.empty())
+        {
+            memcpy(out, part.data(), part.size());
+            out += part.size();
+        }
+    }
+    return std::string_view(memory, sizeof(payloadSize) + payloadSize);
+}
+
+void FrameArena::reset()
+{
+    current = 0;
+    used = 0;
+}
+
+size_t FrameArena::getCapacity() const
+{
+    size_t capacity = 0;
+    for (const auto& block : blocks)
+    {
+        capacity += block.size;
+    }
+    return capacity;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+// Bump allocator for outbound frames built while handling one loop iteration. Nothing is
+// freed individually; reset() at the end of the iteration makes the memory reusable, and
+// once the arena has grown to the iteration's high-water mark it stops allocating.
+class FrameArena {
+public:
+    explicit FrameArena(size_t blockSize = 64 * 1024);
+    char* allocate(size_t size);
+    // Length-prefixed frame: 4-byte size, then the parts back to back
+    std::string_view frame(std::string_view a, std::string_view b = {}, std::string_view c = {}, std::string_view d = {});
+    void reset();
+    size_t getCapacity() const;
+private:
+    struct Block {
+        std::unique_ptr<char[]> data;
+        size_t size;
+    };
+    std::vector<Block> blocks;
+    size_t current;     // block being filled
+    size_t used;        // bytes used in it
+    size_t blockSize;
+};
@@ -0,0 +1,227 @@
+#include "Handoff.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+// Fixed-size values are copied as they are: both ends are the same build on the same machine.
+template <typename T>
+void put(std::string& out, const T& value)
+{
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void putString(std::string& out, const std::string& value)
+{
+    put(out, static_cast<uint32_t>(value.size()));
+    out += value;
+}
+
+class Reader {
+public:
+    explicit Reader(const std::string& data) : data(data), position(0), failed(false)
+    {
+    }
+    template <typename T>
+    T get()
+    {
+        T value{};
+        if (!failed && data.size() - position >= sizeof(value))
+        {
+            memcpy(&value, data.data() + position, sizeof(value));
+            position += sizeof(value);
+        }
+        else
+        {
+            failed = true;
+        }
+        return value;
+    }
+    std::string getString()
+    {
+        uint32_t size = get<uint32_t>();
+        if (failed || data.size() - position < size)
+        {
+            failed = true;
+            return "";
+        }
+        position += size;
+        return data.substr(position - size, size);
+    }
+    bool good() const
+    {
+        return !failed;
+    }
+    bool finished() const
+    {
+        return !failed && position == data.size();
+    }
+private:
+    const std::string& data;
+    size_t position;
+    bool failed;
+};
+}
+
+std::string upgradePipeName(const std::string& port)
+{
+    return "\\\\.\\pipe\\cppchat-upgrade-" + port;
+}
+
+std::string encodeHandoff(const HandoffState& state)
+{
+    std::string out;
+    put(out, state.listenerInfo);
+    put(out, state.rosterVersion);
+    put(out, static_cast<uint32_t>(state.rosterHistory.size()));
+    for (const auto& event : state.rosterHistory)
+    {
+        put(out, event.version);
+        putString(out, Roster::encodeChange(event));
+    }
+    put(out, state.nextTransferId);
+    putString(out, state.multicastGroup);
+    put(out, state.multicastSequence);
+    put(out, state.multicastMemberId);
+    put(out, static_cast<uint32_t>(state.sessions.size()));
+    for (const auto& session : state.sessions)
+    {
+        put(out, session.socketInfo);
+        put(out, session.address);
+        put(out, static_cast<uint8_t>(session.closing));
+        putString(out, session.username);
+        putString(out, session.inbound);
+        put(out, session.discardRemaining);
+        put(out, session.multicastId);
+        put(out, static_cast<uint8_t>(session.compressing));
+        put(out, session.messageTokens);
+        put(out, session.byteTokens);
+        putString(out, session.outbound);
+    }
+    return out;
+}
+
+bool decodeHandoff(const std::string& data, HandoffState& state)
+{
+    Reader in(data);
+    state.listenerInfo = in.get<WSAPROTOCOL_INFOW>();
+    state.rosterVersion = in.get<uint64_t>();
+    uint32_t events = in.get<uint32_t>();
+    for (uint32_t i = 0; i < events && in.good(); i++)
+    {
+        PresenceEvent event;
+        uint64_t version = in.get<uint64_t>();
+        if (!Roster::decodeChange(in.getString(), event))
+        {
+            return false;
+        }
+        event.version = version;
+        state.rosterHistory.push_back(event);
+    }
+    state.nextTransferId = in.get<uint32_t>();
+    state.multicastGroup = in.getString();
+    state.multicastSequence = in.get<uint64_t>();
+    state.multicastMemberId = in.get<uint32_t>();
+    uint32_t sessions = in.get<uint32_t>();
+    for (uint32_t i = 0; i < sessions && in.good(); i++)
+    {
+        HandoffSession session;
+        session.socketInfo = in.get<WSAPROTOCOL_INFOW>();
+        session.address = in.get<u_long>();
+        session.closing = in.get<uint8_t>() != 0;
+        session.username = in.getString();
+        session.inbound = in.getString();
+        session.discardRemaining = in.get<uint64_t>();
+        session.multicastId = in.get<uint32_t>();
+        session.compressing = in.get<uint8_t>() != 0;
+        session.messageTokens = in.get<double>();
+        session.byteTokens = in.get<double>();
+        session.outbound = in.getString();
+        state.sessions.push_back(std::move(session));
+    }
+    return in.finished();
+}
+
+bool writePipeMessage(HANDLE pipe, const std::string& message)
+{
+    std::string frame;
+    put(frame, static_cast<uint32_t>(message.size()));
+    frame += message;
+    size_t written = 0;
+    while (written < frame.size())
+    {
+        DWORD count = 0;
+        if (!WriteFile(pipe, frame.data() + written, static_cast<DWORD>(frame.size() - written), &count, NULL))
+        {
+            return false;
+        }
+        written += count;
+    }
+    return true;
+}
+
+namespace {
+bool readPipeBytes(HANDLE pipe, char* data, size_t size, DWORD timeoutMs)
+{
+    // With a timeout, only what PeekNamedPipe says is there gets read, so ReadFile never blocks
+    DWORD deadline = GetTickCount() + timeoutMs;
+    size_t received = 0;
+    while (received < size)
+    {
+        DWORD wanted = static_cast<DWORD>(size - received);
+        if (timeoutMs != INFINITE)
+        {
+            DWORD available = 0;
+            if (!PeekNamedPipe(pipe, NULL, 0, NULL, &available, NULL))
+            {
+                return false;
+            }
+            if (available == 0)
+            {
+                if (static_cast<int32_t>(deadline - GetTickCount()) <= 0)
+                {
+                    return false;
+                }
+                Sleep(10);
+                continue;
+            }
+            wanted = (std::min)(wanted, available);
+        }
+        DWORD count = 0;
+        if (!ReadFile(pipe, data + received, wanted, &count, NULL) || count == 0)
+        {
+            return false;
+        }
+        received += count;
+    }
+    return true;
+}
+}
+
+bool readPipeMessage(HANDLE pipe, std::string& message)
+{
+    return readPipeMessage(pipe, message, INFINITE);
+}
+
+bool readPipeMessage(HANDLE pipe, std::string& message, DWORD timeoutMs)
+{
+    // The state is the only big message, a few hundred bytes per session
+    const uint32_t maxMessageSize = 64 * 1024 * 1024;
+    DWORD deadline = GetTickCount() + timeoutMs;
+    uint32_t size = 0;
+    if (!readPipeBytes(pipe, reinterpret_cast<char*>(&size), sizeof(size), timeoutMs) || size > maxMessageSize)
+    {
+        return false;
+    }
+    message.resize(size);
+    if (size == 0)
+    {
+        return true;
+    }
+    DWORD remaining = deadline - GetTickCount();
+    if (timeoutMs != INFINITE && static_cast<int32_t>(remaining) <= 0)
+    {
+        return false;
+    }
+    return readPipeBytes(pipe, &message[0], size, timeoutMs == INFINITE ? INFINITE : remaining);
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <winsock2.h>
+#include <windows.h>
+#include "Roster.h"
+
+#pragma comment(lib, "Ws2_32.lib")
+
+// Hot upgrade: a newly started server takes the listening socket and every live session
+// from the running one, so clients never see a disconnect.
+//
+//   successor -> running server    UPGRADE
+//   running server -> successor    HANDOFF <state> | REFUSED <reason>
+//   successor -> running server    ADOPTED
+//   running server -> successor    RELEASED | REFUSED <reason>
+//
+// Messages go over the named pipe upgradePipeName(port), framed like chat messages with
+// a 4-byte size. Sockets travel as WSADuplicateSocket protocol info made out for the
+// successor's process id, which the running server takes from the pipe itself. The
+// running server keeps its own descriptors, and keeps serving, until ADOPTED arrives;
+// only then does it exit, and closing its descriptors leaves the connections open.
+// ADOPTED is waited for HANDOFF_ADOPT_TIMEOUT_MS at most, the server is stopped meanwhile.
+// Later it is refused, and the successor only serves once RELEASED says nobody else does.
+const DWORD HANDOFF_ADOPT_TIMEOUT_MS = 10000;
+
+struct HandoffSession {
+    WSAPROTOCOL_INFOW socketInfo;
+    u_long address = 0;
+    bool closing = false;
+    std::string username;
+    std::string inbound;            // received bytes not yet processed, partial frames included
+    uint64_t discardRemaining = 0;  // rest of an oversized frame still being skipped
+    uint32_t multicastId = 0;
+    bool compressing = false;
+    double messageTokens = 0;       // chat limit levels; transfers are cancelled and start afresh
+    double byteTokens = 0;
+    std::string outbound;           // owed to the client: the rest of the wire, then every waiting frame
+};
+
+struct HandoffState {
+    WSAPROTOCOL_INFOW listenerInfo;
+    uint64_t rosterVersion = 0;
+    std::vector<PresenceEvent> rosterHistory;
+    uint32_t nextTransferId = 0;
+    std::string multicastGroup;         // "<group>:<port>", empty without multicast
+    uint64_t multicastSequence = 0;
+    uint32_t multicastMemberId = 0;
+    std::vector<HandoffSession> sessions;
+};
+
+std::string upgradePipeName(const std::string& port);
+std::string encodeHandoff(const HandoffState& state);
+bool decodeHandoff(const std::string& data, HandoffState& state);
+bool writePipeMessage(HANDLE pipe, const std::string& message);
+bool readPipeMessage(HANDLE pipe, std::string& message);
+// False as well if the whole message hasn't come within timeoutMs
+bool readPipeMessage(HANDLE pipe, std::string& message, DWORD timeoutMs);
@@ -0,0 +1,393 @@
+#include "ImpairmentProxy.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <ws2tcpip.h>
+
+ImpairmentProxy::ImpairmentProxy(const ImpairmentConfig& config)
+    : config(config), listener(INVALID_SOCKET), buffer(PROXY_CHUNK_SIZE)
+{
+    WSADATA wsaData;
+    int result = WSAStartup(MAKEWORD(2, 2), &wsaData);
+    if (result != 0)
+    {
+        throw std::runtime_error("WSAStartup failed: " + std::to_string(result));
+    }
+}
+
+ImpairmentProxy::~ImpairmentProxy()
+{
+    for (auto& link : links)
+    {
+        closesocket(link->client);
+        closesocket(link->upstream);
+    }
+    if (listener != INVALID_SOCKET)
+    {
+        closesocket(listener);
+    }
+    WSACleanup();
+}
+
+void ImpairmentProxy::run()
+{
+    openListener();
+    std::cout << "Proxy on port " << config.listenPort << " to " << config.upstreamIP << ":" << config.upstreamPort
+        << ", impairing " << (config.impairEvery == 1 ? std::string("every connection") : "1 in " + std::to_string(config.impairEvery)) << std::endl;
+    for (;;)
+    {
+        Clock::time_point now = Clock::now();
+        Clock::time_point wake = now + std::chrono::milliseconds(100);
+        fd_set readable;
+        fd_set writable;
+        FD_ZERO(&readable);
+        FD_ZERO(&writable);
+        FD_SET(listener, &readable);
+        SOCKET highest = listener;
+        for (auto& link : links)
+        {
+            updateLink(*link, now);
+            if (link->silent)
+            {
+                continue;
+            }
+            highest = (std::max)(highest, (std::max)(link->client, link->upstream));
+            if (link->stalledUntil > now)
+            {
+                wake = (std::min)(wake, link->stalledUntil);
+            }
+            else if (link->nextStall > now)
+            {
+                wake = (std::min)(wake, link->nextStall);
+            }
+            for (Direction* direction : { &link->up, &link->down })
+            {
+                if (isStalled(*link, *direction, now))
+                {
+                    continue;
+                }
+                if (!direction->readClosed && direction->buffered < config.windowBytes)
+                {
+                    FD_SET(direction->from, &readable);
+                }
+                if (direction->queue.empty())
+                {
+                    continue;
+                }
+                // Not due yet, out of tokens, or waiting for the socket to take more
+                const Chunk& next = direction->queue.front();
+                if (next.due > now)
+                {
+                    wake = (std::min)(wake, next.due);
+                }
+                else if (direction->bandwidth.available() < 1.0)
+                {
+                    wake = (std::min)(wake, now + direction->bandwidth.timeUntilAvailable(1.0));
+                }
+                else
+                {
+                    FD_SET(direction->to, &writable);
+                }
+            }
+        }
+
+        long long waitMicroseconds = (std::max)(0LL,
+            static_cast<long long>(std::chrono::duration_cast<std::chrono::microseconds>(wake - now).count()));
+        timeval timeout;
+        timeout.tv_sec = static_cast<long>(waitMicroseconds / 1000000);
+        timeout.tv_usec = static_cast<long>(waitMicroseconds % 1000000);
+        if (select(static_cast<int>(highest) + 1, &readable, &writable, NULL, &timeout) == SOCKET_ERROR)
+        {
+            throw std::runtime_error("select failed: " + std::to_string(WSAGetLastError()));
+        }
+
+        now = Clock::now();
+        if (FD_ISSET(listener, &readable))
+        {
+            acceptLink();
+        }
+        for (auto& link : links)
+        {
+            if (link->silent)
+            {
+                continue;
+            }
+            for (Direction* direction : { &link->up, &link->down })
+            {
+                if (isStalled(*link, *direction, now))
+                {
+                    continue;
+                }
+                if (FD_ISSET(direction->from, &readable))
+                {
+                    receive(*link, *direction, now);
+                }
+                // Also right after a receive, so an untouched connection costs no extra round
+                forward(*link, *direction, now);
+            }
+        }
+        for (size_t i = 0; i < links.size();)
+        {
+            if (isFinished(*links[i], now))
+            {
+                closeLink(*links[i]);
+                links.erase(links.begin() + i);
+            }
+            else
+            {
+                i++;
+            }
+        }
+    }
+}
+
+std::string ImpairmentProxy::report() const
+{
+    std::ostringstream out;
+    out << "accepted=" << stats.accepted
+        << " impaired=" << stats.impaired
+        << " open=" << links.size()
+        << " stalls=" << stats.stalls
+        << " half_open=" << stats.halfOpened
+        << " bytes_up=" << stats.bytesUp
+        << " bytes_down=" << stats.bytesDown
+        << " max_hold_ms=" << static_cast<long long>(stats.maxHoldMs);
+    return out.str();
+}
+
+void ImpairmentProxy::openListener()
+{
+    struct addrinfo* address = NULL;
+    struct addrinfo hints;
+    ZeroMemory(&hints, sizeof(hints));
+    hints.ai_flags = AI_PASSIVE;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    int result = getaddrinfo(NULL, config.listenPort.c_str(), &hints, &address);
+    if (result != 0)
+    {
+        throw std::runtime_error("Error getting address info: " + std::to_string(result));
+    }
+    listener = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+    if (listener == INVALID_SOCKET
+        || bind(listener, address->ai_addr, (int)address->ai_addrlen) == SOCKET_ERROR
+        || listen(listener, SOMAXCONN) == SOCKET_ERROR)
+    {
+        int error = WSAGetLastError();
+        freeaddrinfo(address);
+        throw std::runtime_error("Can't listen on port " + config.listenPort + ": " + std::to_string(error));
+    }
+    freeaddrinfo(address);
+}
+
+void ImpairmentProxy::acceptLink()
+{
+    SOCKET client = accept(listener, NULL, NULL);
+    if (client == INVALID_SOCKET)
+    {
+        return;
+    }
+    stats.accepted++;
+    // Two sockets per connection; the project raises FD_SETSIZE from Winsock's default of 64
+    if (links.size() * 2 + 3 > FD_SETSIZE)
+    {
+        std::cerr << "Proxy: too many connections, refusing one" << std::endl;
+        closesocket(client);
+        return;
+    }
+    SOCKET upstream = connectUpstream();
+    if (upstream == INVALID_SOCKET)
+    {
+        std::cerr << "Proxy: can't reach " << config.upstreamIP << ":" << config.upstreamPort << ": " << WSAGetLastError() << std::endl;
+        closesocket(client);
+        return;
+    }
+    u_long nonBlocking = 1;
+    ioctlsocket(client, FIONBIO, &nonBlocking);
+    ioctlsocket(upstream, FIONBIO, &nonBlocking);
+    // Small writes go out as they are released, latency is only what we add
+    BOOL noDelay = TRUE;
+    setsockopt(client, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+    setsockopt(upstream, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+
+    std::unique_ptr<Link> link(new Link());
+    link->id = stats.accepted;
+    link->client = client;
+    link->upstream = upstream;
+    link->up.from = client;
+    link->up.to = upstream;
+    link->down.from = upstream;
+    link->down.to = client;
+    link->opened = Clock::now();
+    link->up.lastDue = link->opened;
+    link->down.lastDue = link->opened;
+    link->impaired = config.impairEvery > 0 && link->id % config.impairEvery == 0;
+    // Seeded per connection, so the delays don't depend on how connections interleave
+    link->random.seed(config.seed + static_cast<unsigned>(link->id));
+    if (link->impaired)
+    {
+        stats.impaired++;
+        double rate = config.bandwidthKBps * 1024.0;
+        // A tenth of a second's worth, so the cap holds over short intervals too
+        link->up.bandwidth.configure(rate, rate / 10);
+        link->down.bandwidth.configure(rate, rate / 10);
+        if (config.stallEveryMs > 0 && config.stallForMs > 0)
+        {
+            link->nextStall = link->opened + std::chrono::milliseconds(config.stallEveryMs);
+        }
+    }
+    std::cout << "Proxy: connection " << link->id << (link->impaired ? " impaired" : " clean") << std::endl;
+    links.push_back(std::move(link));
+}
+
+SOCKET ImpairmentProxy::connectUpstream()
+{
+    SOCKET upstream = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (upstream == INVALID_SOCKET)
+    {
+        return INVALID_SOCKET;
+    }
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    inet_pton(AF_INET, config.upstreamIP.c_str(), &address.sin_addr);
+    address.sin_port = htons(static_cast<u_short>(atoi(config.upstreamPort.c_str())));
+    // Blocking: the server is on this machine or close by, and answers at once or not at all
+    if (connect(upstream, (SOCKADDR*)&address, sizeof(address)) == SOCKET_ERROR)
+    {
+        closesocket(upstream);
+        return INVALID_SOCKET;
+    }
+    return upstream;
+}
+
+void ImpairmentProxy::updateLink(Link& link, Clock::time_point now)
+{
+    if (!link.impaired || link.silent)
+    {
+        return;
+    }
+    if (config.halfOpenAfterMs > 0 && now >= link.opened + std::chrono::milliseconds(config.halfOpenAfterMs))
+    {
+        // Nothing is read, written or closed from now on: both ends see a peer that is
+        // connected and never answers, like one whose machine lost power
+        link.silent = true;
+        stats.halfOpened++;
+        std::cout << "Proxy: connection " << link.id << " half-open" << std::endl;
+        return;
+    }
+    if (link.nextStall != Clock::time_point() && now >= link.nextStall)
+    {
+        link.stalledUntil = link.nextStall + std::chrono::milliseconds(config.stallForMs);
+        link.nextStall = link.stalledUntil + std::chrono::milliseconds(config.stallEveryMs);
+        stats.stalls++;
+    }
+}
+
+bool ImpairmentProxy::isStalled(const Link& link, const Direction& direction, Clock::time_point now) const
+{
+    // A stalled client stops reading: its side of the proxy takes nothing from the server,
+    // while what it sends still goes through
+    return &direction == &link.down && now < link.stalledUntil;
+}
+
+void ImpairmentProxy::receive(Link& link, Direction& direction, Clock::time_point now)
+{
+    size_t room = (std::min)(buffer.size(), config.windowBytes - direction.buffered);
+    int received = recv(direction.from, buffer.data(), static_cast<int>(room), 0);
+    if (received == 0)
+    {
+        direction.readClosed = true;
+        return;
+    }
+    if (received == SOCKET_ERROR)
+    {
+        if (WSAGetLastError() != WSAEWOULDBLOCK)
+        {
+            link.failed = true;
+        }
+        return;
+    }
+    Chunk chunk;
+    chunk.arrived = now;
+    chunk.due = now;
+    if (link.impaired)
+    {
+        int delayMs = config.latencyMs;
+        if (config.jitterMs > 0)
+        {
+            delayMs += std::uniform_int_distribution<int>(0, config.jitterMs)(link.random);
+        }
+        // Never before the bytes in front of it, TCP delivers in order
+        chunk.due = (std::max)(now + std::chrono::milliseconds(delayMs), direction.lastDue);
+    }
+    direction.lastDue = chunk.due;
+    chunk.data.assign(buffer.data(), static_cast<size_t>(received));
+    direction.buffered += chunk.data.size();
+    direction.queue.push_back(std::move(chunk));
+}
+
+void ImpairmentProxy::forward(Link& link, Direction& direction, Clock::time_point now)
+{
+    while (!direction.queue.empty() && direction.queue.front().due <= now)
+    {
+        Chunk& chunk = direction.queue.front();
+        size_t size = chunk.data.size() - chunk.offset;
+        if (!direction.bandwidth.isUnlimited())
+        {
+            double tokens = direction.bandwidth.available();
+            if (tokens < 1.0)
+            {
+                break;
+            }
+            size = (std::min)(size, static_cast<size_t>(tokens));
+        }
+        int sent = send(direction.to, chunk.data.data() + chunk.offset, static_cast<int>(size), 0);
+        if (sent == SOCKET_ERROR)
+        {
+            if (WSAGetLastError() != WSAEWOULDBLOCK)
+            {
+                link.failed = true;
+            }
+            break;
+        }
+        direction.bandwidth.forceConsume(sent);
+        direction.bytes += sent;
+        (&direction == &link.up ? stats.bytesUp : stats.bytesDown) += sent;
+        direction.buffered -= sent;
+        chunk.offset += sent;
+        if (chunk.offset < chunk.data.size())
+        {
+            break;
+        }
+        stats.maxHoldMs = (std::max)(stats.maxHoldMs, std::chrono::duration<double, std::milli>(now - chunk.arrived).count());
+        direction.queue.pop_front();
+    }
+    if (direction.readClosed && direction.queue.empty() && !direction.writeClosed)
+    {
+        shutdown(direction.to, SD_SEND);
+        direction.writeClosed = true;
+    }
+}
+
+bool ImpairmentProxy::isFinished(const Link& link, Clock::time_point now) const
+{
+    if (link.silent)
+    {
+        return now >= link.opened + std::chrono::milliseconds(config.halfOpenAfterMs) + std::chrono::seconds(PROXY_HALF_OPEN_HOLD_SECONDS);
+    }
+    return link.failed || (link.up.writeClosed && link.down.writeClosed);
+}
+
+void ImpairmentProxy::closeLink(Link& link)
+{
+    double seconds = std::chrono::duration<double>(Clock::now() - link.opened).count();
+    std::cout << "Proxy: connection " << link.id << " closed after " << seconds << " s, "
+        << link.up.bytes << " bytes up, " << link.down.bytes << " bytes down" << std::endl;
+    std::cout << "Proxy: " << report() << std::endl;
+    closesocket(link.client);
+    closesocket(link.upstream);
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include <winsock2.h>
+#include "TokenBucket.h"
+
+#pragma comment(lib, "Ws2_32.lib")
+
+const size_t PROXY_CHUNK_SIZE = 16 * 1024;          // one recv, the unit delays are applied to
+const int PROXY_HALF_OPEN_HOLD_SECONDS = 300;       // a silent connection is dropped after this
+
+// What the proxy does to a connection. Every option applies to both directions unless it
+// says otherwise, and zero turns it off.
+struct ImpairmentConfig {
+    std::string listenPort = "5100";
+    std::string upstreamIP = "127.0.0.1";
+    std::string upstreamPort = "5000";
+    int impairEvery = 1;            // every Nth connection is impaired, the others pass untouched
+    int latencyMs = 0;              // added one way
+    int jitterMs = 0;               // up to this much more, never reordering the stream
+    int bandwidthKBps = 0;          // per connection and direction
+    int stallEveryMs = 0;           // the client stops reading this often...
+    int stallForMs = 0;             // ...for this long
+    int halfOpenAfterMs = 0;        // then goes silent without closing anything
+    size_t windowBytes = 256 * 1024;    // held per direction before the proxy stops reading
+    unsigned seed = 1;              // jitter is repeatable from run to run
+};
+
+struct ImpairmentStats {
+    unsigned long long accepted = 0;
+    unsigned long long impaired = 0;
+    unsigned long long stalls = 0;
+    unsigned long long halfOpened = 0;
+    unsigned long long bytesUp = 0;     // client to server
+    unsigned long long bytesDown = 0;
+    double maxHoldMs = 0;               // longest a byte waited in the proxy
+};
+
+// TCP proxy for testing on one machine what slow and broken peers do to the server. Bots or
+// the benchmark connect to it instead of the server, and it relays every connection to the
+// server through the configured impairments. A connection's bytes are released at their
+// arrival time plus the latency and jitter, then paced by a token bucket. Reading stops when a
+// direction holds a window's worth, so a slow client backs up into the server's send buffers
+// the way a real one does. Runs on the calling thread until the process ends.
+class ImpairmentProxy {
+public:
+    ImpairmentProxy(const ImpairmentConfig& config);
+    ~ImpairmentProxy();
+    void run();
+    std::string report() const;
+private:
+    typedef std::chrono::steady_clock Clock;
+    struct Chunk {
+        Clock::time_point arrived;
+        Clock::time_point due;
+        std::string data;
+        size_t offset = 0;
+    };
+    struct Direction {
+        SOCKET from = INVALID_SOCKET;
+        SOCKET to = INVALID_SOCKET;
+        std::deque<Chunk> queue;
+        size_t buffered = 0;
+        Clock::time_point lastDue;
+        TokenBucket bandwidth;
+        bool readClosed = false;    // the sender's FIN arrived
+        bool writeClosed = false;   // and was passed on
+        unsigned long long bytes = 0;
+    };
+    struct Link {
+        unsigned long long id = 0;
+        SOCKET client = INVALID_SOCKET;
+        SOCKET upstream = INVALID_SOCKET;
+        Direction up;
+        Direction down;
+        bool impaired = false;
+        bool silent = false;
+        bool failed = false;
+        Clock::time_point opened;
+        Clock::time_point nextStall;
+        Clock::time_point stalledUntil;
+        std::mt19937 random;
+    };
+    void openListener();
+    void acceptLink();
+    SOCKET connectUpstream();
+    void updateLink(Link& link, Clock::time_point now);
+    bool isStalled(const Link& link, const Direction& direction, Clock::time_point now) const;
+    void receive(Link& link, Direction& direction, Clock::time_point now);
+    void forward(Link& link, Direction& direction, Clock::time_point now);
+    bool isFinished(const Link& link, Clock::time_point now) const;
+    void closeLink(Link& link);
+    ImpairmentConfig config;
+    ImpairmentStats stats;
+    SOCKET listener;
+    std::vector<std::unique_ptr<Link>> links;
+    std::vector<char> buffer;
+};
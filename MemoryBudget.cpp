@@ -0,0 +1,112 @@
+#include "MemoryBudget.h"
+
+#include <algorithm>
+#include <sstream>
+
+std::vector<char> BufferPool::acquire()
+{
+    std::vector<char> buffer;
+    if (!spare.empty())
+    {
+        buffer.swap(spare.back());
+        spare.pop_back();
+    }
+    else
+    {
+        buffer.reserve(SESSION_BUFFER_SIZE);
+    }
+    return buffer;
+}
+
+size_t BufferPool::release(std::vector<char>& buffer)
+{
+    size_t capacity = buffer.capacity();
+    buffer.clear();
+    if (capacity == SESSION_BUFFER_SIZE && spare.size() < BUFFER_POOL_MAX)
+    {
+        spare.emplace_back();
+        spare.back().swap(buffer);
+    }
+    else
+    {
+        // Grown past the pooled size for a big frame, or the pool is full
+        std::vector<char>().swap(buffer);
+    }
+    return capacity;
+}
+
+size_t BufferPool::getSpare() const
+{
+    return spare.size();
+}
+
+MemoryBudget::MemoryBudget()
+{
+}
+
+void MemoryBudget::configure(const MemoryConfig& newConfig)
+{
+    config = newConfig;
+}
+
+const MemoryConfig& MemoryBudget::getConfig() const
+{
+    return config;
+}
+
+BufferPool& MemoryBudget::getPool()
+{
+    return pool;
+}
+
+bool MemoryBudget::admit()
+{
+    if (isOver())
+    {
+        stats.rejected++;
+        return false;
+    }
+    return true;
+}
+
+void MemoryBudget::recordSweep(size_t inUse)
+{
+    stats.inUse = inUse;
+    stats.peak = (std::max)(stats.peak, inUse);
+}
+
+bool MemoryBudget::isOver() const
+{
+    return config.budget != 0 && stats.inUse > config.budget;
+}
+
+void MemoryBudget::recordReclaim(size_t bytes)
+{
+    stats.reclaimed++;
+    stats.reclaimedBytes += bytes;
+}
+
+void MemoryBudget::recordShed(size_t bytes)
+{
+    stats.shed++;
+    stats.inUse -= (std::min)(stats.inUse, bytes);
+}
+
+const MemoryStats& MemoryBudget::getStats() const
+{
+    return stats;
+}
+
+std::string MemoryBudget::report() const
+{
+    std::ostringstream out;
+    out << "sessions=" << stats.inUse
+        << " peak=" << stats.peak
+        << " budget=" << config.budget
+        << " pooled=" << pool.getSpare()
+        << " reclaimed=" << stats.reclaimed
+        << " reclaimed_bytes=" << stats.reclaimedBytes
+        << " rejected=" << stats.rejected
+        << " shed=" << stats.shed;
+    return out.str();
+}
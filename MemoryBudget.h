@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+const size_t SESSION_BUFFER_SIZE = 4 * 1024;    // pooled inbound buffer, any chat line fits with room to spare
+const size_t BUFFER_POOL_MAX = 4096;            // spare buffers kept for sessions that wake up
+const int MEMORY_SWEEP_SECONDS = 1;
+
+// Memory held by sessions. A budget of zero disables shedding.
+struct MemoryConfig {
+    size_t budget = 512 * 1024 * 1024;  // all sessions together
+    int idleSeconds = 10;               // a session quiet this long gives its buffers back
+    size_t shedFloor = 256 * 1024;      // sessions using less are never shed, whatever the total
+};
+
+struct MemoryStats {
+    size_t inUse = 0;                       // all sessions, at the last sweep
+    size_t peak = 0;
+    unsigned long long reclaimed = 0;       // times a session gave its buffers back
+    unsigned long long reclaimedBytes = 0;
+    unsigned long long rejected = 0;        // connections refused while over budget
+    unsigned long long shed = 0;            // sessions cut off to get back under it
+};
+
+// Fixed-size inbound buffers handed between sessions. A session that goes quiet gives its
+// buffer back, however big it grew, and takes a small one from here when it next receives,
+// so a mostly idle crowd costs its sessions' metadata and not the largest frame each sent.
+class BufferPool {
+public:
+    std::vector<char> acquire();
+    // Leaves buffer empty, without any capacity
+    size_t release(std::vector<char>& buffer);
+    size_t getSpare() const;
+private:
+    std::vector<std::vector<char>> spare;
+};
+
+// Accounting for the budget: the server sums what every session holds once per sweep,
+// and refuses new connections while the last sum was over.
+class MemoryBudget {
+public:
+    MemoryBudget();
+    void configure(const MemoryConfig& config);
+    const MemoryConfig& getConfig() const;
+    BufferPool& getPool();
+    bool admit();
+    void recordSweep(size_t inUse);
+    bool isOver() const;
+    void recordReclaim(size_t bytes);
+    void recordShed(size_t bytes);
+    const MemoryStats& getStats() const;
+    std::string report() const;
+private:
+    MemoryConfig config;
+    MemoryStats stats;
+    BufferPool pool;
+};
@@ -0,0 +1,310 @@
+#include "Multicast.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+namespace {
+template <typename T>
+void put(std::string& out, const T& value)
+{
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <typename T>
+T get(const char* data)
+{
+    T value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+}
+
+MulticastPublisher::MulticastPublisher() : socket(INVALID_SOCKET), groupAddress{}, port(0),
+    history(MULTICAST_REPAIR_HISTORY), nextSequence(1), nextMemberId(1), batchCount(0)
+{
+}
+
+MulticastPublisher::~MulticastPublisher()
+{
+    if (socket != INVALID_SOCKET)
+    {
+        closesocket(socket);
+    }
+}
+
+bool MulticastPublisher::open(const std::string& newGroup, u_short newPort, const std::string& interfaceIP)
+{
+    socket = ::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (socket == INVALID_SOCKET)
+    {
+        return false;
+    }
+    // One hop: the group is for the LAN the server is on. Loopback lets clients on the
+    // server's own machine join too.
+    DWORD ttl = 1;
+    DWORD loop = 1;
+    in_addr outgoing{};
+    if (inet_pton(AF_INET, interfaceIP.c_str(), &outgoing) != 1 || outgoing.s_addr == INADDR_BROADCAST)
+    {
+        outgoing.s_addr = htonl(INADDR_ANY);
+    }
+    groupAddress.sin_family = AF_INET;
+    groupAddress.sin_port = htons(newPort);
+    if (inet_pton(AF_INET, newGroup.c_str(), &groupAddress.sin_addr) != 1
+        || setsockopt(socket, IPPROTO_IP, IP_MULTICAST_TTL, (const char*)&ttl, sizeof(ttl)) == SOCKET_ERROR
+        || setsockopt(socket, IPPROTO_IP, IP_MULTICAST_LOOP, (const char*)&loop, sizeof(loop)) == SOCKET_ERROR
+        || setsockopt(socket, IPPROTO_IP, IP_MULTICAST_IF, (const char*)&outgoing, sizeof(outgoing)) == SOCKET_ERROR)
+    {
+        closesocket(socket);
+        socket = INVALID_SOCKET;
+        return false;
+    }
+    group = newGroup;
+    port = newPort;
+    lastSend = std::chrono::steady_clock::now();
+    return true;
+}
+
+bool MulticastPublisher::isOpen() const
+{
+    return socket != INVALID_SOCKET;
+}
+
+const std::string& MulticastPublisher::getGroup() const
+{
+    return group;
+}
+
+u_short MulticastPublisher::getPort() const
+{
+    return port;
+}
+
+uint32_t MulticastPublisher::addMember()
+{
+    return nextMemberId++;
+}
+
+uint64_t MulticastPublisher::publish(std::string_view message, uint32_t origin)
+{
+    uint64_t sequence = nextSequence++;
+    Entry& entry = history[sequence % history.size()];
+    entry.sequence = sequence;
+    entry.origin = origin;
+    entry.message.assign(message.data(), message.size());
+    stats.messages++;
+
+    size_t entrySize = MULTICAST_ENTRY_HEADER_SIZE + message.size();
+    if (batchCount > 0 && batch.size() + entrySize > MULTICAST_DATAGRAM_SIZE)
+    {
+        flushBatch();
+    }
+    if (MULTICAST_HEADER_SIZE + entrySize > MULTICAST_MAX_DATAGRAM_SIZE)
+    {
+        // Receivers see the gap and get this one over TCP
+        return sequence;
+    }
+    if (batchCount == 0)
+    {
+        batch.clear();
+        put(batch, MULTICAST_MAGIC);
+        put(batch, sequence);
+        put(batch, batchCount);
+    }
+    put(batch, origin);
+    put(batch, static_cast<uint32_t>(message.size()));
+    batch.append(message.data(), message.size());
+    batchCount++;
+    memcpy(&batch[MULTICAST_HEADER_SIZE - sizeof(batchCount)], &batchCount, sizeof(batchCount));
+    if (batch.size() >= MULTICAST_DATAGRAM_SIZE)
+    {
+        flushBatch();
+    }
+    return sequence;
+}
+
+void MulticastPublisher::flush(std::chrono::steady_clock::time_point now)
+{
+    flushBatch();
+    if (now - lastSend >= std::chrono::milliseconds(MULTICAST_HEARTBEAT_MS))
+    {
+        std::string heartbeat;
+        put(heartbeat, MULTICAST_MAGIC);
+        put(heartbeat, nextSequence);
+        put(heartbeat, static_cast<uint16_t>(0));
+        sendDatagram(heartbeat);
+        stats.heartbeats++;
+    }
+}
+
+void MulticastPublisher::flushBatch()
+{
+    if (batchCount > 0)
+    {
+        sendDatagram(batch);
+        batchCount = 0;
+    }
+}
+
+void MulticastPublisher::sendDatagram(const std::string& datagram)
+{
+    if (sendto(socket, datagram.data(), static_cast<int>(datagram.size()), 0, (const sockaddr*)&groupAddress, sizeof(groupAddress)) == SOCKET_ERROR)
+    {
+        // Lost like any datagram, the receivers NACK what they miss
+        std::cerr << "Multicast send failed: " << WSAGetLastError() << std::endl;
+    }
+    stats.datagrams++;
+    lastSend = std::chrono::steady_clock::now();
+}
+
+bool MulticastPublisher::find(uint64_t sequence, std::string_view& message, uint32_t& origin) const
+{
+    if (sequence < getOldestSequence() || sequence >= nextSequence)
+    {
+        return false;
+    }
+    const Entry& entry = history[sequence % history.size()];
+    message = entry.message;
+    origin = entry.origin;
+    return true;
+}
+
+uint64_t MulticastPublisher::getOldestSequence() const
+{
+    return nextSequence > history.size() ? nextSequence - history.size() : 1;
+}
+
+uint64_t MulticastPublisher::getNextSequence() const
+{
+    return nextSequence;
+}
+
+uint32_t MulticastPublisher::getNextMemberId() const
+{
+    return nextMemberId;
+}
+
+void MulticastPublisher::restoreSequence(uint64_t sequence, uint32_t memberId)
+{
+    // Nothing before this point can be repaired, the history stayed with the old process
+    nextSequence = (std::max)(sequence, uint64_t(1));
+    nextMemberId = (std::max)(memberId, uint32_t(1));
+    for (Entry& entry : history)
+    {
+        entry.sequence = 0;
+    }
+}
+
+MulticastStats& MulticastPublisher::getStats()
+{
+    return stats;
+}
+
+const MulticastStats& MulticastPublisher::getStats() const
+{
+    return stats;
+}
+
+MulticastSequencer::MulticastSequencer() : started(false), nextExpected(0), highestSeen(0), nackedUpTo(0)
+{
+}
+
+void MulticastSequencer::start(uint64_t nextSequence)
+{
+    started = true;
+    nextExpected = nextSequence;
+    highestSeen = nextSequence;
+    nackedUpTo = nextSequence;
+    early.clear();
+}
+
+bool MulticastSequencer::isStarted() const
+{
+    return started;
+}
+
+void MulticastSequencer::receive(uint64_t sequence, uint32_t origin, std::string text, std::vector<Message>& deliver)
+{
+    if (!started || sequence < nextExpected)
+    {
+        return;     // a duplicate, or a repair that came after the original
+    }
+    highestSeen = (std::max)(highestSeen, sequence + 1);
+    early.emplace(sequence, Message{ sequence, origin, std::move(text) });
+    drain(deliver);
+}
+
+void MulticastSequencer::skip(uint64_t from, uint64_t to, std::vector<Message>& deliver)
+{
+    if (started && from <= nextExpected && to >= nextExpected)
+    {
+        nextExpected = to + 1;
+        highestSeen = (std::max)(highestSeen, nextExpected);
+        early.erase(early.begin(), early.lower_bound(nextExpected));
+        drain(deliver);
+    }
+}
+
+void MulticastSequencer::heartbeat(uint64_t serverNext)
+{
+    highestSeen = (std::max)(highestSeen, serverNext);
+}
+
+void MulticastSequencer::drain(std::vector<Message>& deliver)
+{
+    while (!early.empty() && early.begin()->first == nextExpected)
+    {
+        deliver.push_back(std::move(early.begin()->second));
+        early.erase(early.begin());
+        nextExpected++;
+    }
+}
+
+bool MulticastSequencer::takeNack(std::chrono::steady_clock::time_point now, uint64_t& from, uint64_t& to)
+{
+    if (!started || nextExpected >= highestSeen)
+    {
+        return false;
+    }
+    // The first hole; later ones are asked for once it is filled
+    from = nextExpected;
+    to = (early.empty() ? highestSeen : early.begin()->first) - 1;
+    to = (std::min)(to, from + MULTICAST_MAX_NACK_RANGE - 1);
+    // A new hole is asked for right away, one already asked for only after a while
+    if (to < nackedUpTo && now - lastNack < std::chrono::milliseconds(MULTICAST_NACK_RETRY_MS))
+    {
+        return false;
+    }
+    lastNack = now;
+    nackedUpTo = (std::max)(nackedUpTo, to + 1);
+    return true;
+}
+
+bool MulticastSequencer::parseDatagram(const char* data, size_t size, uint64_t& firstSequence, std::vector<Message>& messages)
+{
+    if (size < MULTICAST_HEADER_SIZE || get<uint32_t>(data) != MULTICAST_MAGIC)
+    {
+        return false;
+    }
+    firstSequence = get<uint64_t>(data + 4);
+    uint16_t count = get<uint16_t>(data + 12);
+    size_t position = MULTICAST_HEADER_SIZE;
+    for (uint16_t i = 0; i < count; i++)
+    {
+        if (size - position < MULTICAST_ENTRY_HEADER_SIZE)
+        {
+            return false;
+        }
+        uint32_t origin = get<uint32_t>(data + position);
+        uint32_t length = get<uint32_t>(data + position + 4);
+        position += MULTICAST_ENTRY_HEADER_SIZE;
+        if (size - position < length)
+        {
+            return false;
+        }
+        messages.push_back(Message{ firstSequence + i, origin, std::string(data + position, length) });
+        position += length;
+    }
+    return true;
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+
+#pragma comment(lib, "Ws2_32.lib")
+
+// Optional multicast data plane for chat. Sessions that join get chat messages from a
+// multicast group instead of one TCP write each, so the server sends every message once
+// however many members there are. Everything else stays on TCP.
+//
+//   client -> server   $multicast join
+//   server -> client   MULTICAST <group> <port> <next sequence> <member id>
+//   client -> server   $nack <from> <to>                 (inclusive, over TCP)
+//   server -> client   REPAIR <sequence> <origin>\n<message>
+//                      REPAIR_LOST <from> <to>           (no longer held, skip them)
+//
+// Datagram (host byte order, like the TCP framing):
+//   uint32 magic, uint64 first sequence, uint16 count, then per message
+//   uint32 origin member id, uint32 size, bytes
+// Messages sent in the same loop iteration share datagrams. An empty datagram is a
+// heartbeat carrying the next sequence, sent when idle so a lost last datagram is noticed.
+// Messages too big for one datagram are only sent as repairs.
+const char* const MULTICAST_DEFAULT_GROUP = "239.255.42.99";
+const u_short MULTICAST_DEFAULT_PORT = 5001;
+const uint32_t MULTICAST_MAGIC = 0x4D435043;               // "CPCM"
+const size_t MULTICAST_HEADER_SIZE = 4 + 8 + 2;
+const size_t MULTICAST_ENTRY_HEADER_SIZE = 4 + 4;
+const size_t MULTICAST_DATAGRAM_SIZE = 1400;                // stays under a LAN MTU
+const size_t MULTICAST_MAX_DATAGRAM_SIZE = 60 * 1024;      // fragmented, still one send
+const size_t MULTICAST_REPAIR_HISTORY = 4096;              // messages kept for NACKs
+const uint64_t MULTICAST_MAX_NACK_RANGE = 1024;
+const int MULTICAST_HEARTBEAT_MS = 1000;
+const int MULTICAST_NACK_RETRY_MS = 500;
+
+struct MulticastStats {
+    unsigned long long messages = 0;
+    unsigned long long datagrams = 0;
+    unsigned long long heartbeats = 0;
+    unsigned long long repairs = 0;
+    unsigned long long repairsLost = 0;
+};
+
+// Server side: numbers, batches and sends messages, and keeps the recent ones for repairs.
+class MulticastPublisher {
+public:
+    MulticastPublisher();
+    ~MulticastPublisher();
+    bool open(const std::string& group, u_short port, const std::string& interfaceIP);
+    bool isOpen() const;
+    const std::string& getGroup() const;
+    u_short getPort() const;
+    uint32_t addMember();
+    uint64_t publish(std::string_view message, uint32_t origin);
+    void flush(std::chrono::steady_clock::time_point now);
+    bool find(uint64_t sequence, std::string_view& message, uint32_t& origin) const;
+    uint64_t getOldestSequence() const;
+    uint64_t getNextSequence() const;
+    void restoreSequence(uint64_t nextSequence, uint32_t nextMemberId);
+    uint32_t getNextMemberId() const;
+    MulticastStats& getStats();
+    const MulticastStats& getStats() const;
+private:
+    struct Entry {
+        uint64_t sequence = 0;
+        uint32_t origin = 0;
+        std::string message;    // capacity is reused once the ring has wrapped
+    };
+    void flushBatch();
+    void sendDatagram(const std::string& datagram);
+    SOCKET socket;
+    sockaddr_in groupAddress;
+    std::string group;
+    u_short port;
+    std::vector<Entry> history;
+    uint64_t nextSequence;
+    uint32_t nextMemberId;
+    std::string batch;
+    uint16_t batchCount;
+    std::chrono::steady_clock::time_point lastSend;
+    MulticastStats stats;
+};
+
+// Client side: puts messages from datagrams and repairs back in order, and says which
+// ranges to ask the server for again.
+class MulticastSequencer {
+public:
+    struct Message {
+        uint64_t sequence;
+        uint32_t origin;
+        std::string text;
+    };
+    MulticastSequencer();
+    void start(uint64_t nextSequence);
+    bool isStarted() const;
+    void receive(uint64_t sequence, uint32_t origin, std::string text, std::vector<Message>& deliver);
+    void skip(uint64_t from, uint64_t to, std::vector<Message>& deliver);
+    void heartbeat(uint64_t serverNext);
+    bool takeNack(std::chrono::steady_clock::time_point now, uint64_t& from, uint64_t& to);
+    static bool parseDatagram(const char* data, size_t size, uint64_t& firstSequence, std::vector<Message>& messages);
+private:
+    void drain(std::vector<Message>& deliver);
+    bool started;
+    uint64_t nextExpected;
+    uint64_t highestSeen;       // one past the highest sequence known to exist
+    std::map<uint64_t, Message> early;
+    std::chrono::steady_clock::time_point lastNack;
+    uint64_t nackedUpTo;
+};
@@ -0,0 +1,198 @@
+#include "OutboundQueue.h"
+
+OutboundQueue::OutboundQueue() : wireOffset(0), controlDue(false), current(0), laneBytes(0), overflowed(false)
+{
+}
+
+void OutboundQueue::appendWire(const char* data, size_t size)
+{
+    // Reclaim what has been sent before growing
+    if (wireOffset == wire.size())
+    {
+        wire.clear();
+        wireOffset = 0;
+    }
+    else if (wireOffset > wire.size() / 2)
+    {
+        wire.erase(0, wireOffset);
+        wireOffset = 0;
+    }
+    wire.append(data, size);
+}
+
+bool OutboundQueue::hasWire() const
+{
+    return wireOffset < wire.size();
+}
+
+std::string_view OutboundQueue::getWire() const
+{
+    return std::string_view(wire.data() + wireOffset, wire.size() - wireOffset);
+}
+
+void OutboundQueue::consumeWire(size_t count)
+{
+    wireOffset += count;
+    if (wireOffset == wire.size())
+    {
+        wire.clear();
+        wireOffset = 0;
+    }
+}
+
+OutboundQueue::Lane& OutboundQueue::laneFor(OutboundClass lane)
+{
+    return lanes[lane == OUTBOUND_BULK ? 1 : 0];
+}
+
+void OutboundQueue::push(OutboundClass lane, std::string_view frame)
+{
+    if (lane == OUTBOUND_CONTROL)
+    {
+        control.emplace_back(frame);
+    }
+    else
+    {
+        laneFor(lane).frames.emplace_back(frame);
+    }
+    laneBytes += frame.size();
+}
+
+void OutboundQueue::addBulkSource(BulkSource source)
+{
+    sources.push_back(std::move(source));
+}
+
+bool OutboundQueue::next(std::string_view& frame)
+{
+    controlDue = !control.empty();
+    if (controlDue)
+    {
+        frame = control.front();
+        return true;
+    }
+    Lane& bulk = lanes[1];
+    while (bulk.frames.empty() && !sources.empty())
+    {
+        std::string part;
+        if (sources.front()(part))
+        {
+            laneBytes += part.size();
+            bulk.frames.push_back(std::move(part));
+        }
+        else
+        {
+            sources.pop_front();
+        }
+    }
+    if (lanes[0].frames.empty() && bulk.frames.empty())
+    {
+        return false;
+    }
+    // Terminates: a lane with frames gains a quantum on every visit
+    for (;;)
+    {
+        Lane& lane = lanes[current];
+        if (!lane.frames.empty() && lane.deficit >= lane.frames.front().size())
+        {
+            frame = lane.frames.front();
+            return true;
+        }
+        if (lane.frames.empty())
+        {
+            // No saving up credit while idle
+            lane.deficit = 0;
+        }
+        current = 1 - current;
+        if (!lanes[current].frames.empty())
+        {
+            lanes[current].deficit += current == 0 ? OUTBOUND_QUANTUM * OUTBOUND_CHAT_WEIGHT : OUTBOUND_QUANTUM;
+        }
+    }
+}
+
+void OutboundQueue::pop()
+{
+    if (controlDue)
+    {
+        laneBytes -= control.front().size();
+        control.pop_front();
+        controlDue = false;
+        return;
+    }
+    Lane& lane = lanes[current];
+    size_t size = lane.frames.front().size();
+    lane.deficit -= size;
+    laneBytes -= size;
+    lane.frames.pop_front();
+}
+
+void OutboundQueue::discardWaiting()
+{
+    for (Lane& lane : lanes)
+    {
+        lane.frames.clear();
+        lane.deficit = 0;
+    }
+    laneBytes = 0;
+    for (const std::string& frame : control)
+    {
+        laneBytes += frame.size();
+    }
+    sources.clear();
+}
+
+void OutboundQueue::setOverflowed()
+{
+    overflowed = true;
+    discardWaiting();
+    control.clear();
+    laneBytes = 0;
+}
+
+bool OutboundQueue::isOverflowed() const
+{
+    return overflowed;
+}
+
+bool OutboundQueue::isEmpty() const
+{
+    return !hasWire() && !hasWaiting();
+}
+
+bool OutboundQueue::hasWaiting() const
+{
+    return !control.empty() || !lanes[0].frames.empty() || !lanes[1].frames.empty() || !sources.empty();
+}
+
+bool OutboundQueue::hasBulkSources() const
+{
+    return !sources.empty();
+}
+
+size_t OutboundQueue::getBacklog() const
+{
+    return wire.size() - wireOffset + laneBytes;
+}
+
+size_t OutboundQueue::getMemoryUsage() const
+{
+    size_t frames = control.size() + lanes[0].frames.size() + lanes[1].frames.size();
+    return wire.capacity() + laneBytes + frames * sizeof(std::string) + sources.size() * sizeof(BulkSource);
+}
+
+void OutboundQueue::shrink()
+{
+    if (!isEmpty())
+    {
+        return;
+    }
+    std::string().swap(wire);
+    wireOffset = 0;
+    std::deque<std::string>().swap(control);
+    for (Lane& lane : lanes)
+    {
+        std::deque<std::string>().swap(lane.frames);
+    }
+    std::deque<BulkSource>().swap(sources);
+}
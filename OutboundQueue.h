@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <string>
+#include <string_view>
+
+// Classes of outbound traffic, highest priority first
+enum OutboundClass {
+    OUTBOUND_CONTROL = 0,   // replies, errors and file flow control
+    OUTBOUND_CHAT = 1,      // chat, presence and repairs
+    OUTBOUND_BULK = 2,      // log parts and file chunks
+};
+
+const size_t OUTBOUND_CHUNK_SIZE = 16 * 1024;               // largest bulk payload, all that chat can end up behind
+const size_t OUTBOUND_QUANTUM = OUTBOUND_CHUNK_SIZE + 256;  // a bulk part with its header
+const uint32_t OUTBOUND_CHAT_WEIGHT = 4;                    // chat bytes per bulk byte while both wait
+const size_t OUTBOUND_MAX_BACKLOG = 4 * 1024 * 1024;        // a client that lets more pile up is cut off
+const size_t OUTBOUND_MAX_BURST = 256 * 1024;               // committed per session per flush, so nobody hogs the loop
+
+// What a session is owed but its transport hasn't taken yet.
+//
+// The wire holds bytes already committed to the stream: the rest of a frame the socket only
+// took part of. Every other frame waits whole in its class's lane until the transport has
+// room, so frames can still be reordered. Control frames go first, right behind the wire.
+// The chat and bulk lanes are drained by deficit round robin: while both have frames
+// waiting, chat gets OUTBOUND_CHAT_WEIGHT times the bytes bulk does, and bulk is never starved.
+//
+// A bulk reply too big to queue in one go is a source, asked for its next frame only when
+// the bulk lane runs dry, so it is never held in memory more than a part at a time.
+class OutboundQueue {
+public:
+    typedef std::function<bool(std::string& frame)> BulkSource;    // false once it has nothing more
+    OutboundQueue();
+    void appendWire(const char* data, size_t size);
+    bool hasWire() const;
+    std::string_view getWire() const;
+    void consumeWire(size_t count);
+    void push(OutboundClass lane, std::string_view frame);
+    void addBulkSource(BulkSource source);
+    // Frame that is due next, valid until pop()
+    bool next(std::string_view& frame);
+    void pop();
+    // Chat and bulk that isn't on the wire yet; control frames still go out
+    void discardWaiting();
+    // Past OUTBOUND_MAX_BACKLOG: nothing more is queued, the session is cut off
+    void setOverflowed();
+    bool isOverflowed() const;
+    bool isEmpty() const;
+    // Frames or sources left once the wire is out
+    bool hasWaiting() const;
+    bool hasBulkSources() const;
+    size_t getBacklog() const;
+    size_t getMemoryUsage() const;
+    // Frees the buffers an empty queue still holds on to
+    void shrink();
+private:
+    struct Lane {
+        std::deque<std::string> frames;
+        size_t deficit = 0;
+    };
+    Lane& laneFor(OutboundClass lane);
+    std::string wire;
+    size_t wireOffset;
+    std::deque<std::string> control;
+    bool controlDue;            // next() returned a control frame
+    Lane lanes[2];              // chat, bulk
+    int current;                // lane being served
+    size_t laneBytes;
+    std::deque<BulkSource> sources;
+    bool overflowed;
+};
@@ -12,6 +12,7 @@ enum OutputMessageType {
     STARTUP_ERROR = 6,
     ADDRESS_ERROR = 7,
     PARAMETER_ERROR = 8,
+    CHECK_FAILED = 9,
 };
 
 #endif // OUTPUT_MESSAGES_H
\ No newline at end of file
@@ -2,12 +2,20 @@
 #include <string>
 #include <thread>
 #include <mutex>
+#include <atomic>
 #include <winsock2.h>
 #include <ws2tcpip.h>
 #include "OutputValues.h"
 #include "Client.h"
 #include "Server.h"
+#include "Benchmark.h"
+#include "Console.h"
+#include "ImpairmentProxy.h"
 #include <limits>
+#include <algorithm>
+#include <sstream>
+#include <cstring>
+#include <cstdlib>
 
 #pragma comment(lib, "Ws2_32.lib")
 
@@ -15,18 +23,223 @@
 //IP test: 127.0.0.1
 //Port test: 5000
 //Wireshark filter: ip.addr == 127.0.0.1 or tcp.port == 5000 or udp.port == 5000 ip.src = 127.0
-int main()
+//Server options: --engine select|rio, --max-clients N, --no-rate-limits (for benchmarks),
+//                --upgrade (take the sessions over from the server running on the same port),
+//                --multicast [group[:port]] (fan chat out over UDP multicast, default 239.255.42.99:5001),
+//                --memory-budget MB (memory all sessions may hold before new ones are refused, 0 for no limit),
+//                --filter path (banned terms, one per line, "?term" only flags; reloaded when the file changes)
+//                --busy-poll us (keep polling this long after the last event before sleeping, 0 for off),
+//                --pin-cores 2[,3...] (CPUs the server loop thread may run on)
+//                --compress-threshold bytes (smallest frame compressed for clients that ask, default 1024, 0 for never)
+//Client and benchmark options: --local (the server's local socket instead of TCP), --shm (local socket, then shared memory)
+//Client options: --no-compression (don't ask the server for compressed frames),
+//                --tls (TLS only, a server whose broadcast doesn't offer it is refused)
+//Benchmark options: --port N (the server's port, or a proxy's), --rate N (messages per second, default as fast as possible),
+//                   --check-allocations (relay the burst again and fail unless the server allocated nothing for it)
+//Proxy options: --listen port (default 5100), --upstream ip:port (default 127.0.0.1:5000), --impair-every N (default 1, all),
+//               --latency ms, --jitter ms, --bandwidth KB/s, --stall every_ms:for_ms, --half-open after_ms,
+//               --window KB (held per direction before the proxy stops reading, default 256)
+int main(int argc, char* argv[])
 {
+    IoEngineType engine = IO_ENGINE_SELECT;
+    int maxClients = MAX_CLIENTS;
+    bool rateLimits = true;
+    bool upgrade = false;
+    bool multicast = false;
+    std::string multicastGroup = MULTICAST_DEFAULT_GROUP;
+    u_short multicastPort = MULTICAST_DEFAULT_PORT;
+    bool localTransport = false;
+    bool sharedMemory = false;
+    MemoryConfig memoryConfig;
+    std::string filterPath;
+    size_t compressThreshold = COMPRESS_DEFAULT_THRESHOLD;
+    bool compression = true;
+    bool tls = false;
+    std::string benchmarkPort = "5000";
+    int benchmarkRate = 0;
+    bool checkAllocations = false;
+    BusyPollConfig busyPoll;
+    ImpairmentConfig impairment;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc)
+        {
+            engine = strcmp(argv[++i], "rio") == 0 ? IO_ENGINE_RIO : IO_ENGINE_SELECT;
+        }
+        else if (strcmp(argv[i], "--max-clients") == 0 && i + 1 < argc)
+        {
+            maxClients = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--memory-budget") == 0 && i + 1 < argc)
+        {
+            memoryConfig.budget = static_cast<size_t>(atoll(argv[++i])) * 1024 * 1024;
+        }
+        else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc)
+        {
+            filterPath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--compress-threshold") == 0 && i + 1 < argc)
+        {
+            compressThreshold = static_cast<size_t>(atoll(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--no-compression") == 0)
+        {
+            compression = false;
+        }
+        else if (strcmp(argv[i], "--tls") == 0)
+        {
+            tls = true;
+        }
+        else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc)
+        {
+            benchmarkPort = argv[++i];
+        }
+        else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc)
+        {
+            benchmarkRate = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--check-allocations") == 0)
+        {
+            checkAllocations = true;
+        }
+        else if (strcmp(argv[i], "--busy-poll") == 0 && i + 1 < argc)
+        {
+            busyPoll.spinMicroseconds = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--pin-cores") == 0 && i + 1 < argc)
+        {
+            std::istringstream cores(argv[++i]);
+            std::string core;
+            while (std::getline(cores, core, ','))
+            {
+                busyPoll.cores.push_back(atoi(core.c_str()));
+            }
+        }
+        else if (strcmp(argv[i], "--listen") == 0 && i + 1 < argc)
+        {
+            impairment.listenPort = argv[++i];
+        }
+        else if (strcmp(argv[i], "--upstream") == 0 && i + 1 < argc)
+        {
+            std::string address = argv[++i];
+            size_t colon = address.find(':');
+            if (colon != std::string::npos)
+            {
+                impairment.upstreamPort = address.substr(colon + 1);
+                address.resize(colon);
+            }
+            impairment.upstreamIP = address;
+        }
+        else if (strcmp(argv[i], "--impair-every") == 0 && i + 1 < argc)
+        {
+            impairment.impairEvery = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--latency") == 0 && i + 1 < argc)
+        {
+            impairment.latencyMs = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--jitter") == 0 && i + 1 < argc)
+        {
+            impairment.jitterMs = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--bandwidth") == 0 && i + 1 < argc)
+        {
+            impairment.bandwidthKBps = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--stall") == 0 && i + 1 < argc)
+        {
+            const char* stall = argv[++i];
+            impairment.stallEveryMs = atoi(stall);
+            const char* colon = strchr(stall, ':');
+            impairment.stallForMs = colon != NULL ? atoi(colon + 1) : 0;
+        }
+        else if (strcmp(argv[i], "--half-open") == 0 && i + 1 < argc)
+        {
+            impairment.halfOpenAfterMs = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--window") == 0 && i + 1 < argc)
+        {
+            impairment.windowBytes = static_cast<size_t>((std::max)(atoi(argv[++i]), 1)) * 1024;
+        }
+        else if (strcmp(argv[i], "--no-rate-limits") == 0)
+        {
+            rateLimits = false;
+        }
+        else if (strcmp(argv[i], "--upgrade") == 0)
+        {
+            upgrade = true;
+        }
+        else if (strcmp(argv[i], "--local") == 0)
+        {
+            localTransport = true;
+        }
+        else if (strcmp(argv[i], "--shm") == 0)
+        {
+            localTransport = true;
+            sharedMemory = true;
+        }
+        else if (strcmp(argv[i], "--multicast") == 0)
+        {
+            multicast = true;
+            if (i + 1 < argc && strncmp(argv[i + 1], "--", 2) != 0)
+            {
+                std::string address = argv[++i];
+                size_t colon = address.find(':');
+                if (colon != std::string::npos)
+                {
+                    multicastPort = static_cast<u_short>(atoi(address.c_str() + colon + 1));
+                    address.resize(colon);
+                }
+                multicastGroup = address;
+            }
+        }
+    }
+
     std::string input;
-    std::cout << "Start as [s]erver or [c]lient? ";
+    std::cout << "Start as [s]erver, [c]lient, [b]enchmark or impairment [p]roxy? ";
     std::cin >> input;
 
     if (input == "s") //Server loop
     {
         // Start server
-        Server server(MAX_CLIENTS, "5000");
+        Server server(maxClients, "5000");
+        server.setIoEngine(engine);
+        server.setTakeOver(upgrade);
+        server.setMemoryConfig(memoryConfig);
+        server.setCompressionThreshold(compressThreshold);
+        server.setBusyPoll(busyPoll);
+        if (multicast)
+        {
+            server.enableMulticast(multicastGroup, multicastPort);
+        }
+        if (!rateLimits)
+        {
+            SessionLimits limits;
+            limits.messagesPerSecond = 0;
+            limits.bytesPerSecond = 0;
+            limits.transferBytesPerSecond = 0;
+            limits.transferChunksPerSecond = 0;
+            server.setSessionLimits(limits);
+            AdmissionConfig admission;
+            admission.globalAcceptRate = 0;
+            admission.perIpAcceptRate = 0;
+            admission.maxConnectionsPerIp = 0;
+            server.setAdmissionConfig(admission);
+        }
         try
         {
+            if (!filterPath.empty())
+            {
+                server.enableContentFilter(filterPath);
+            }
+            // Optional TLS; scripts/New-CppChatTestCertificate.ps1 creates a local test certificate
+            std::string certificateSubject;
+            std::cout << "TLS certificate subject (- for plaintext): ";
+            std::cin >> certificateSubject;
+            if (certificateSubject != "-")
+            {
+                server.enableTls(certificateSubject);
+            }
             server.run();
         }
         catch (const std::exception& ex)
@@ -39,10 +252,22 @@ int main()
     {
         // Initialize Client
         Client client;
+        client.setCompression(compression);
+        if (tls)
+        {
+            client.enableTls(true);
+        }
         try
         {
-            // Connect to server
-            client.listenForUdpBroadcast();
+            // Connect to server, found by its broadcast unless it runs on this machine
+            if (localTransport)
+            {
+                client.connectLocal("5000", sharedMemory);
+            }
+            else
+            {
+                client.listenForUdpBroadcast();
+            }
             // Register username
             std::string username;
             std::cout << "Enter username: ";
@@ -56,7 +281,11 @@ int main()
         }
 
         // Main loop
-        bool quitFlag = false;
+        std::atomic<bool> quitFlag(false);
+        // Everything shown from here on is queued and drawn by the console's renderer thread
+        Console console;
+        console.start();
+        client.setDisplay([&console](std::string text) { console.write(std::move(text)); });
         // Start a thread to listen for incoming messages from the server
         std::thread serverListener([&]()
             {
@@ -67,14 +296,16 @@ int main()
                     {
                         std::string message = client.receiveMessage(quitFlag);
                         if (message != "")
-                            std::cout << message;
+                            console.write(std::move(message));
                     }
                     catch (const std::exception& ex)
                     {
+                        console.stop();
                         std::cerr << "Error: " << ex.what() << std::endl;
                         break;
                     }
                 }
+                console.stop();
                 exit(0);
                 //return 0;
             });
@@ -85,7 +316,7 @@ int main()
                 while (client.isConnected() && !quitFlag)
                 {
                     std::string input;
-                    std::cout << "Enter command or message: ";
+                    console.prompt();
                     std::getline(std::cin >> std::ws, input);
                     if (quitFlag)
                         break;
@@ -98,15 +329,18 @@ int main()
                         helpMessage += "$getlog: Returns the chat log.\n\n";
                         helpMessage += "$exit: Disconnects the user from the server.\n\n";
                         helpMessage += "$chat message: Sends a message to all connected clients.\n\n";
+                        helpMessage += "$stats: Shows server counters (connections, admission control).\n\n";
+                        helpMessage += "$sendfile user|#all path: Offers a file to one user or to everybody, and streams it once accepted.\n\n";
+                        helpMessage += "$accept id / $decline id: Answers a file offer. Accepted files are saved as received_<name>, partial ones resume.\n\n";
+                        helpMessage += "$multicast join / $multicast leave: Receives chat over the server's multicast group, if it has one, instead of TCP.\n\n";
                         helpMessage += "$help: Displays this help message.\n\n";
-                        helpMessage += "Enter command or message: ";
-                        std::cout << helpMessage;
+                        console.write(helpMessage);
                         std::getline(std::cin >> std::ws, input);
                     }
                     if (input == "$quit") //Function to simulate forced quit, not to confuse with $exit
                     {
                         quitFlag = true;
-                        std::cout << "You have quitted the chat\n";
+                        console.write("You have quitted the chat\n");
                         break;
                     }
                     else if (input.find("$chat") == 0)
@@ -121,6 +355,41 @@ int main()
                             std::cerr << "Error: " << ex.what() << std::endl;
                         }
                     }
+                    else if (input.find("$sendfile ") == 0 || input.find("$accept ") == 0 || input.find("$decline ") == 0)
+                    {
+                        // File transfers run in the background, chat keeps working meanwhile
+                        try
+                        {
+                            std::istringstream arguments(input);
+                            std::string command;
+                            arguments >> command;
+                            if (command == "$sendfile")
+                            {
+                                std::string target;
+                                std::string path;
+                                arguments >> target;
+                                std::getline(arguments >> std::ws, path);
+                                client.sendFile(target, path);
+                            }
+                            else
+                            {
+                                uint32_t id = 0;
+                                arguments >> id;
+                                if (command == "$accept")
+                                {
+                                    client.acceptFile(id);
+                                }
+                                else
+                                {
+                                    client.declineFile(id);
+                                }
+                            }
+                        }
+                        catch (const std::exception& ex)
+                        {
+                            std::cerr << "Error: " << ex.what() << std::endl;
+                        }
+                    }
                     else
                     {
                         // Send other command to server
@@ -141,8 +410,53 @@ int main()
 
         // Close connection
         client.closeConnection();
+        console.stop();
 
     }
+    else if (input == "b") //Benchmark against a running server
+    {
+        BenchmarkConfig config;
+        config.transport = sharedMemory ? "shm" : localTransport ? "local" : "tcp";
+        config.port = benchmarkPort;
+        config.messagesPerSecond = benchmarkRate;
+        config.checkAllocations = checkAllocations;
+        std::cout << "Server IP address: ";
+        std::cin >> config.serverIP;
+        std::cout << "Connections (including the sender): ";
+        std::cin >> config.connections;
+        std::cout << "Messages: ";
+        std::cin >> config.messages;
+        try
+        {
+            Benchmark benchmark(config);
+            BenchmarkResult result = benchmark.run();
+            std::cout << Benchmark::formatResult(config, result) << std::endl;
+            if (config.checkAllocations && result.allocations != 0)
+            {
+                std::cerr << "Allocation check failed: the server allocated " << result.allocations << " times relaying "
+                    << config.messages << " messages" << std::endl;
+                return OutputMessageType::CHECK_FAILED;
+            }
+        }
+        catch (const std::exception& ex)
+        {
+            std::cerr << "Error: " << ex.what() << std::endl;
+            return OutputMessageType::CONNECT_ERROR;
+        }
+    }
+    else if (input == "p") //Impairment proxy in front of a running server, for the benchmark or bots
+    {
+        try
+        {
+            ImpairmentProxy proxy(impairment);
+            proxy.run();
+        }
+        catch (const std::exception& ex)
+        {
+            std::cerr << "Error: " << ex.what() << std::endl;
+            return OutputMessageType::STARTUP_ERROR;
+        }
+    }
     else
     {
         std::cout << "Invalid input." << std::endl;
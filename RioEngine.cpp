@@ -0,0 +1,481 @@
+#include "RioEngine.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+const ULONGLONG RECEIVE_CONTEXT = ~0ULL;
+const ULONG COMPLETION_BATCH = 256;
+}
+
+RioEngine::RioEngine() : initialized(false), completionQueue(RIO_INVALID_CQ), completionEvent(NULL), notifyArmed(false),
+    receiveRegion(NULL), sendRegion(NULL), receiveBuffer(RIO_INVALID_BUFFERID), sendBuffer(RIO_INVALID_BUFFERID)
+{
+    ZeroMemory(&rio, sizeof(rio));
+}
+
+RioEngine::~RioEngine()
+{
+    // Request queues go away with their sockets. The server has closed its own by now,
+    // detached ones still draining are closed here.
+    for (size_t index : draining)
+    {
+        closesocket(connections[index].socket);
+    }
+    if (completionQueue != RIO_INVALID_CQ)
+    {
+        rio.RIOCloseCompletionQueue(completionQueue);
+    }
+    if (receiveBuffer != RIO_INVALID_BUFFERID)
+    {
+        rio.RIODeregisterBuffer(receiveBuffer);
+    }
+    if (sendBuffer != RIO_INVALID_BUFFERID)
+    {
+        rio.RIODeregisterBuffer(sendBuffer);
+    }
+    if (receiveRegion != NULL)
+    {
+        VirtualFree(receiveRegion, 0, MEM_RELEASE);
+    }
+    if (sendRegion != NULL)
+    {
+        VirtualFree(sendRegion, 0, MEM_RELEASE);
+    }
+    if (completionEvent != NULL)
+    {
+        WSACloseEvent(completionEvent);
+    }
+}
+
+bool RioEngine::initialize(SOCKET anySocket, int maxSessions)
+{
+    if (maxSessions > RIO_MAX_SESSIONS)
+    {
+        return false;
+    }
+    GUID functionTableId = WSAID_MULTIPLE_RIO;
+    DWORD bytes = 0;
+    rio.cbSize = sizeof(rio);
+    if (WSAIoctl(anySocket, SIO_GET_MULTIPLE_EXTENSION_FUNCTION_POINTER, &functionTableId, sizeof(functionTableId),
+        &rio, sizeof(rio), &bytes, NULL, NULL) == SOCKET_ERROR)
+    {
+        return false;
+    }
+
+    // Spare connections: a closed socket's queue can still have completions in flight,
+    // its slot is only reused once they are in.
+    size_t connectionCount = static_cast<size_t>(maxSessions) + 16;
+    size_t slotCount = (std::max)(static_cast<size_t>(256), connectionCount * RIO_SEND_SLOTS_PER_SESSION);
+    DWORD receiveSize = static_cast<DWORD>(connectionCount * RIO_RECEIVE_SIZE);
+    DWORD sendSize = static_cast<DWORD>(slotCount * RIO_SEND_SLOT_SIZE);
+    receiveRegion = static_cast<char*>(VirtualAlloc(NULL, receiveSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+    sendRegion = static_cast<char*>(VirtualAlloc(NULL, sendSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+    if (receiveRegion == NULL || sendRegion == NULL)
+    {
+        return false;
+    }
+    receiveBuffer = rio.RIORegisterBuffer(receiveRegion, receiveSize);
+    sendBuffer = rio.RIORegisterBuffer(sendRegion, sendSize);
+    if (receiveBuffer == RIO_INVALID_BUFFERID || sendBuffer == RIO_INVALID_BUFFERID)
+    {
+        return false;
+    }
+
+    completionEvent = WSACreateEvent();
+    if (completionEvent == NULL)
+    {
+        return false;
+    }
+    RIO_NOTIFICATION_COMPLETION notification;
+    ZeroMemory(&notification, sizeof(notification));
+    notification.Type = RIO_EVENT_COMPLETION;
+    notification.Event.EventHandle = completionEvent;
+    notification.Event.NotifyReset = TRUE;
+    completionQueue = rio.RIOCreateCompletionQueue(static_cast<DWORD>(connectionCount * (1 + RIO_MAX_SENDS_PER_QUEUE)), &notification);
+    if (completionQueue == RIO_INVALID_CQ)
+    {
+        return false;
+    }
+
+    connections.resize(connectionCount);
+    for (size_t i = slotCount; i > 0; i--)
+    {
+        freeSlots.push_back(static_cast<int>(i - 1));
+    }
+    initialized = true;
+    return true;
+}
+
+bool RioEngine::isInitialized() const
+{
+    return initialized;
+}
+
+bool RioEngine::attach(SOCKET socket, Session* owner)
+{
+    for (size_t index = 0; index < connections.size(); index++)
+    {
+        Connection& connection = connections[index];
+        if (connection.owner != nullptr || connection.socket != INVALID_SOCKET || connection.receivePosted || connection.sendsOutstanding > 0)
+        {
+            continue;
+        }
+        // The generation tells completions of a previous socket on this slot apart.
+        connection.generation++;
+        ULONGLONG context = (static_cast<ULONGLONG>(connection.generation) << 32) | index;
+        connection.queue = rio.RIOCreateRequestQueue(socket, 1, 1, RIO_MAX_SENDS_PER_QUEUE, 1,
+            completionQueue, completionQueue, reinterpret_cast<PVOID>(static_cast<ULONG_PTR>(context)));
+        if (connection.queue == RIO_INVALID_RQ)
+        {
+            return false;
+        }
+        connection.owner = owner;
+        connection.socket = socket;
+        connectionOf[owner] = index;
+        return postReceive(owner);
+    }
+    return false;
+}
+
+void RioEngine::detach(Session* owner)
+{
+    auto it = connectionOf.find(owner);
+    if (it == connectionOf.end())
+    {
+        return;
+    }
+    Connection& connection = connections[it->second];
+    // Closing the socket cancels posted sends, so it stays open until queued output has reached
+    // the kernel. Nothing waits for that here, poll() closes it once the last send completes or
+    // the deadline passes; a peer that doesn't read may never take it. The connection is only
+    // reused once its last send has completed.
+    if (connection.openSlot >= 0 && connection.openUsed > 0)
+    {
+        postOpenSlot(connection);
+    }
+    if (connection.deferred)
+    {
+        rio.RIOSend(connection.queue, NULL, 0, RIO_MSG_COMMIT_ONLY, NULL);
+        connection.deferred = false;
+        stats.commits++;
+    }
+    if (connection.openSlot >= 0)
+    {
+        freeSlots.push_back(connection.openSlot);
+        connection.openSlot = -1;
+        connection.openUsed = 0;
+    }
+    pending.erase(std::remove_if(pending.begin(), pending.end(),
+        [owner](const RioReceive& receive) { return receive.owner == owner; }), pending.end());
+    connection.owner = nullptr;
+    connection.queue = RIO_INVALID_RQ;
+    connection.drainDeadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(RIO_DRAIN_TIMEOUT_MS);
+    draining.push_back(it->second);
+    connectionOf.erase(it);
+    closeDrained();
+}
+
+void RioEngine::closeDrained()
+{
+    auto now = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < draining.size();)
+    {
+        Connection& connection = connections[draining[i]];
+        if (connection.sendsOutstanding > 0 && now < connection.drainDeadline)
+        {
+            i++;
+            continue;
+        }
+        closesocket(connection.socket);
+        connection.socket = INVALID_SOCKET;
+        draining[i] = draining.back();
+        draining.pop_back();
+    }
+}
+
+RioEngine::Connection* RioEngine::find(Session* owner)
+{
+    auto it = connectionOf.find(owner);
+    return it == connectionOf.end() ? nullptr : &connections[it->second];
+}
+
+bool RioEngine::postReceive(Session* owner)
+{
+    Connection* connection = find(owner);
+    if (connection == nullptr)
+    {
+        return false;
+    }
+    if (connection->receivePosted)
+    {
+        return true;
+    }
+    RIO_BUF buffer;
+    buffer.BufferId = receiveBuffer;
+    buffer.Offset = static_cast<ULONG>((connection - connections.data()) * RIO_RECEIVE_SIZE);
+    buffer.Length = RIO_RECEIVE_SIZE;
+    if (!rio.RIOReceive(connection->queue, &buffer, 1, 0, reinterpret_cast<PVOID>(static_cast<ULONG_PTR>(RECEIVE_CONTEXT))))
+    {
+        return false;
+    }
+    connection->receivePosted = true;
+    return true;
+}
+
+bool RioEngine::send(Session* owner, const char* data, size_t size, const char* more, size_t moreSize)
+{
+    Connection* connection = find(owner);
+    if (connection == nullptr)
+    {
+        return false;
+    }
+    // All or nothing, half a frame in the stream would corrupt it. Sends that completed
+    // meanwhile may have made room, but nothing is waited for.
+    if (!hasRoom(*connection, size + moreSize))
+    {
+        reap(0);
+        if (!hasRoom(*connection, size + moreSize))
+        {
+            stats.refused++;
+            return false;
+        }
+    }
+    const char* parts[2] = { data, more };
+    size_t sizes[2] = { size, moreSize };
+    for (int part = 0; part < 2; part++)
+    {
+        const char* source = parts[part];
+        size_t left = sizes[part];
+        while (left > 0)
+        {
+            if (connection->openSlot < 0 || connection->openUsed == RIO_SEND_SLOT_SIZE)
+            {
+                if (connection->openSlot >= 0 && !postOpenSlot(*connection))
+                {
+                    return false;
+                }
+                int slot = acquireSlot();
+                if (slot < 0)
+                {
+                    return false;
+                }
+                connection->openSlot = slot;
+                connection->openUsed = 0;
+                dirty.push_back(static_cast<size_t>(connection - connections.data()));
+            }
+            size_t count = (std::min)(left, static_cast<size_t>(RIO_SEND_SLOT_SIZE - connection->openUsed));
+            memcpy(sendRegion + static_cast<size_t>(connection->openSlot) * RIO_SEND_SLOT_SIZE + connection->openUsed, source, count);
+            connection->openUsed += static_cast<uint32_t>(count);
+            source += count;
+            left -= count;
+        }
+    }
+    stats.bytesSent += size + moreSize;
+    return true;
+}
+
+bool RioEngine::canSend(Session* owner, size_t size)
+{
+    // Half the queue in flight is plenty to keep the connection busy
+    Connection* connection = find(owner);
+    if (connection == nullptr || connection->sendsOutstanding >= RIO_MAX_SENDS_PER_QUEUE / 2)
+    {
+        return false;
+    }
+    if (!hasRoom(*connection, size))
+    {
+        reap(0);
+    }
+    return hasRoom(*connection, size);
+}
+
+bool RioEngine::hasRoom(const Connection& connection, size_t size) const
+{
+    // What the open slot doesn't take needs fresh slots, and each one takes over from a
+    // slot that is then posted
+    size_t room = connection.openSlot >= 0 ? RIO_SEND_SLOT_SIZE - connection.openUsed : 0;
+    if (size <= room)
+    {
+        return true;
+    }
+    size_t slots = (size - room + RIO_SEND_SLOT_SIZE - 1) / RIO_SEND_SLOT_SIZE;
+    size_t posts = connection.openSlot >= 0 ? slots : slots - 1;
+    return freeSlots.size() >= slots && connection.sendsOutstanding + posts <= RIO_MAX_SENDS_PER_QUEUE;
+}
+
+bool RioEngine::postOpenSlot(Connection& connection)
+{
+    if (connection.sendsOutstanding == RIO_MAX_SENDS_PER_QUEUE)
+    {
+        // Queue full, the slot stays open until one of the sends completes
+        return false;
+    }
+    RIO_BUF buffer;
+    buffer.BufferId = sendBuffer;
+    buffer.Offset = static_cast<ULONG>(connection.openSlot) * RIO_SEND_SLOT_SIZE;
+    buffer.Length = connection.openUsed;
+    int slot = connection.openSlot;
+    connection.openSlot = -1;
+    connection.openUsed = 0;
+    if (!rio.RIOSend(connection.queue, &buffer, 1, RIO_MSG_DEFER, reinterpret_cast<PVOID>(static_cast<ULONG_PTR>(slot))))
+    {
+        freeSlots.push_back(slot);
+        return false;
+    }
+    connection.sendsOutstanding++;
+    connection.deferred = true;
+    stats.sends++;
+    return true;
+}
+
+int RioEngine::acquireSlot()
+{
+    if (freeSlots.empty())
+    {
+        return -1;
+    }
+    int slot = freeSlots.back();
+    freeSlots.pop_back();
+    return slot;
+}
+
+void RioEngine::flush()
+{
+    // One commit per queue for everything posted since the last flush.
+    std::vector<size_t> flushing;
+    flushing.swap(dirty);
+    for (size_t index : flushing)
+    {
+        Connection& connection = connections[index];
+        if (connection.owner == nullptr)
+        {
+            continue;
+        }
+        if (connection.openSlot >= 0)
+        {
+            if (connection.openUsed == 0)
+            {
+                freeSlots.push_back(connection.openSlot);
+                connection.openSlot = -1;
+            }
+            else if (!postOpenSlot(connection) && connection.openSlot >= 0)
+            {
+                // Its queue is full, posted on a later flush once sends have completed
+                dirty.push_back(index);
+            }
+        }
+        if (connection.deferred)
+        {
+            rio.RIOSend(connection.queue, NULL, 0, RIO_MSG_COMMIT_ONLY, NULL);
+            connection.deferred = false;
+            stats.commits++;
+        }
+    }
+}
+
+void RioEngine::wait(HANDLE other, DWORD timeoutMs)
+{
+    if (!pending.empty())
+    {
+        return;
+    }
+    // A draining socket's deadline is checked in poll(), so don't sleep past it
+    auto now = std::chrono::steady_clock::now();
+    for (size_t index : draining)
+    {
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(connections[index].drainDeadline - now).count();
+        timeoutMs = (std::min)(timeoutMs, left > 0 ? static_cast<DWORD>(left) + 1 : 0);
+    }
+    armNotify();
+    HANDLE handles[2] = { completionEvent, other };
+    DWORD result = WaitForMultipleObjects(other != NULL ? 2 : 1, handles, FALSE, timeoutMs);
+    if (result == WAIT_OBJECT_0)
+    {
+        notifyArmed = false;
+    }
+}
+
+void RioEngine::armNotify()
+{
+    // The queue signals its event once after each RIONotify, and right away if it isn't empty.
+    if (!notifyArmed)
+    {
+        INT result = rio.RIONotify(completionQueue);
+        notifyArmed = result == ERROR_SUCCESS || result == WSAEALREADY;
+    }
+}
+
+ULONG RioEngine::reap(DWORD timeoutMs)
+{
+    RIORESULT results[COMPLETION_BATCH];
+    ULONG count = rio.RIODequeueCompletion(completionQueue, results, COMPLETION_BATCH);
+    if (count == 0 && timeoutMs > 0)
+    {
+        // On the event itself, wait() returns at once while receives are pending
+        armNotify();
+        if (WaitForSingleObject(completionEvent, timeoutMs) == WAIT_OBJECT_0)
+        {
+            notifyArmed = false;
+        }
+        count = rio.RIODequeueCompletion(completionQueue, results, COMPLETION_BATCH);
+    }
+    if (count == RIO_CORRUPT_CQ)
+    {
+        throw std::runtime_error("Registered I/O completion queue corrupted");
+    }
+    for (ULONG i = 0; i < count; i++)
+    {
+        handleCompletion(results[i]);
+    }
+    return count;
+}
+
+void RioEngine::handleCompletion(const RIORESULT& result)
+{
+    size_t index = static_cast<size_t>(result.SocketContext & 0xFFFFFFFF);
+    uint32_t generation = static_cast<uint32_t>(result.SocketContext >> 32);
+    if (index >= connections.size())
+    {
+        return;
+    }
+    Connection& connection = connections[index];
+    if (result.RequestContext != RECEIVE_CONTEXT)
+    {
+        freeSlots.push_back(static_cast<int>(result.RequestContext));
+        if (connection.sendsOutstanding > 0)
+        {
+            connection.sendsOutstanding--;
+        }
+        return;
+    }
+    connection.receivePosted = false;
+    if (connection.owner == nullptr || connection.generation != generation)
+    {
+        return;
+    }
+    stats.receives++;
+    RioReceive receive;
+    receive.owner = connection.owner;
+    receive.data = receiveRegion + index * RIO_RECEIVE_SIZE;
+    receive.size = result.Status == 0 ? static_cast<int>(result.BytesTransferred) : SOCKET_ERROR;
+    pending.push_back(receive);
+}
+
+void RioEngine::poll(std::vector<RioReceive>& received)
+{
+    // Drain the queue; send completions only free slots, receives are handed out.
+    while (reap(0) == COMPLETION_BATCH)
+    {
+    }
+    closeDrained();
+    received.clear();
+    received.swap(pending);
+}
+
+const RioStats& RioEngine::getStats() const
+{
+    return stats;
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include <winsock2.h>
+#include <mswsock.h>
+#include <windows.h>
+
+#pragma comment(lib, "Ws2_32.lib")
+
+class Session;
+
+const uint32_t RIO_RECEIVE_SIZE = 64 * 1024;    // registered receive buffer per connection
+const uint32_t RIO_SEND_SLOT_SIZE = 16 * 1024;  // unit of the registered send pool
+const uint32_t RIO_MAX_SENDS_PER_QUEUE = 64;
+const uint32_t RIO_SEND_SLOTS_PER_SESSION = 8;
+// A registered buffer is at most 4 GiB, and the send pool takes 128 KiB per connection
+const int RIO_MAX_SESSIONS = 32000;
+const DWORD RIO_DRAIN_TIMEOUT_MS = 1000;        // for a closing socket's output to reach the kernel
+
+// A receive completed by the engine. data points into the connection's registered
+// buffer and stays valid until the next receive is posted for that session.
+struct RioReceive {
+    Session* owner;
+    const char* data;
+    int size;
+};
+
+struct RioStats {
+    unsigned long long receives = 0;
+    unsigned long long sends = 0;
+    unsigned long long commits = 0;
+    unsigned long long refused = 0;     // sends turned away for want of a slot or queue room
+    unsigned long long bytesSent = 0;
+};
+
+// Registered I/O backend: every socket gets a request queue, all of them complete into
+// one completion queue, and data moves through buffers registered once at startup, so
+// no send or receive pins memory or allocates in the kernel.
+// Outbound bytes are appended to the session's open send slot and only posted on flush(),
+// deferred, then committed with one call per queue: a fan-out to every session costs one
+// kernel transition per session instead of two sends per frame.
+// The engine never waits for room: a send that doesn't fit in the free slots and the
+// queue's remaining sends is refused whole, and canSend tells the caller beforehand, so
+// the frame can wait in the session's outbound queue instead.
+class RioEngine {
+public:
+    RioEngine();
+    ~RioEngine();
+    bool initialize(SOCKET anySocket, int maxSessions);
+    bool isInitialized() const;
+    bool attach(SOCKET socket, Session* owner);
+    // Takes the socket over and closes it once its queued output has gone out
+    void detach(Session* owner);
+    bool postReceive(Session* owner);
+    // False, with nothing sent, if it doesn't fit right now
+    bool send(Session* owner, const char* data, size_t size, const char* more = NULL, size_t moreSize = 0);
+    // Room for size more bytes without waiting on completions
+    bool canSend(Session* owner, size_t size);
+    void flush();
+    void wait(HANDLE other, DWORD timeoutMs);
+    void poll(std::vector<RioReceive>& received);
+    const RioStats& getStats() const;
+private:
+    struct Connection {
+        Session* owner = nullptr;
+        uint32_t generation = 0;
+        RIO_RQ queue = RIO_INVALID_RQ;
+        bool receivePosted = false;
+        int openSlot = -1;          // slot being filled, not posted yet
+        uint32_t openUsed = 0;
+        uint32_t sendsOutstanding = 0;
+        bool deferred = false;      // posted sends waiting for a commit
+        SOCKET socket = INVALID_SOCKET;
+        std::chrono::steady_clock::time_point drainDeadline;    // detached, closed by then at the latest
+    };
+    bool hasRoom(const Connection& connection, size_t size) const;
+    bool postOpenSlot(Connection& connection);
+    int acquireSlot();
+    void armNotify();
+    ULONG reap(DWORD timeoutMs);
+    void handleCompletion(const RIORESULT& result);
+    void closeDrained();
+    Connection* find(Session* owner);
+
+    RIO_EXTENSION_FUNCTION_TABLE rio;
+    bool initialized;
+    RIO_CQ completionQueue;
+    HANDLE completionEvent;
+    bool notifyArmed;
+    char* receiveRegion;
+    char* sendRegion;
+    RIO_BUFFERID receiveBuffer;
+    RIO_BUFFERID sendBuffer;
+    std::vector<Connection> connections;
+    std::unordered_map<Session*, size_t> connectionOf;
+    std::vector<int> freeSlots;
+    std::vector<size_t> dirty;          // connections with an open slot or uncommitted sends
+    std::vector<size_t> draining;       // detached connections whose sockets are still open
+    std::vector<RioReceive> pending;    // receives dequeued outside poll()
+    RioStats stats;
+};
@@ -0,0 +1,168 @@
+#include "Roster.h"
+
+#include <sstream>
+
+Roster::Roster(size_t historyLimit) : historyLimit(historyLimit), version(0), snapshotVersion(UINT64_MAX)
+{
+}
+
+uint64_t Roster::getVersion() const
+{
+    return version;
+}
+
+size_t Roster::size() const
+{
+    return members.size();
+}
+
+PresenceEvent Roster::record(PresenceEventType type, const std::string& name, const std::string& previousName)
+{
+    PresenceEvent event;
+    event.version = ++version;
+    event.type = type;
+    event.name = name;
+    event.previousName = previousName;
+    history.push_back(event);
+    if (history.size() > historyLimit)
+    {
+        history.pop_front();
+    }
+    return event;
+}
+
+PresenceEvent Roster::join(const std::string& name)
+{
+    members[name]++;
+    return record(PRESENCE_JOIN, name, "");
+}
+
+PresenceEvent Roster::leave(const std::string& name)
+{
+    auto it = members.find(name);
+    if (it != members.end() && --it->second == 0)
+    {
+        members.erase(it);
+    }
+    return record(PRESENCE_LEAVE, name, "");
+}
+
+PresenceEvent Roster::rename(const std::string& previousName, const std::string& name)
+{
+    auto it = members.find(previousName);
+    if (it != members.end() && --it->second == 0)
+    {
+        members.erase(it);
+    }
+    members[name]++;
+    return record(PRESENCE_RENAME, name, previousName);
+}
+
+bool Roster::canServeDelta(uint64_t knownVersion) const
+{
+    if (knownVersion == 0 || knownVersion > version)
+    {
+        return false;
+    }
+    // The history must still hold every event after knownVersion.
+    return knownVersion == version || (!history.empty() && history.front().version <= knownVersion + 1);
+}
+
+const std::deque<PresenceEvent>& Roster::getHistory() const
+{
+    return history;
+}
+
+void Roster::restore(uint64_t restoredVersion, const std::vector<std::string>& names, const std::vector<PresenceEvent>& restoredHistory)
+{
+    version = restoredVersion;
+    members.clear();
+    for (const auto& name : names)
+    {
+        members[name]++;
+    }
+    history.assign(restoredHistory.begin(), restoredHistory.end());
+    snapshotVersion = UINT64_MAX;
+}
+
+std::string Roster::encodeListReply(uint64_t knownVersion)
+{
+    if (!canServeDelta(knownVersion))
+    {
+        return snapshot();
+    }
+    std::string reply = "LIST " + std::to_string(version) + " DELTA";
+    for (const auto& event : history)
+    {
+        if (event.version > knownVersion)
+        {
+            reply += "\n" + encodeChange(event);
+        }
+    }
+    return reply;
+}
+
+const std::string& Roster::snapshot()
+{
+    // Rebuilt only when the roster changed since the last request.
+    if (snapshotVersion != version)
+    {
+        snapshotCache = "LIST " + std::to_string(version) + " SNAPSHOT";
+        for (const auto& member : members)
+        {
+            for (int i = 0; i < member.second; i++)
+            {
+                snapshotCache += "\n" + member.first;
+            }
+        }
+        snapshotVersion = version;
+    }
+    return snapshotCache;
+}
+
+std::string Roster::encodeEvent(const PresenceEvent& event)
+{
+    return "PRESENCE " + std::to_string(event.version) + " " + encodeChange(event);
+}
+
+std::string Roster::encodeChange(const PresenceEvent& event)
+{
+    switch (event.type)
+    {
+    case PRESENCE_JOIN:
+        return "JOIN " + event.name;
+    case PRESENCE_LEAVE:
+        return "LEAVE " + event.name;
+    case PRESENCE_RENAME:
+        return "RENAME " + event.previousName + " " + event.name;
+    }
+    return "";
+}
+
+bool Roster::decodeChange(const std::string& line, PresenceEvent& event)
+{
+    std::istringstream in(line);
+    std::string type;
+    in >> type;
+    event.previousName.clear();
+    if (type == "JOIN")
+    {
+        event.type = PRESENCE_JOIN;
+        in >> event.name;
+    }
+    else if (type == "LEAVE")
+    {
+        event.type = PRESENCE_LEAVE;
+        in >> event.name;
+    }
+    else if (type == "RENAME")
+    {
+        event.type = PRESENCE_RENAME;
+        in >> event.previousName >> event.name;
+    }
+    else
+    {
+        return false;
+    }
+    return !event.name.empty();
+}
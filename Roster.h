@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+enum PresenceEventType {
+    PRESENCE_JOIN = 0,
+    PRESENCE_LEAVE = 1,
+    PRESENCE_RENAME = 2,
+};
+
+struct PresenceEvent {
+    uint64_t version = 0;
+    PresenceEventType type = PRESENCE_JOIN;
+    std::string name;
+    std::string previousName;   // only set for renames
+};
+
+// Versioned list of registered users. Every change bumps the version and is kept
+// in a bounded history, so clients can catch up with a delta instead of a full list.
+//
+// Wire format (one item per line):
+//   PRESENCE <version> JOIN <name> | LEAVE <name> | RENAME <old> <new>
+//   LIST <version> DELTA    followed by JOIN/LEAVE/RENAME lines
+//   LIST <version> SNAPSHOT followed by one name per line
+class Roster {
+public:
+    explicit Roster(size_t historyLimit = 256);
+    uint64_t getVersion() const;
+    size_t size() const;
+    PresenceEvent join(const std::string& name);
+    PresenceEvent leave(const std::string& name);
+    PresenceEvent rename(const std::string& previousName, const std::string& name);
+    std::string encodeListReply(uint64_t knownVersion);
+    const std::deque<PresenceEvent>& getHistory() const;
+    // Picks up where another process's roster left off, see Handoff.h
+    void restore(uint64_t version, const std::vector<std::string>& names, const std::vector<PresenceEvent>& history);
+    static std::string encodeEvent(const PresenceEvent& event);
+    static std::string encodeChange(const PresenceEvent& event);
+    static bool decodeChange(const std::string& line, PresenceEvent& event);
+private:
+    PresenceEvent record(PresenceEventType type, const std::string& name, const std::string& previousName);
+    bool canServeDelta(uint64_t knownVersion) const;
+    const std::string& snapshot();
+    size_t historyLimit;
+    uint64_t version;
+    std::map<std::string, int> members;     // name -> number of sessions using it
+    std::deque<PresenceEvent> history;
+    std::string snapshotCache;
+    uint64_t snapshotVersion;
+};
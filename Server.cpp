@@ -4,13 +4,98 @@
 #include <fstream>
 #include <ws2tcpip.h>
 #include <thread>
+#include <algorithm>
+#include <cstdlib>
+#include <sstream>
+#include <charconv>
+#include <cstdio>
+#include <random>
+#include <filesystem>
+#include <afunix.h>
+#include "AllocationCounter.h"
+#include "Handoff.h"
 #pragma comment(lib, "Ws2_32.lib")
 
 #define _WINSOCK_DEPRECATED_NO_WARNINGS
 #pragma warning(disable: 4996)
 #define _CRT_SECURE_NO_WARNINGS
 
-Server::Server(int maxClients, const char* port) : maxClients(maxClients), port(port), logFileName("chat_log.txt") {
+namespace {
+// The listening and local sockets share the select engine's fd_set with the sessions
+const int SELECT_MAX_SESSIONS = FD_SETSIZE - 2;
+
+// Length of a leading "@<id> " correlation tag, 0 if the frame has none
+size_t requestTagLength(std::string_view frame)
+{
+    if (frame.size() < 3 || frame[0] != '@')
+    {
+        return 0;
+    }
+    size_t end = 1;
+    while (end < frame.size() && end <= 20 && frame[end] >= '0' && frame[end] <= '9')
+    {
+        end++;
+    }
+    return end > 1 && end < frame.size() && frame[end] == ' ' ? end + 1 : 0;
+}
+
+// Non-blocking send: how much the socket took, false only on a real error
+bool sendSome(SOCKET socket, const char* data, size_t size, size_t& sent)
+{
+    sent = 0;
+    int result = send(socket, data, static_cast<int>(size), 0);
+    if (result == SOCKET_ERROR)
+    {
+        return WSAGetLastError() == WSAEWOULDBLOCK;
+    }
+    sent = static_cast<size_t>(result);
+    return true;
+}
+
+// The chat log as it is now, a part per call: "LOG+ <part>" frames, then a last "LOG <part>".
+// With a compressor, parts go out as ZIP frames, the full ones from its history cache.
+OutboundQueue::BulkSource logSource(std::shared_ptr<std::ifstream> file, uint64_t remaining, std::string tag, FrameCompressor* compressor)
+{
+    bool finished = false;
+    uint64_t offset = 0;
+    return [file, remaining, tag, compressor, finished, offset](std::string& frame) mutable
+    {
+        if (finished)
+        {
+            return false;
+        }
+        std::string part(static_cast<size_t>((std::min)(remaining, static_cast<uint64_t>(OUTBOUND_CHUNK_SIZE))), '\0');
+        file->read(&part[0], static_cast<std::streamsize>(part.size()));
+        // A log that got shorter than it was when the request came in just ends early
+        size_t partSize = part.size();
+        part.resize(static_cast<size_t>(file->gcount()));
+        remaining = part.size() < partSize ? 0 : remaining - partSize;
+        finished = remaining == 0;
+        std::string_view kind = finished ? "LOG " : "LOG+ ";
+        uint64_t partOffset = offset;
+        offset += part.size();
+        if (compressor != nullptr
+            && compressor->compressHistory(tag + std::string(kind), partOffset, part, part.size() == OUTBOUND_CHUNK_SIZE, frame))
+        {
+            return true;
+        }
+        uint32_t frameSize = static_cast<uint32_t>(tag.size() + kind.size() + part.size());
+        frame.assign(reinterpret_cast<const char*>(&frameSize), sizeof(frameSize));
+        frame += tag;
+        frame += kind;
+        frame += part;
+        return true;
+    };
+}
+}
+
+Server::Server(int maxClients, const char* port) : maxClients(maxClients), tcpServerSocket(INVALID_SOCKET), port(port), logFileName("chat_log.txt"),
+    recvBuffer(64 * 1024), framesTooLarge(0), framesRateLimited(0), framesDropped(0), framesSent{0, 0, 0},
+    framesQueued(0), outboundOverflows(0),
+    requestClient(NULL), requestReplied(false), taggedRequests(0),
+    tlsHandshakes(0), tlsResumed(0), tlsFailures(0), nextTransferId(0), transfersCompleted(0),
+    transfersCancelled(0), transferBytes(0), ioEngine(IO_ENGINE_SELECT), localServerSocket(INVALID_SOCKET), sharedAttached(0), multicastPort(0), filterReloaded(false),
+    running(false), takeOver(false), upgradeRequested(false), upgradePipe(INVALID_HANDLE_VALUE), upgradeProcessId(0) {
     WSADATA wsaData;
     int result = WSAStartup(MAKEWORD(2, 2), &wsaData);
     if (result != NO_ERROR) 
@@ -20,6 +105,41 @@ Server::Server(int maxClients, const char* port) : maxClients(maxClients), port(
     }
     initialize();
 
+    // Create a UDP socket
+    udpServerSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (udpServerSocket == INVALID_SOCKET) {
+        std::cerr << "Can't create UDP socket: " << WSAGetLastError() << std::endl;
+        WSACleanup();
+        exit(SETUP_ERROR);
+    }
+
+    // Enable broadcast for the UDP socket
+    int broadcast = 1;
+    result = setsockopt(udpServerSocket, SOL_SOCKET, SO_BROADCAST, (char*)&broadcast, sizeof(broadcast));
+    if (result == SOCKET_ERROR) {
+        std::cerr << "Can't enable UDP broadcast: " << WSAGetLastError() << std::endl;
+        closesocket(udpServerSocket);
+        WSACleanup();
+        exit(SETUP_ERROR);
+    }
+}
+
+Server::~Server() {
+    for (auto client : clients) {
+        closesocket(client->getSocket());
+        delete client;
+    }
+    closesocket(tcpServerSocket);
+    if (localServerSocket != INVALID_SOCKET)
+    {
+        closesocket(localServerSocket);
+        DeleteFileA(localPath.c_str());
+    }
+    WSACleanup();
+}
+
+
+void Server::openListener() {
     struct addrinfo* result_addr = NULL, hints;
     ZeroMemory(&hints, sizeof(hints));
     hints.ai_flags = AI_PASSIVE; // Server address.
@@ -31,7 +151,7 @@ Server::Server(int maxClients, const char* port) : maxClients(maxClients), port(
     //hints.ai_socktype = SOCK_DGRAM; // UDP connection!!!
     //hints.ai_protocol = IPPROTO_UDP; // UDP connection!!!
 
-    result = getaddrinfo(NULL, port, &hints, &result_addr);
+    int result = getaddrinfo(NULL, port, &hints, &result_addr);
     if (result != 0) 
     {
         std::cerr << "Error getting address info: " << result << std::endl;
@@ -39,7 +159,9 @@ Server::Server(int maxClients, const char* port) : maxClients(maxClients), port(
         exit(ADDRESS_ERROR);
     }
     
-    tcpServerSocket = socket(result_addr->ai_family, result_addr->ai_socktype, result_addr->ai_protocol);
+    // Accepted sockets inherit the flags, Registered I/O needs them on every client socket.
+    tcpServerSocket = WSASocket(result_addr->ai_family, result_addr->ai_socktype, result_addr->ai_protocol, NULL, 0,
+        WSA_FLAG_OVERLAPPED | WSA_FLAG_REGISTERED_IO);
     if (tcpServerSocket == INVALID_SOCKET) 
     {
         std::cerr << "Error creating server socket: " << WSAGetLastError() << std::endl;
@@ -57,29 +179,17 @@ Server::Server(int maxClients, const char* port) : maxClients(maxClients), port(
         exit(BIND_ERROR);
     }
 
-    // Create a UDP socket
-    udpServerSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-    if (udpServerSocket == INVALID_SOCKET) {
-        std::cerr << "Can't create UDP socket: " << WSAGetLastError() << std::endl;
-        closesocket(tcpServerSocket);
-        WSACleanup();
-        exit(SETUP_ERROR);
-    }
-
-    // Enable broadcast for the UDP socket
-    int broadcast = 1;
-    result = setsockopt(udpServerSocket, SOL_SOCKET, SO_BROADCAST, (char*)&broadcast, sizeof(broadcast));
-    if (result == SOCKET_ERROR) {
-        std::cerr << "Can't enable UDP broadcast: " << WSAGetLastError() << std::endl;
-        closesocket(tcpServerSocket);
-        closesocket(udpServerSocket);
-        WSACleanup();
-        exit(SETUP_ERROR);
-    }
-
     //TCP Close
     freeaddrinfo(result_addr);
 
+    // Let WSAAccept reject connections before the handshake completes, so refused peers cost us nothing.
+    BOOL conditionalAccept = TRUE;
+    result = setsockopt(tcpServerSocket, SOL_SOCKET, SO_CONDITIONAL_ACCEPT, (char*)&conditionalAccept, sizeof(conditionalAccept));
+    if (result == SOCKET_ERROR)
+    {
+        std::cerr << "Can't enable conditional accept: " << WSAGetLastError() << std::endl;
+    }
+
     result = listen(tcpServerSocket, SOMAXCONN);
     if (result == SOCKET_ERROR) 
     {
@@ -91,16 +201,43 @@ Server::Server(int maxClients, const char* port) : maxClients(maxClients), port(
     }
 }
 
-Server::~Server() {
-    for (auto client : clients) {
-        closesocket(client->getSocket());
-        delete client;
+void Server::openLocalListener() {
+    // Registered I/O only takes TCP and UDP sockets, so the local socket is a select engine feature
+    if (ioEngine == IO_ENGINE_RIO)
+    {
+        std::cout << "Local socket: not with the rio engine" << std::endl;
+        return;
     }
-    closesocket(tcpServerSocket);
-    WSACleanup();
+    localPath = localSocketPath(port);
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (localPath.size() >= sizeof(address.sun_path))
+    {
+        std::cerr << "Local socket path is too long: " << localPath << std::endl;
+        return;
+    }
+    memcpy(address.sun_path, localPath.c_str(), localPath.size());
+    // Needs Windows 10 1803 or later; without it same-host clients still have TCP
+    localServerSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (localServerSocket == INVALID_SOCKET)
+    {
+        std::cerr << "Local socket is not available: " << WSAGetLastError() << std::endl;
+        return;
+    }
+    // A stale file from a server that didn't exit, or from the one we took over from
+    DeleteFileA(localPath.c_str());
+    if (bind(localServerSocket, (sockaddr*)&address, sizeof(address)) == SOCKET_ERROR
+        || listen(localServerSocket, SOMAXCONN) == SOCKET_ERROR)
+    {
+        std::cerr << "Error opening the local socket: " << WSAGetLastError() << std::endl;
+        closesocket(localServerSocket);
+        localServerSocket = INVALID_SOCKET;
+        return;
+    }
+    FD_SET(localServerSocket, &master);
+    std::cout << "Local socket: " << localPath << std::endl;
 }
 
-
 void Server::run() {
     // Prompt user for server IP and port
     std::cout << "Enter server IP address: ";
@@ -111,6 +248,36 @@ void Server::run() {
     std::cout << "Starting server..." << std::endl;
     std::cout << "IP: " << serverIP << ", Port: " << port << std::endl;
 
+    // Chat for the members goes out on the interface the beacon announces. The group is open to
+    // anybody on the network and nothing in it is encrypted, which would undo TLS.
+    if (!multicastGroup.empty() && tlsCredentials)
+    {
+        throw std::runtime_error("--multicast sends chat in the clear and can't be combined with TLS");
+    }
+    if (!multicastGroup.empty())
+    {
+        if (multicast.open(multicastGroup, multicastPort, serverIP))
+        {
+            std::cout << "Multicast: " << multicastGroup << ":" << multicastPort << std::endl;
+        }
+        else
+        {
+            std::cerr << "Multicast is not available (" << WSAGetLastError() << "), chat stays on TCP" << std::endl;
+        }
+    }
+
+    // Either a fresh listening socket, or the running server's one along with its sessions
+    std::vector<Session*> adopted;
+    if (!takeOver)
+    {
+        openListener();
+    }
+    else if (!takeOverRunningServer(adopted))
+    {
+        WSACleanup();
+        exit(SETUP_ERROR);
+    }
+
     // Set up server socket to listen for incoming connections
     fdmax = tcpServerSocket;
     FD_ZERO(&master);
@@ -121,20 +288,121 @@ void Server::run() {
     // Start thread for sending UDP broadcast
     std::thread udpThread(&Server::sendUdpBroadcast, this);
     udpThread.detach();
+    lastAdmissionPrune = std::chrono::steady_clock::now();
+
+    if (ioEngine == IO_ENGINE_RIO && maxClients > RIO_MAX_SESSIONS)
+    {
+        std::cerr << "The rio engine registers buffers for at most " << RIO_MAX_SESSIONS << " sessions, max clients lowered to that" << std::endl;
+        maxClients = RIO_MAX_SESSIONS;
+    }
+    if (ioEngine == IO_ENGINE_RIO && !rio.initialize(tcpServerSocket, maxClients))
+    {
+        std::cerr << "Registered I/O is not available (" << WSAGetLastError() << "), using select" << std::endl;
+        ioEngine = IO_ENGINE_SELECT;
+    }
+    // FD_SET ignores sockets past the set's capacity, those sessions would never be served
+    if (ioEngine == IO_ENGINE_SELECT && maxClients > SELECT_MAX_SESSIONS)
+    {
+        std::cerr << "The select engine watches at most " << SELECT_MAX_SESSIONS << " sessions, max clients lowered to that" << std::endl;
+        maxClients = SELECT_MAX_SESSIONS;
+    }
+    std::cout << "I/O engine: " << (ioEngine == IO_ENGINE_RIO ? "rio" : "select") << std::endl;
+    openLocalListener();
+    for (Session* session : adopted)
+    {
+        if (!addSession(session))
+        {
+            // Gone for this session only, its client reconnects
+            admission.release(session->getAddress());
+            closesocket(session->getSocket());
+            delete session;
+        }
+    }
+
+    // A successor process can ask for our sockets at any time, see Handoff.h
+    running = true;
+    std::thread upgradeThread(&Server::listenForUpgrades, this);
+    upgradeThread.detach();
+    if (contentFilter)
+    {
+        std::thread filterThread(&Server::watchContentFilter, this);
+        filterThread.detach();
+    }
+    // The loop runs on this thread; background threads stay wherever the scheduler puts them
+    if (!busyPoll.pinCurrentThread())
+    {
+        std::cerr << "Can't pin the server loop to the given cores (" << GetLastError() << "), it runs on any" << std::endl;
+    }
+    if (busyPoll.isEnabled())
+    {
+        std::cout << "Busy poll: " << busyPoll.report() << std::endl;
+    }
+    if (ioEngine == IO_ENGINE_RIO)
+    {
+        runRio();
+    }
+    else
+    {
+        runSelect();
+    }
+}
 
+void Server::runSelect() {
     // Main loop for server
-    while (true) 
+    while (running) 
     {
         read_fds = master;
-        int highest_fd = tcpServerSocket;
+        FD_ZERO(&write_fds);
+        int highest_fd = (std::max)(tcpServerSocket, localServerSocket == INVALID_SOCKET ? 0 : localServerSocket);
+        auto now = std::chrono::steady_clock::now();
+        auto wakeUp = now + std::chrono::seconds(1);
         for (const auto& client : clients) 
         {
+            if (client->getSocket() == INVALID_SOCKET)
+            {
+                continue;
+            }
             if (client->getSocket() > highest_fd) 
             {
                 highest_fd = client->getSocket();
             }
+            // Output waiting for room: the socket says when it has some, a ring has to be looked at again
+            if (!client->getOutbound().isEmpty())
+            {
+                if (client->getShared() != NULL)
+                {
+                    wakeUp = (std::min)(wakeUp, now + std::chrono::milliseconds(1));
+                }
+                else
+                {
+                    FD_SET(client->getSocket(), &write_fds);
+                }
+            }
+            // Throttled sessions are not read from, so the kernel buffer pushes back on the sender.
+            // The same goes for a shared ring: it fills up and its writer waits.
+            if (client->isThrottled(now))
+            {
+                FD_CLR(client->getSocket(), &read_fds);
+                wakeUp = (std::min)(wakeUp, client->getThrottledUntil());
+                continue;
+            }
+            // A ring that already has data means no sleeping, otherwise its writer rings the socket
+            if (client->getShared() != NULL && !client->getShared()->armWakeUp())
+            {
+                wakeUp = now;
+            }
+        }
+        // Right after traffic, busy poll mode only looks and doesn't sleep
+        bool polled = busyPoll.isSpinning(now);
+        if (polled)
+        {
+            wakeUp = now;
         }
-        int result = select(highest_fd + 1, &read_fds, NULL, NULL, &timeout);
+        auto wait = std::chrono::duration_cast<std::chrono::microseconds>(wakeUp - now);
+        timeout.tv_sec = static_cast<long>(wait.count() / 1000000);
+        timeout.tv_usec = static_cast<long>(wait.count() % 1000000);
+        int result = select(highest_fd + 1, &read_fds, &write_fds, NULL, &timeout);
+        busyPoll.recordWait(polled, result > 0, std::chrono::steady_clock::now());
 
         // Check for errors
         if (result == SOCKET_ERROR) 
@@ -144,36 +412,200 @@ void Server::run() {
             WSACleanup();
             exit(PARAMETER_ERROR);
         }
+        for (const auto& client : clients)
+        {
+            if (client->getShared() != NULL)
+            {
+                client->getShared()->disarmWakeUp();
+            }
+        }
 
         // Check if new client connection is available
         if (FD_ISSET(tcpServerSocket, &read_fds)) 
         {
             acceptClient();
         }
+        if (localServerSocket != INVALID_SOCKET && FD_ISSET(localServerSocket, &read_fds))
+        {
+            acceptLocalClient();
+        }
         // Check all connected clients for incoming messages
+        now = std::chrono::steady_clock::now();
         for (int i = 0; i < clients.size(); i++)
         {
             SOCKET clientSocket = clients[i]->getSocket();
+            if (clientSocket == INVALID_SOCKET)
+            {
+                continue;
+            }
+            if (FD_ISSET(clientSocket, &write_fds) || (clients[i]->getShared() != NULL && !clients[i]->getOutbound().isEmpty()))
+            {
+                flushOutbound(clients[i]);
+            }
             if (FD_ISSET(clientSocket, &read_fds))
             {
                 handleClientRequest(clients[i]);
             }
+            else if (clients[i]->hasPendingInbound() && !clients[i]->isThrottled(now))
+            {
+                // Frames held back by the rate limiter are ready to go again
+                processInbound(clients[i]);
+            }
+            if (clients[i]->getShared() != NULL && !clients[i]->isThrottled(now))
+            {
+                receiveShared(clients[i]);
+            }
+        }
+
+        finishIteration();
+    }
+}
+
+void Server::runRio() {
+    // Completions instead of readiness: every session always has a receive posted into its
+    // registered buffer, except while throttled, which leaves the data in the kernel and
+    // pushes back on the sender like the select loop does.
+    HANDLE acceptEvent = WSACreateEvent();
+    if (WSAEventSelect(tcpServerSocket, acceptEvent, FD_ACCEPT) == SOCKET_ERROR)
+    {
+        std::cerr << "Error watching the listening socket: " << WSAGetLastError() << std::endl;
+        closesocket(tcpServerSocket);
+        WSACleanup();
+        exit(SETUP_ERROR);
+    }
+    std::vector<RioReceive> received;
+    while (running)
+    {
+        auto now = std::chrono::steady_clock::now();
+        auto wakeUp = now + std::chrono::seconds(1);
+        for (const auto& client : clients)
+        {
+            if (client->getSocket() != INVALID_SOCKET && client->isThrottled(now))
+            {
+                wakeUp = (std::min)(wakeUp, client->getThrottledUntil());
+            }
+            // Send completions wake us too, this is for a session that used up its burst
+            if (client->getSocket() != INVALID_SOCKET && !client->getOutbound().isEmpty())
+            {
+                wakeUp = (std::min)(wakeUp, now + std::chrono::milliseconds(1));
+            }
+        }
+        // Right after traffic, busy poll mode dequeues completions without arming the event or
+        // sleeping on it, so no kernel transition at all until the spin budget runs out
+        bool polled = busyPoll.isSpinning(now);
+        if (!polled)
+        {
+            rio.wait(acceptEvent, static_cast<DWORD>(std::chrono::duration_cast<std::chrono::milliseconds>(wakeUp - now).count()));
+        }
+
+        WSANETWORKEVENTS events;
+        bool accepted = false;
+        if (WSAEnumNetworkEvents(tcpServerSocket, acceptEvent, &events) == 0 && (events.lNetworkEvents & FD_ACCEPT))
+        {
+            acceptClient();
+            accepted = true;
+        }
+
+        rio.poll(received);
+        busyPoll.recordWait(polled, accepted || !received.empty(), std::chrono::steady_clock::now());
+        for (const auto& receive : received)
+        {
+            handleReceived(receive.owner, receive.data, receive.size);
+        }
+
+        now = std::chrono::steady_clock::now();
+        for (auto& client : clients)
+        {
+            if (client->getSocket() != INVALID_SOCKET && !client->getOutbound().isEmpty())
+            {
+                flushOutbound(client);
+            }
+            if (client->getSocket() == INVALID_SOCKET || client->isThrottled(now))
+            {
+                continue;
+            }
+            if (client->hasPendingInbound())
+            {
+                // Frames held back by the rate limiter are ready to go again
+                processInbound(client);
+            }
+            if (client->getSocket() != INVALID_SOCKET && !client->isThrottled(now))
+            {
+                rio.postReceive(client);
+            }
+        }
+
+        // Everything this round produced goes out with one commit per session
+        rio.flush();
+        finishIteration();
+    }
+}
+
+void Server::finishIteration() {
+    // Cut off the sessions that let their output pile up
+    for (size_t i = 0; i < clients.size(); i++)
+    {
+        if (clients[i]->getSocket() != INVALID_SOCKET && clients[i]->getOutbound().isOverflowed())
+        {
+            std::cerr << "(" << clients[i]->getUsername() << ") is not reading its output, disconnecting" << std::endl;
+            disconnectClient(clients[i]);
         }
+    }
+
+    // Give idle sessions' buffers back, and get under the memory budget if we are over it
+    auto now = std::chrono::steady_clock::now();
+    if (now - lastMemorySweep >= std::chrono::seconds(MEMORY_SWEEP_SECONDS))
+    {
+        sweepMemory();
+        lastMemorySweep = now;
+    }
 
-        // Remove clients with an INVALID_SOCKET
-        clients.erase(
-            std::remove_if(clients.begin(), clients.end(),  [](Client* client) 
+    // Remove clients with an INVALID_SOCKET
+    clients.erase(
+        std::remove_if(clients.begin(), clients.end(),  [](Session* client) 
+            {
+                if (client->getSocket() == INVALID_SOCKET) 
                 {
-                    if (client->getSocket() == INVALID_SOCKET) 
-                    {
-                        std::cout << "(" << client->getUsername() << ") HAS DISCONNECTED" << std::endl;
-                        closesocket(client->getSocket());
-                        delete client;
-                        return true;
-                    }
-                    return false;
-                }),
-            clients.end());
+                    std::cout << "(" << client->getUsername() << ") HAS DISCONNECTED" << std::endl;
+                    delete client;
+                    return true;
+                }
+                return false;
+            }),
+        clients.end());
+
+    // Start or give up on file offers nobody answered in time
+    expireFileOffers(now);
+
+    // Drop per-source admission state that no longer matters
+    if (now - lastAdmissionPrune > std::chrono::seconds(10))
+    {
+        admission.prune();
+        lastAdmissionPrune = now;
+    }
+
+    // Chat published this iteration leaves in as few datagrams as it fits in
+    if (multicast.isOpen())
+    {
+        multicast.flush(now);
+    }
+
+    // Frames built this iteration have all been written
+    arena.reset();
+
+    // A recompiled filter applies from the next message on
+    if (filterReloaded)
+    {
+        std::lock_guard<std::mutex> lock(filterMutex);
+        contentFilter = std::move(reloadedFilter);
+        filterReloaded = false;
+        filterStats.reloads++;
+    }
+
+    // Between iterations nothing is half done, so this is where sessions can move
+    if (upgradeRequested)
+    {
+        handOff();
     }
 }
 
@@ -183,9 +615,14 @@ void Server::sendUdpBroadcast() {
     udpBroadcastAddr.sin_addr.s_addr = INADDR_BROADCAST;
     udpBroadcastAddr.sin_port = htons(static_cast<unsigned short>(std::stoi(port)));
 
+    // The beacon never changes, build it once
+    std::string broadcastMessage = serverIP + ":" + std::string(port); //"255.255.255.255:" if addres dosen't work
+    if (tlsCredentials)
+    {
+        broadcastMessage += ":tls";
+    }
     while (true) 
     {
-        std::string broadcastMessage = serverIP + ":" + std::string(port); //"255.255.255.255:" if addres dosen't work
         int result = sendto(udpServerSocket, broadcastMessage.c_str(), broadcastMessage.size(), 0, (sockaddr*)&udpBroadcastAddr, sizeof(udpBroadcastAddr));
         if (result == SOCKET_ERROR) 
         {
@@ -196,254 +633,1688 @@ void Server::sendUdpBroadcast() {
     }
 }
 
+int CALLBACK Server::admissionCondition(LPWSABUF callerId, LPWSABUF, LPQOS, LPQOS, LPWSABUF, LPWSABUF, GROUP*, DWORD_PTR callbackData)
+{
+    Server* server = reinterpret_cast<Server*>(callbackData);
+    if (callerId == NULL || callerId->buf == NULL || callerId->len < sizeof(sockaddr_in))
+    {
+        return CF_ACCEPT;
+    }
+    const sockaddr_in* callerAddr = reinterpret_cast<const sockaddr_in*>(callerId->buf);
+    return server->admission.admit(callerAddr->sin_addr.s_addr) == ADMIT ? CF_ACCEPT : CF_REJECT;
+}
+
 void Server::acceptClient() {
     struct sockaddr_in clientAddr {};
     int clientAddrLen = sizeof(clientAddr);
 
-    SOCKET clientSocket = accept(tcpServerSocket, (sockaddr*)&clientAddr, &clientAddrLen);
+    // Admission control runs inside the condition callback, before any per-client state exists.
+    SOCKET clientSocket = WSAAccept(tcpServerSocket, (sockaddr*)&clientAddr, &clientAddrLen, &Server::admissionCondition, reinterpret_cast<DWORD_PTR>(this));
 
     // Check for errors
     if (clientSocket == INVALID_SOCKET) 
     {
-        std::cerr << "Error accepting client socket: " << WSAGetLastError() << std::endl;
+        int error = WSAGetLastError();
+        if (error != WSAECONNREFUSED) // refused by admission control, already counted
+        {
+            std::cerr << "Error accepting client socket: " << error << std::endl;
+        }
         return;
     }
-    // Check if server is full
-    if (clients.size() >= maxClients) //acount for index
+    // Check if server is full; being over the memory budget counts as full too
+    if (clients.size() >= maxClients || !memory.admit()) //acount for index
     {
-        std::string message = "SV_FULL";
-        Client* disconnectingClient = new Client();
-        disconnectingClient->setSocket(clientSocket);
-        sendToSpecificClient(message, disconnectingClient);
-        std::this_thread::sleep_for(std::chrono::seconds(1));
+        // Fast reject: no session object and no sleep, the frame is tiny and the socket is fresh.
+        // A TLS client can't read a plaintext frame, it just sees the connection close.
+        admission.recordServerFull(clientAddr.sin_addr.s_addr);
+        if (!tlsCredentials)
+        {
+            sendFrame(clientSocket, "SV_FULL");
+        }
+        shutdown(clientSocket, SD_SEND);
         closesocket(clientSocket);
-        delete disconnectingClient;
         return;
     }
     // Add client to list of connected clients
-    Client* newClient = new Client();
-    newClient->setSocket(clientSocket);
-    clients.push_back(newClient);
-    // Add client socket to master set
-    FD_SET(clientSocket, &master);
-    if (clientSocket > fdmax) 
+    Session* newClient = new Session(clientSocket, clientAddr.sin_addr.s_addr, sessionLimits);
+    if (!addSession(newClient))
     {
-        fdmax = clientSocket;
+        admission.release(clientAddr.sin_addr.s_addr);
+        closesocket(clientSocket);
+        delete newClient;
+        return;
+    }
+    // Send success message to client, or once the TLS handshake completes
+    if (tlsCredentials)
+    {
+        newClient->setTls(new TlsChannel(tlsCredentials, ""));
+    }
+    else
+    {
+        std::string message = "SV_SUCCESS";
+        writeSocket(newClient, message.c_str(), message.size() + 1);
     }
-    // Send success message to client
-    std::string message = "SV_SUCCESS";
-    send(clientSocket, message.c_str(), message.size() + 1, 0);
     // Print connection info
     std::cout << "New client connected from " << inet_ntoa(clientAddr.sin_addr) << ":" << ntohs(clientAddr.sin_port) << std::endl;
 }
 
-bool Server::handleClientRequest(Client* client) 
-{
-    // Receive the size of the incoming message first.
-    int messageSize = 0;
-    int nbytes = recv(client->getSocket(), reinterpret_cast<char*>(&messageSize), sizeof(messageSize), 0);
-    if (nbytes <= 0)
+void Server::acceptLocalClient() {
+    SOCKET clientSocket = accept(localServerSocket, NULL, NULL);
+    if (clientSocket == INVALID_SOCKET)
     {
-        // client disconnected
-        closesocket(client->getSocket());
-        FD_CLR(client->getSocket(), &master);
-        for (auto it = clients.begin(); it != clients.end(); ++it)
-        {
-            if ((*it)->getSocket() == client->getSocket())
-            {
-                delete (*it);
-                clients.erase(it);
-                break;
-            }
-        }
+        std::cerr << "Error accepting local client socket: " << WSAGetLastError() << std::endl;
+        return;
+    }
+    if (clients.size() >= maxClients || !memory.admit())
+    {
+        sendFrame(clientSocket, "SV_FULL");
+        shutdown(clientSocket, SD_SEND);
+        closesocket(clientSocket);
+        return;
+    }
+    // Counted as loopback, but not against the accept rates, which are there for the network.
+    // Local sessions are plaintext even on a TLS server: nothing leaves the machine.
+    Session* newClient = new Session(clientSocket, htonl(INADDR_LOOPBACK), sessionLimits);
+    newClient->setLocal(true);
+    addSession(newClient);
+    admission.adopt(newClient->getAddress());
+    std::string message = "SV_SUCCESS";
+    writeSocket(newClient, message.c_str(), message.size() + 1);
+    std::cout << "New client connected on the local socket" << std::endl;
+}
+
+void Server::attachShared(Session* client) {
+    // Both ends have to be on this machine, which only the local socket guarantees
+    if (!client->isLocal() || client->getShared() != NULL)
+    {
+        sendError(client, "SHM_UNAVAILABLE", "shared memory needs a connection over the local socket");
+        return;
+    }
+    std::random_device random;
+    char suffix[17];
+    snprintf(suffix, sizeof(suffix), "%08x%08x", random(), random());
+    std::unique_ptr<SharedChannel> channel(new SharedChannel());
+    if (!channel->create("cppchat-" + std::string(port) + "-" + suffix))
+    {
+        sendError(client, "SHM_UNAVAILABLE", "can't create shared memory: " + std::to_string(GetLastError()));
+        return;
+    }
+    // The reply is the last frame on the socket, everything after it goes through the rings
+    reply(client, "SHM " + channel->getName());
+    client->setShared(channel.release());
+    sharedAttached++;
+}
+
+bool Server::addSession(Session* session)
+{
+    SOCKET socket = session->getSocket();
+    if (ioEngine == IO_ENGINE_RIO)
+    {
+        // Accepted sockets inherit the listening socket's event selection, which RIO doesn't want
+        WSAEventSelect(socket, NULL, 0);
+        u_long blocking = 0;
+        ioctlsocket(socket, FIONBIO, &blocking);
+        if (!rio.attach(socket, session))
+        {
+            std::cerr << "Error registering client socket: " << WSAGetLastError() << std::endl;
+            return false;
+        }
+    }
+    else
+    {
+        if (clients.size() >= static_cast<size_t>(SELECT_MAX_SESSIONS))
+        {
+            // Only adopted sessions get here, accepts stop at max clients
+            std::cerr << "No room in the fd_set for another session" << std::endl;
+            return false;
+        }
+        // A send never blocks the loop, what the socket doesn't take waits in the session
+        u_long nonBlocking = 1;
+        ioctlsocket(socket, FIONBIO, &nonBlocking);
+    }
+    busyPoll.applyTo(socket);
+    clients.push_back(session);
+    // Add client socket to master set
+    FD_SET(socket, &master);
+    if (socket > fdmax) 
+    {
+        fdmax = socket;
+    }
+    return true;
+}
+
+void Server::setTakeOver(bool enabled) {
+    takeOver = enabled;
+}
+
+void Server::listenForUpgrades() {
+    // One pipe instance at a time. Everybody may open it for reading, but only our own
+    // account and administrators may write the request, so nobody else gets our sockets.
+    std::string pipeName = upgradePipeName(port);
+    while (running)
+    {
+        HANDLE pipe = CreateNamedPipeA(pipeName.c_str(), PIPE_ACCESS_DUPLEX | FILE_FLAG_FIRST_PIPE_INSTANCE,
+            PIPE_TYPE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS, 1, 64 * 1024, 64 * 1024, 0, NULL);
+        if (pipe == INVALID_HANDLE_VALUE)
+        {
+            // The server we took over from may not have let go of the name yet
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+            continue;
+        }
+        bool connected = ConnectNamedPipe(pipe, NULL) || GetLastError() == ERROR_PIPE_CONNECTED;
+        std::string request;
+        ULONG processId = 0;
+        if (connected && readPipeMessage(pipe, request) && request == "UPGRADE" && GetNamedPipeClientProcessId(pipe, &processId))
+        {
+            // The main loop does the handoff between two iterations
+            std::unique_lock<std::mutex> lock(upgradeMutex);
+            upgradePipe = pipe;
+            upgradeProcessId = processId;
+            upgradeRequested = true;
+            upgradeSignal.wait(lock, [this]() { return !upgradeRequested; });
+            upgradePipe = INVALID_HANDLE_VALUE;
+        }
+        DisconnectNamedPipe(pipe);
+        CloseHandle(pipe);
+    }
+}
+
+void Server::handOff() {
+    std::unique_lock<std::mutex> lock(upgradeMutex);
+    std::string refusal;
+    HandoffState state;
+    std::vector<Session*> handed;
+    if (tlsCredentials)
+    {
+        refusal = "TLS sessions can't be handed over";
+    }
+    else if (ioEngine == IO_ENGINE_RIO)
+    {
+        // A posted receive would keep taking data meant for the successor
+        refusal = "the rio engine can't hand over its posted receives";
+    }
+    else if (WSADuplicateSocketW(tcpServerSocket, upgradeProcessId, &state.listenerInfo) != 0)
+    {
+        refusal = "can't duplicate the listening socket: " + std::to_string(WSAGetLastError());
+    }
+    for (size_t i = 0; i < clients.size() && refusal.empty(); i++)
+    {
+        Session* client = clients[i];
+        if (client->getSocket() == INVALID_SOCKET)
+        {
+            continue;
+        }
+        // Local sessions stay behind and close with this process; their clients reconnect
+        if (client->isLocal())
+        {
+            continue;
+        }
+        OutboundQueue& queue = client->getOutbound();
+        if (queue.hasBulkSources())
+        {
+            // Only the file knows the rest of it
+            refusal = "a chat log is still being sent, try again";
+            break;
+        }
+        HandoffSession session;
+        if (WSADuplicateSocketW(client->getSocket(), upgradeProcessId, &session.socketInfo) != 0)
+        {
+            refusal = "can't duplicate a client socket: " + std::to_string(WSAGetLastError());
+            break;
+        }
+        session.address = client->getAddress();
+        session.closing = client->isClosing();
+        session.username = client->getUsername();
+        session.inbound = std::string(client->getPendingInbound());
+        session.discardRemaining = client->getDiscardRemaining();
+        session.multicastId = client->getMulticastId();
+        session.compressing = client->isCompressing();
+        client->getChatTokens(session.messageTokens, session.byteTokens);
+        state.sessions.push_back(std::move(session));
+        handed.push_back(client);
+    }
+
+    bool handedOff = false;
+    if (refusal.empty())
+    {
+        // Whatever the sessions are owed goes along, and stays here as their wire in case the
+        // successor doesn't take them. Whole frames can go in any order across lanes.
+        for (size_t i = 0; i < handed.size(); i++)
+        {
+            OutboundQueue& queue = handed[i]->getOutbound();
+            std::string& outbound = state.sessions[i].outbound;
+            outbound = std::string(queue.getWire());
+            std::string_view frame;
+            while (queue.next(frame))
+            {
+                outbound += frame;
+                queue.pop();
+            }
+            queue.consumeWire(queue.getWire().size());
+            queue.appendWire(outbound.data(), outbound.size());
+        }
+        // Transfers stay behind; their senders resume them against the successor
+        while (!transfers.empty())
+        {
+            cancelTransfer(transfers.begin(), "SERVER_UPGRADE");
+        }
+        state.rosterVersion = roster.getVersion();
+        state.rosterHistory.assign(roster.getHistory().begin(), roster.getHistory().end());
+        state.nextTransferId = nextTransferId;
+        if (multicast.isOpen())
+        {
+            multicast.flush(std::chrono::steady_clock::now());
+            state.multicastGroup = multicast.getGroup() + ":" + std::to_string(multicast.getPort());
+            state.multicastSequence = multicast.getNextSequence();
+            state.multicastMemberId = multicast.getNextMemberId();
+        }
+
+        // Our descriptors have to stay open until the successor has made its own. A successor
+        // that doesn't answer in time is refused, or this loop would stay stopped on its behalf.
+        std::string reply;
+        bool adopted = writePipeMessage(upgradePipe, "HANDOFF " + encodeHandoff(state))
+            && readPipeMessage(upgradePipe, reply, HANDOFF_ADOPT_TIMEOUT_MS) && reply == "ADOPTED";
+        if (!adopted)
+        {
+            refusal = "the successor didn't adopt the sessions within " + std::to_string(HANDOFF_ADOPT_TIMEOUT_MS / 1000) + " seconds";
+            writePipeMessage(upgradePipe, "REFUSED " + refusal);
+        }
+        handedOff = adopted && writePipeMessage(upgradePipe, "RELEASED");
+    }
+    else
+    {
+        writePipeMessage(upgradePipe, "REFUSED " + refusal);
+    }
+
+    if (handedOff)
+    {
+        std::cout << "Handed " << state.sessions.size() << " sessions over to process " << upgradeProcessId << ", exiting" << std::endl;
+        // The successor has its own local socket at the same path by now
+        if (localServerSocket != INVALID_SOCKET)
+        {
+            closesocket(localServerSocket);
+            localServerSocket = INVALID_SOCKET;
+        }
+        running = false;
+    }
+    else
+    {
+        std::cerr << "Upgrade to process " << upgradeProcessId << " failed" << (refusal.empty() ? "" : ": " + refusal) << ", still serving" << std::endl;
+    }
+    upgradeRequested = false;
+    lock.unlock();
+    upgradeSignal.notify_all();
+}
+
+bool Server::takeOverRunningServer(std::vector<Session*>& adopted) {
+    HANDLE pipe = CreateFileA(upgradePipeName(port).c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+    if (pipe == INVALID_HANDLE_VALUE)
+    {
+        std::cerr << "No running server to take over on port " << port << ": " << GetLastError() << std::endl;
         return false;
     }
+    std::string reply;
+    HandoffState state;
+    if (!writePipeMessage(pipe, "UPGRADE") || !readPipeMessage(pipe, reply)
+        || reply.find("HANDOFF ") != 0 || !decodeHandoff(reply.substr(8), state))
+    {
+        std::cerr << "The running server did not hand over: " << (reply.empty() ? "no answer" : reply) << std::endl;
+        CloseHandle(pipe);
+        return false;
+    }
+
+    // Our own descriptor for every socket, then ADOPTED lets the old process go
+    SOCKET listener = WSASocketW(FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, &state.listenerInfo, 0,
+        WSA_FLAG_OVERLAPPED | WSA_FLAG_REGISTERED_IO);
+    bool complete = listener != INVALID_SOCKET;
+    std::vector<std::string> names;
+    // Members keep their place in the sequence if we multicast to the same group, otherwise chat goes back to TCP
+    bool sameGroup = multicast.isOpen() && state.multicastGroup == multicast.getGroup() + ":" + std::to_string(multicast.getPort());
+    for (size_t i = 0; i < state.sessions.size() && complete; i++)
+    {
+        HandoffSession& handed = state.sessions[i];
+        SOCKET socket = WSASocketW(FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, &handed.socketInfo, 0,
+            WSA_FLAG_OVERLAPPED | WSA_FLAG_REGISTERED_IO);
+        if (socket == INVALID_SOCKET)
+        {
+            complete = false;
+            break;
+        }
+        Session* session = new Session(socket, handed.address, sessionLimits);
+        session->setUsername(handed.username);
+        session->appendInbound(handed.inbound.data(), static_cast<int>(handed.inbound.size()), memory.getPool());
+        session->setDiscardRemaining(handed.discardRemaining);
+        session->setClosing(handed.closing);
+        session->setMulticastId(sameGroup ? handed.multicastId : 0);
+        session->setCompressing(handed.compressing && compression.isEnabled());
+        session->setChatTokens(handed.messageTokens, handed.byteTokens);
+        session->getOutbound().appendWire(handed.outbound.data(), handed.outbound.size());
+        if (!handed.username.empty())
+        {
+            names.push_back(handed.username);
+        }
+        adopted.push_back(session);
+    }
+    // Without ADOPTED the running server carries on as if nothing happened. It may also have
+    // given up on us already, then nothing but RELEASED means the sockets are ours alone.
+    if (!complete || !writePipeMessage(pipe, "ADOPTED") || !readPipeMessage(pipe, reply) || reply != "RELEASED")
+    {
+        std::cerr << "Taking over the sockets failed: "
+            << (reply.find("REFUSED ") == 0 ? reply.substr(8) : std::to_string(WSAGetLastError())) << std::endl;
+        for (Session* session : adopted)
+        {
+            closesocket(session->getSocket());
+            delete session;
+        }
+        adopted.clear();
+        if (listener != INVALID_SOCKET)
+        {
+            closesocket(listener);
+        }
+        CloseHandle(pipe);
+        return false;
+    }
+    CloseHandle(pipe);
+
+    tcpServerSocket = listener;
+    roster.restore(state.rosterVersion, names, state.rosterHistory);
+    nextTransferId = state.nextTransferId;
+    if (sameGroup)
+    {
+        multicast.restoreSequence(state.multicastSequence, state.multicastMemberId);
+    }
+    for (Session* session : adopted)
+    {
+        admission.adopt(session->getAddress());
+    }
+    std::cout << "Took over " << adopted.size() << " sessions from the running server" << std::endl;
+    return true;
+}
+
+void Server::disconnectClient(Session* client)
+{
+    if (client->getSocket() == INVALID_SOCKET)
+    {
+        return;
+    }
+    if (ioEngine == IO_ENGINE_RIO)
+    {
+        // The engine closes the socket once its queued output is out
+        rio.detach(client);
+    }
+    else
+    {
+        closesocket(client->getSocket());
+    }
+    FD_CLR(client->getSocket(), &master);
+    admission.release(client->getAddress());
+    if (!client->getUsername().empty())
+    {
+        broadcastPresence(roster.leave(client->getUsername()), client);
+    }
+    dropFileTransfers(client);
+    // The session is deleted by the sweep at the end of the loop iteration,
+    // so callers iterating over the clients list stay valid.
+    client->setSocket(INVALID_SOCKET);
+}
+
+bool Server::handleClientRequest(Session* client) 
+{
+    // One recv per readiness notification
+    int nbytes = recv(client->getSocket(), recvBuffer.data(), static_cast<int>(recvBuffer.size()), 0);
+    if (nbytes == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK)
+    {
+        return true;
+    }
+    // Once the frames go through shared memory, the socket only carries doorbells and the hang-up
+    if (client->getShared() != NULL && nbytes > 0)
+    {
+        return true;
+    }
+    return handleReceived(client, recvBuffer.data(), nbytes);
+}
+
+bool Server::receiveShared(Session* client)
+{
+    // Like one recv: at most a buffer per iteration, so every session gets its turn
+    if (client->getSocket() == INVALID_SOCKET)
+    {
+        return false;
+    }
+    size_t nbytes = client->getShared()->receive(recvBuffer.data(), recvBuffer.size());
+    if (client->getShared()->hasFailed())
+    {
+        // The client broke its ring, or stopped draining ours
+        disconnectClient(client);
+        return false;
+    }
+    return nbytes == 0 || handleReceived(client, recvBuffer.data(), static_cast<int>(nbytes));
+}
+
+bool Server::handleReceived(Session* client, const char* data, int nbytes)
+{
+    if (client->getSocket() == INVALID_SOCKET)
+    {
+        return false;
+    }
+    if (nbytes <= 0)
+    {
+        // client disconnected
+        disconnectClient(client);
+        return false;
+    }
+    if (client->isClosing())
+    {
+        // Waiting for the client to close after $exit; anything else it sends is ignored.
+        return true;
+    }
+    if (client->getTls() != NULL)
+    {
+        return receiveTls(client, data, nbytes);
+    }
+    client->appendInbound(data, nbytes, memory.getPool());
+    return processInbound(client);
+}
+
+bool Server::receiveTls(Session* client, const char* data, int nbytes)
+{
+    TlsChannel* tls = client->getTls();
+    bool wasEstablished = tls->isEstablished();
+    std::string toSend;
+    std::string plaintext;
+    TlsResult result = tls->receive(data, nbytes, toSend, plaintext);
+    if (!toSend.empty())
+    {
+        writeSocket(client, toSend.data(), toSend.size());
+    }
+    if (result != TLS_OK)
+    {
+        if (!wasEstablished)
+        {
+            tlsFailures++;
+        }
+        disconnectClient(client);
+        return false;
+    }
+    if (!wasEstablished && tls->isEstablished())
+    {
+        tlsHandshakes++;
+        if (tls->wasResumed())
+        {
+            tlsResumed++;
+        }
+        // The same welcome plaintext clients get right after accept
+        commitOrQueue(client, std::string_view("SV_SUCCESS", sizeof("SV_SUCCESS")), OUTBOUND_CONTROL);
+    }
+    if (plaintext.empty())
+    {
+        return true;
+    }
+    client->appendInbound(plaintext.data(), static_cast<int>(plaintext.size()), memory.getPool());
+    return processInbound(client);
+}
+
+bool Server::processInbound(Session* client)
+{
+    std::string_view message;
+    while (client->getSocket() != INVALID_SOCKET && !client->isClosing())
+    {
+        FrameStatus status = client->nextFrame(message);
+        if (status == FRAME_INCOMPLETE)
+        {
+            break;
+        }
+        else if (status == FRAME_TOO_LARGE)
+        {
+            framesTooLarge++;
+            sendError(client, "FRAME_TOO_LARGE", std::to_string(client->getLastRejectedSize()) + " bytes, limit is " + std::to_string(sessionLimits.maxFrameSize));
+        }
+        else if (status == FRAME_DROPPED)
+        {
+            framesDropped++;
+            if (client->takeLimitNotice())
+            {
+                sendError(client, "RATE_LIMITED", "message dropped");
+            }
+        }
+        else if (status == FRAME_RATE_LIMITED)
+        {
+            framesRateLimited++;
+            if (client->takeLimitNotice())
+            {
+                sendError(client, "RATE_LIMITED", "slow down, messages are being delayed");
+            }
+            break;
+        }
+        else
+        {
+            // A tagged request gets every reply tagged, and a bare OK if it has no other answer
+            size_t tagLength = requestTagLength(message);
+            requestClient = tagLength > 0 ? client : NULL;
+            requestTag = message.substr(0, tagLength);
+            requestReplied = false;
+            taggedRequests += tagLength > 0 ? 1 : 0;
+            bool keepReading = processFrame(client, message.substr(tagLength));
+            if (requestClient != NULL && !requestReplied && client->getSocket() != INVALID_SOCKET)
+            {
+                reply(client, "OK");
+            }
+            requestClient = NULL;
+            if (!keepReading)
+            {
+                return false;
+            }
+        }
+    }
+    return client->getSocket() != INVALID_SOCKET;
+}
+
+bool Server::processFrame(Session* client, std::string_view message)
+{
+    if (message.find("$file chunk ") != 0)
+    {
+        std::cout<<"[Received] ("<< client->getUsername()<<"): " << message << std::endl;
+    }
+
+    // Handle client request commands
+    if (message.find("$register") == 0)
+    {
+        std::string username(message.size() > 10 ? message.substr(10) : std::string_view());
+        if (username.empty() || username.find_first_of(" \t\r\n") != std::string::npos)
+        {
+            sendError(client, "INVALID_USERNAME", "usernames must be one word");
+        }
+        else if (username[0] == '#')
+        {
+            // '#' names a group of users, see $file offer
+            sendError(client, "INVALID_USERNAME", "usernames can't start with #");
+        }
+        else if (clients.size() > maxClients)
+        {
+            reply(client, "SV_FULL");
+            if (ioEngine == IO_ENGINE_RIO)
+            {
+                rio.flush();
+            }
+            shutdown(client->getSocket(), SD_SEND);
+            disconnectClient(client);
+            return false;
+        }
+        else 
+        {
+            // register user
+            std::string previousName = client->getUsername();
+            client->setUsername(username);
+            if (client == requestClient)
+            {
+                reply(client, "SV_SUCCESS");
+            }
+            else
+            {
+                // Untagged registrations keep the original unframed answer
+                commitOrQueue(client, "SV_SUCCESS", OUTBOUND_CONTROL);
+            }
+
+            // Tell everybody about the change as it happens, the subject too: its copy of the
+            // roster moves to the new version like everybody else's
+            if (previousName.empty())
+            {
+                broadcastPresence(roster.join(username), NULL);
+            }
+            else if (previousName != username)
+            {
+                broadcastPresence(roster.rename(previousName, username), NULL);
+            }
+        }
+    }
+    else if (message.find("$getlist") == 0)
+    {
+        // "$getlist <version>" gets the changes since that version, plain "$getlist" a full snapshot
+        uint64_t knownVersion = 0;
+        if (message.size() > 9)
+        {
+            std::from_chars(message.data() + 9, message.data() + message.size(), knownVersion);
+        }
+        reply(client, roster.encodeListReply(knownVersion));
+    }
+    else if (message.find("$getlog") == 0)
+    {
+        sendLog(client);
+    }
+    else if (message.find("$exit") == 0) 
+    { 
+        // Send a message to the client before closing the connection; chat and bulk
+        // still waiting for it are moot now
+        client->getOutbound().discardWaiting();
+        reply(client, "EXIT Goodbye! You have been disconnected.");
+        if (!client->getOutbound().hasWaiting())
+        {
+            sendCloseNotify(client);
+        }
+        if (ioEngine == IO_ENGINE_RIO)
+        {
+            // Posted sends have to be committed before the FIN
+            rio.flush();
+        }
+        // Disable sending on the socket to give the client a chance to read the message,
+        // or once the socket has taken it, see flushOutbound
+        client->setClosing(true);
+        if (client->getOutbound().isEmpty())
+        {
+            shutdown(client->getSocket(), SD_SEND);
+        }
+
+        // Wait for the client to acknowledge by closing its end; the main loop
+        // sees recv return 0 and removes the client from the clients list.
+        return false;
+    }
+    else if (message.find("$file ") == 0)
+    {
+        handleFileCommand(client, message);
+    }
+    else if (message.find("$multicast") == 0)
+    {
+        if (!multicast.isOpen())
+        {
+            sendError(client, "MULTICAST_UNAVAILABLE", "the server was started without --multicast");
+        }
+        else if (message.find("$multicast leave") == 0)
+        {
+            client->setMulticastId(0);
+        }
+        else
+        {
+            // Chat from here on comes from the group, starting at the sequence in the reply
+            if (client->getMulticastId() == 0)
+            {
+                client->setMulticastId(multicast.addMember());
+            }
+            reply(client, "MULTICAST " + multicast.getGroup() + " " + std::to_string(multicast.getPort()) + " "
+                + std::to_string(multicast.getNextSequence()) + " " + std::to_string(client->getMulticastId()));
+        }
+    }
+    else if (message.find("$nack ") == 0)
+    {
+        handleNack(client, message);
+    }
+    else if (message.find("$shm attach") == 0)
+    {
+        attachShared(client);
+    }
+    else if (message.find("$compress") == 0)
+    {
+        // "$compress <algorithm> ...", the ones the client can expand
+        std::string offered = " " + std::string(message.substr((std::min)(message.size(), size_t(9)))) + " ";
+        bool agreed = compression.isEnabled() && offered.find(" " + std::string(COMPRESS_ALGORITHM_NAME) + " ") != std::string::npos;
+        client->setCompressing(agreed);
+        reply(client, agreed ? "COMPRESS " + std::string(COMPRESS_ALGORITHM_NAME) + " " + std::to_string(compression.getThreshold())
+            : std::string("COMPRESS none"));
+    }
+    else if (message.find("$stats") == 0)
+    {
+        reply(client, "STATS " + buildStatsReport());
+    }
+    else if (message.find("$allocations") == 0)
+    {
+        // The benchmark's allocation check reads this before and after a burst of chat, so
+        // the answer is built like a relayed message: on the stack and in the arena
+        char count[64];
+        int size = allocationCountingEnabled()
+            ? snprintf(count, sizeof(count), "ALLOCATIONS %llu", static_cast<unsigned long long>(allocationCount()))
+            : snprintf(count, sizeof(count), "ERROR NOT_COUNTED build with CPPCHAT_COUNT_ALLOCATIONS");
+        reply(client, std::string_view(count, static_cast<size_t>(size)));
+    }
+    else if (message.find("$chat") == 0)
+    {
+        if (!passesContentFilter(client, message.substr((std::min)(message.size(), size_t(6)))))
+        {
+            return true;
+        }
+        // broadcast message to all other clients; the frame is built once, in the arena
+        std::string_view frame = arena.frame("\nCHAT ", client->getChatPrefix(), message.substr((std::min)(message.size(), size_t(6))));
+        broadcastChat(frame, client);
+        logMessage(frame.substr(sizeof(uint32_t)));
+    }
+    else 
+    {
+        if (!passesContentFilter(client, message))
+        {
+            return true;
+        }
+        // broadcast message to all other clients
+        std::string_view frame = arena.frame("CHAT ", client->getChatPrefix(), message);
+        broadcastChat(frame, client);
+        logMessage(frame.substr(sizeof(uint32_t)));
+    }
+    return true;
+}
+
+void Server::handleFileCommand(Session* client, std::string_view message)
+{
+    if (client->getUsername().empty())
+    {
+        sendError(client, "NOT_REGISTERED", "register before sending or receiving files");
+        return;
+    }
+    // Chunk frames carry binary data after the first line, only the line is parsed.
+    size_t headerEnd = message.find('\n');
+    static const std::string_view chunkCommand = "$file chunk ";
+    if (message.substr(0, chunkCommand.size()) == chunkCommand)
+    {
+        // The busy one, parsed in place
+        uint32_t ref = 0;
+        uint64_t offset = 0;
+        const char* end = message.data() + (headerEnd == std::string_view::npos ? message.size() : headerEnd);
+        auto parsedRef = std::from_chars(message.data() + chunkCommand.size(), end, ref);
+        auto parsedOffset = std::from_chars(parsedRef.ptr + 1, end, offset);
+        if (headerEnd == std::string_view::npos || parsedRef.ec != std::errc() || parsedOffset.ec != std::errc())
+        {
+            sendError(client, "BAD_REQUEST", "malformed file chunk");
+            return;
+        }
+        relayFileChunk(client, ref, offset, message.data() + headerEnd + 1, message.size() - headerEnd - 1);
+        return;
+    }
+
+    std::istringstream header(std::string(message.substr(0, headerEnd)));
+    std::string command;
+    std::string verb;
+    header >> command >> verb;
+    if (verb == "offer")
+    {
+        uint32_t ref = 0;
+        std::string target;
+        uint64_t size = 0;
+        std::string name;
+        if (!(header >> ref >> target >> size))
+        {
+            sendError(client, "BAD_REQUEST", "usage: $file offer <ref> <user|#all> <size> <name>");
+            return;
+        }
+        std::getline(header >> std::ws, name);
+        std::string prefix = "FILE ABORT " + std::to_string(ref) + " ";
+        if (name.empty() || name.find_first_of("/\\") != std::string::npos)
+        {
+            sendToSpecificClient(prefix + "BAD_NAME", client);
+            return;
+        }
+        if (findTransfer(client, ref) != transfers.end())
+        {
+            sendToSpecificClient(prefix + "DUPLICATE_REF", client);
+            return;
+        }
+
+        FileTransfer transfer;
+        transfer.id = ++nextTransferId;
+        transfer.sender = client;
+        transfer.senderRef = ref;
+        transfer.size = size;
+        transfer.name = name;
+        transfer.offeredAt = std::chrono::steady_clock::now();
+        // There are no rooms yet, #all is everybody registered except the sender
+        for (auto& other : clients)
+        {
+            if (other != client && other->getSocket() != INVALID_SOCKET && !other->getUsername().empty()
+                && (target == "#all" || other->getUsername() == target))
+            {
+                transfer.receivers[other] = FileReceiver();
+            }
+        }
+        if (transfer.receivers.empty())
+        {
+            sendToSpecificClient(prefix + "NO_RECIPIENT", client);
+            return;
+        }
+        std::string offer = "FILE OFFER " + std::to_string(transfer.id) + " " + client->getUsername() + " "
+            + std::to_string(size) + " " + name;
+        for (auto& receiver : transfer.receivers)
+        {
+            sendToSpecificClient(offer, receiver.first);
+        }
+        transfers[transfer.id] = transfer;
+    }
+    else if (verb == "accept" || verb == "window" || verb == "decline")
+    {
+        uint32_t id = 0;
+        header >> id;
+        auto it = transfers.find(id);
+        if (it == transfers.end() || it->second.receivers.count(client) == 0)
+        {
+            // Also what a late answer to an expired offer gets
+            sendToSpecificClient("FILE CANCEL " + std::to_string(id) + " UNKNOWN", client);
+            return;
+        }
+        FileTransfer& transfer = it->second;
+        FileReceiver& receiver = transfer.receivers[client];
+        uint64_t offset = 0;
+        uint64_t limit = 0;
+        if (verb == "decline")
+        {
+            transfer.receivers.erase(client);
+        }
+        else if (verb == "accept" && !receiver.accepted && (header >> offset >> limit))
+        {
+            receiver.accepted = true;
+            receiver.offset = (std::min)(offset, transfer.size);
+            receiver.limit = (std::max)(receiver.offset, (std::min)(limit, transfer.size));
+        }
+        else if (verb == "window" && receiver.accepted && (header >> limit))
+        {
+            // Credit only ever grows
+            receiver.limit = (std::max)(receiver.limit, (std::min)(limit, transfer.size));
+        }
+        else
+        {
+            sendError(client, "BAD_REQUEST", "malformed $file " + verb);
+            return;
+        }
+        updateTransfer(id);
+    }
+    else if (verb == "cancel")
+    {
+        uint32_t ref = 0;
+        header >> ref;
+        auto it = findTransfer(client, ref);
+        if (it != transfers.end())
+        {
+            cancelTransfer(it, "CANCELLED");
+        }
+    }
+    else
+    {
+        sendError(client, "BAD_REQUEST", "unknown file command " + verb);
+    }
+}
+
+void Server::relayFileChunk(Session* client, uint32_t ref, uint64_t offset, const char* data, size_t size)
+{
+    auto it = findTransfer(client, ref);
+    if (it == transfers.end())
+    {
+        // Chunks already in flight when the transfer was cancelled
+        return;
+    }
+    FileTransfer& transfer = it->second;
+    if (!transfer.started || offset != transfer.nextOffset || size == 0 || size > FILE_CHUNK_SIZE
+        || offset + size > transfer.grantedLimit)
+    {
+        sendToSpecificClient("FILE ABORT " + std::to_string(ref) + " PROTOCOL_ERROR", client);
+        cancelTransfer(it, "PROTOCOL_ERROR");
+        return;
+    }
+
+    // Relayed as it arrives; the server never holds more than this one chunk of a file.
+    char header[64];
+    int headerSize = snprintf(header, sizeof(header), "FILE CHUNK %u %llu\n", transfer.id, static_cast<unsigned long long>(offset));
+    std::string_view chunk = arena.frame(std::string_view(header, headerSize), std::string_view(data, size));
+    for (auto& receiver : transfer.receivers)
+    {
+        // A receiver that resumed further ahead already has these bytes
+        if (offset + size > receiver.second.offset)
+        {
+            writeFrame(receiver.first, chunk, OUTBOUND_BULK);
+        }
+    }
+    transfer.nextOffset += size;
+    transferBytes += size;
+    if (transfer.nextOffset == transfer.size)
+    {
+        completeTransfer(it);
+    }
+}
+
+void Server::updateTransfer(uint32_t id)
+{
+    auto it = transfers.find(id);
+    if (it == transfers.end())
+    {
+        return;
+    }
+    FileTransfer& transfer = it->second;
+    std::string ref = std::to_string(transfer.senderRef);
+    if (!transfer.hasAcceptedReceivers() && (transfer.started || !transfer.hasPendingReceivers()))
+    {
+        sendToSpecificClient("FILE ABORT " + ref + (transfer.started ? " RECEIVERS_LEFT" : " DECLINED"), transfer.sender);
+        transfer.sender->removeTransfer(transfer.senderRef);
+        transfersCancelled++;
+        transfers.erase(it);
+        return;
+    }
+    if (!transfer.started)
+    {
+        // Everybody answered, stream from the lowest offset anyone asked for
+        if (transfer.hasPendingReceivers())
+        {
+            return;
+        }
+        transfer.started = true;
+        transfer.sender->addTransfer(transfer.senderRef);
+        transfer.nextOffset = transfer.startOffset();
+        sendToSpecificClient("FILE START " + ref + " " + std::to_string(transfer.nextOffset), transfer.sender);
+    }
+    if (transfer.nextOffset == transfer.size)
+    {
+        // Every receiver already had the whole file
+        completeTransfer(it);
+        return;
+    }
+    uint64_t limit = transfer.windowLimit();
+    if (limit > transfer.grantedLimit)
+    {
+        transfer.grantedLimit = limit;
+        sendToSpecificClient("FILE WINDOW " + ref + " " + std::to_string(limit), transfer.sender);
+    }
+}
+
+void Server::completeTransfer(std::map<uint32_t, FileTransfer>::iterator transfer)
+{
+    // Behind the chunks, which may still be waiting in the bulk lane
+    std::string done = "FILE DONE " + std::to_string(transfer->second.id);
+    for (auto& receiver : transfer->second.receivers)
+    {
+        sendToSpecificClient(done, receiver.first, OUTBOUND_BULK);
+    }
+    sendToSpecificClient("FILE SENT " + std::to_string(transfer->second.senderRef), transfer->second.sender);
+    transfer->second.sender->removeTransfer(transfer->second.senderRef);
+    transfersCompleted++;
+    transfers.erase(transfer);
+}
+
+void Server::cancelTransfer(std::map<uint32_t, FileTransfer>::iterator transfer, const std::string& reason)
+{
+    std::string cancel = "FILE CANCEL " + std::to_string(transfer->second.id) + " " + reason;
+    for (auto& receiver : transfer->second.receivers)
+    {
+        sendToSpecificClient(cancel, receiver.first, OUTBOUND_BULK);
+    }
+    transfer->second.sender->removeTransfer(transfer->second.senderRef);
+    transfersCancelled++;
+    transfers.erase(transfer);
+}
 
-    // Allocate a buffer of the appropriate size to receive the message.
-    char* buffer = new char[messageSize];
-    int bytesRead = 0;
-    while (bytesRead < messageSize)
+void Server::expireFileOffers(std::chrono::steady_clock::time_point now)
+{
+    std::vector<uint32_t> expired;
+    for (auto& transfer : transfers)
+    {
+        if (!transfer.second.started && now - transfer.second.offeredAt > std::chrono::seconds(FILE_OFFER_TIMEOUT_SECONDS))
+        {
+            expired.push_back(transfer.first);
+        }
+    }
+    for (uint32_t id : expired)
     {
-        int result = recv(client->getSocket(), buffer + bytesRead, messageSize - bytesRead, 0);
-        if (result == SOCKET_ERROR || result == 0)
+        // Whoever didn't answer is left out, the rest get the file
+        FileTransfer& transfer = transfers[id];
+        for (auto it = transfer.receivers.begin(); it != transfer.receivers.end();)
         {
-            // Error occurred or client disconnected
-            delete[] buffer;
-            closesocket(client->getSocket());
-            FD_CLR(client->getSocket(), &master);
-            for (auto it = clients.begin(); it != clients.end(); ++it)
+            if (!it->second.accepted)
             {
-                if ((*it)->getSocket() == client->getSocket())
-                {
-                    delete (*it);
-                    clients.erase(it);
-                    break;
-                }
+                sendToSpecificClient("FILE CANCEL " + std::to_string(id) + " EXPIRED", it->first);
+                it = transfer.receivers.erase(it);
+            }
+            else
+            {
+                ++it;
             }
-            return false;
         }
-        bytesRead += result;
+        updateTransfer(id);
     }
-    // Convert the received message to a string.
-    std::string message(buffer, messageSize);
-    std::cout<<"[Received] ("<< client->getUsername()<<"): " << message << std::endl;
-    delete[] buffer;
+}
 
-    // Handle client request commands
-    if (message.find("$register") == 0)
+void Server::dropFileTransfers(Session* client)
+{
+    std::vector<uint32_t> affected;
+    for (auto& transfer : transfers)
     {
-        std::string username = message.substr(10, message.size() - 10);
-        if (clients.size() > maxClients)
+        affected.push_back(transfer.first);
+    }
+    for (uint32_t id : affected)
+    {
+        auto it = transfers.find(id);
+        if (it == transfers.end())
         {
-            std::string message = "SV_FULL";
-            sendToSpecificClient(message, client);
-            std::this_thread::sleep_for(std::chrono::seconds(1));
-            closesocket(client->getSocket());
-            delete client;
+            continue;
         }
-        else 
+        if (it->second.sender == client)
         {
-            // register user
-            client->setUsername(username);
-            std::string reply = "SV_SUCCESS";
-            send(client->getSocket(), reply.c_str(), reply.size(), 0);
+            cancelTransfer(it, "SENDER_LEFT");
         }
-    }
-    else if (message.find("$getlist") == 0)
-    {
-        // send list of connected users
-        std::string list;
-        list += "LIST ";
-        for (auto& c : clients) 
+        else if (it->second.receivers.erase(client) > 0)
         {
-            list += c->getUsername() + ",";
+            // The others may have been waiting on this receiver
+            updateTransfer(id);
         }
-        if (clients.size() > 1)
+    }
+}
+
+std::map<uint32_t, FileTransfer>::iterator Server::findTransfer(Session* sender, uint32_t ref)
+{
+    for (auto it = transfers.begin(); it != transfers.end(); ++it)
+    {
+        if (it->second.sender == sender && it->second.senderRef == ref)
         {
-            list.erase(list.size() - 1); // remove last comma
+            return it;
         }
-        else
+    }
+    return transfers.end();
+}
+
+void Server::sendToSpecificClient(std::string_view message, Session* client, OutboundClass priority) {
+    // Header and payload in one piece: one TLS record, and one entry if it has to wait
+    writeFrame(client, arena.frame(message), priority);
+}
+
+bool Server::writeFrame(Session* client, std::string_view frame, OutboundClass priority) {
+    // frame already carries its size header
+    OutboundQueue& queue = client->getOutbound();
+    if (client->isClosing() || queue.isOverflowed())
+    {
+        // Past its goodbye, or about to be cut off
+        return false;
+    }
+    framesSent[priority]++;
+    if (client->isCompressing() && compression.compressFrame(std::string_view(), frame.substr(sizeof(uint32_t)), compressScratch))
+    {
+        // Compressed once however many sessions it goes to, see FrameCompressor
+        frame = compressScratch;
+    }
+    return commitOrQueue(client, frame, priority);
+}
+
+bool Server::commitOrQueue(Session* client, std::string_view bytes, OutboundClass priority) {
+    // Control frames too: a rio or shared-memory session without room would block or be refused
+    OutboundQueue& queue = client->getOutbound();
+    if (queue.isEmpty() && canCommit(client, bytes.size()))
+    {
+        // Nothing to wait for: straight to the transport, without a copy
+        if (!transmit(client, bytes.data(), static_cast<int>(bytes.size())))
         {
-            list = "LIST You are all alone in this server\n";
+            return false;
         }
-        sendToSpecificClient(list, client);
     }
-    else if (message.find("$getlog") == 0)
+    else
     {
-        // send chat log
-        std::ifstream logFile(logFileName, std::ios::binary);
-        if (!logFile.good()) {
-            std::cerr << "Error opening log file." << std::endl;
-            return false;
+        framesQueued++;
+        queue.push(priority, bytes);
+        flushOutbound(client);
+    }
+    if (queue.getBacklog() > OUTBOUND_MAX_BACKLOG)
+    {
+        // Disconnected at the end of the iteration, not in the middle of somebody's loop over the sessions
+        queue.setOverflowed();
+        outboundOverflows++;
+        return false;
+    }
+    return true;
+}
+
+bool Server::canCommit(Session* client, size_t size) {
+    // Whether the transport takes another frame now, rather than blocking or buffering it
+    if (ioEngine == IO_ENGINE_RIO)
+    {
+        TlsChannel* tls = client->getTls();
+        return rio.canSend(client, tls != NULL ? tls->encryptedSize(size) : size);
+    }
+    if (client->getShared() != NULL)
+    {
+        return client->getShared()->writable() >= size;
+    }
+    return !client->getOutbound().hasWire();
+}
+
+void Server::flushOutbound(Session* client) {
+    // The rest of the wire first, then frames in the order the lanes are due, while the
+    // transport has room; a burst at most, the other sessions are waiting too
+    OutboundQueue& queue = client->getOutbound();
+    size_t burst = 0;
+    std::string_view frame;
+    while (client->getSocket() != INVALID_SOCKET && !queue.isOverflowed())
+    {
+        if (queue.hasWire())
+        {
+            std::string_view wire = queue.getWire();
+            size_t sent = 0;
+            if (!sendSome(client->getSocket(), wire.data(), wire.size(), sent) || sent == 0)
+            {
+                break;
+            }
+            queue.consumeWire(sent);
+            continue;
+        }
+        if (client->isClosing() && !queue.hasWaiting())
+        {
+            // The goodbye is out
+            if (ioEngine == IO_ENGINE_RIO)
+            {
+                rio.flush();
+            }
+            shutdown(client->getSocket(), SD_SEND);
+            break;
+        }
+        if (burst >= OUTBOUND_MAX_BURST || !queue.next(frame) || !canCommit(client, frame.size()))
+        {
+            break;
+        }
+        burst += frame.size();
+        transmit(client, frame.data(), static_cast<int>(frame.size()));
+        queue.pop();
+        if (client->isClosing() && !queue.hasWaiting())
+        {
+            // The goodbye had to wait for room, its close_notify goes right behind it
+            sendCloseNotify(client);
         }
-        logFile.seekg(0, std::ios::end);
-        int fileSize = logFile.tellg();
-        logFile.seekg(0, std::ios::beg);
+    }
+}
 
-        std::string logPrefix = "LOG ";
-        int totalSize = fileSize + logPrefix.size();
+void Server::sendCloseNotify(Session* client) {
+    if (client->getTls() == NULL)
+    {
+        return;
+    }
+    std::string closeNotify;
+    client->getTls()->close(closeNotify);
+    writeSocket(client, closeNotify.data(), closeNotify.size());
+}
 
-        char* fileBuffer = new char[totalSize];
-        memcpy(fileBuffer, logPrefix.c_str(), logPrefix.size());
-        logFile.read(fileBuffer + logPrefix.size(), fileSize);
-        logFile.close();
+void Server::sendLog(Session* client) {
+    // Bulk, in parts pulled from the file as the session has room for them, so live chat keeps
+    // flowing and the log is never held in memory whole
+    std::shared_ptr<std::ifstream> logFile = std::make_shared<std::ifstream>(logFileName, std::ios::binary);
+    if (!logFile->good()) {
+        std::cerr << "Error opening log file." << std::endl;
+        sendError(client, "LOG_UNAVAILABLE", "the chat log could not be opened");
+        return;
+    }
+    logFile->seekg(0, std::ios::end);
+    uint64_t fileSize = static_cast<uint64_t>(logFile->tellg());
+    logFile->seekg(0, std::ios::beg);
+    // The cache is keyed by offset, so it has to be this very file: one moved in to replace
+    // the log has a new file index even if it is as long
+    BY_HANDLE_FILE_INFORMATION identity{};
+    HANDLE file = CreateFileA(logFileName.c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, 0, NULL);
+    if (file == INVALID_HANDLE_VALUE || !GetFileInformationByHandle(file, &identity))
+    {
+        identity = BY_HANDLE_FILE_INFORMATION{};
+    }
+    if (file != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(file);
+    }
+    compression.useHistoryOf(identity.dwVolumeSerialNumber,
+        (static_cast<uint64_t>(identity.nFileIndexHigh) << 32) | identity.nFileIndexLow, fileSize);
+    if (client == requestClient)
+    {
+        requestReplied = true;
+    }
+    client->getOutbound().addBulkSource(logSource(logFile, fileSize, std::string(client == requestClient ? requestTag : std::string_view()),
+        client->isCompressing() ? &compression : nullptr));
+    flushOutbound(client);
+}
 
-        // Send the size of the log file with prefix first
-        std::string logString(fileBuffer, totalSize);
-        sendToSpecificClient(logString, client);
-        delete[] fileBuffer;
+bool Server::transmit(Session* client, const char* data, int size) {
+    TlsChannel* tls = client->getTls();
+    if (tls == NULL)
+    {
+        return writeSocket(client, data, size);
     }
-    else if (message.find("$exit") == 0) 
-    { 
-        // Send a message to the client before closing the connection
-        std::string goodbyeMessage = "EXIT Goodbye! You have been disconnected.";
-        sendToSpecificClient(goodbyeMessage, client);
-        std::cout << "(" << client->getUsername() << ") HAS DISCONNECTED\n";
-        // Disable sending on the socket to give the client a chance to read the message
-        shutdown(client->getSocket(), SD_SEND);
-
-        // Wait for the client to acknowledge the message
-        char buffer[256];
-        recv(client->getSocket(), buffer, sizeof(buffer), 0);
-        int recvResult = recv(client->getSocket(), buffer, sizeof(buffer), 0);
-        if (recvResult == SOCKET_ERROR) {
-            std::cerr << "Error receiving acknowledgment: " << WSAGetLastError() << std::endl;
-        }
-        // Close the client socket
-        closesocket(client->getSocket());
-        FD_CLR(client->getSocket(), &master);
+    tlsScratch.clear();
+    if (!tls->encrypt(data, size, tlsScratch))
+    {
+        return false;
+    }
+    return writeSocket(client, tlsScratch.data(), tlsScratch.size());
+}
 
-        // Remove the client from the clients list
-        auto it = std::find_if(clients.begin(), clients.end(), [&client](const Client* c) { return c->getSocket() == client->getSocket(); });
-        if (it != clients.end()) {
-            delete (*it);
-            clients.erase(it);
+bool Server::writeSocket(Session* client, const char* data, size_t size, const char* more, size_t moreSize) {
+    // Every byte for a session goes through here. With RIO it is queued in registered memory
+    // and leaves on the next flush, with select it is a non-blocking send right away, and
+    // whatever the socket doesn't take goes on the session's wire.
+    if (ioEngine == IO_ENGINE_RIO)
+    {
+        // Refused when out of slots; what got here without asking canCommit is cut off
+        // rather than left waiting on the loop
+        if (!rio.send(client, data, size, more, moreSize))
+        {
+            disconnectClient(client);
+            return false;
         }
+        return true;
     }
-    else if (message.find("$chat") == 0)
+    SharedChannel* shared = client->getShared();
+    if (shared != NULL)
     {
-        // broadcast message to all other clients
-        std::string broadcastMessage = "(" + client->getUsername() + "): " + message.substr(6);
-        broadcastMessage = "\nCHAT " + broadcastMessage;
-        sendToAllClients(broadcastMessage, client);
-        logMessage(broadcastMessage);
+        // A client that stopped draining its ring is cut off like a dead connection
+        if (!shared->send(data, size, more, moreSize))
+        {
+            disconnectClient(client);
+            return false;
+        }
+        return true;
     }
-    else 
+    OutboundQueue& queue = client->getOutbound();
+    const char* parts[2] = { data, more };
+    size_t sizes[2] = { size, moreSize };
+    for (int part = 0; part < 2; part++)
     {
-        // broadcast message to all other clients
-        std::string broadcastMessage = "(" + client->getUsername() + "): " + message;
-        broadcastMessage = "CHAT " + broadcastMessage;
-        sendToAllClients(broadcastMessage, client);
-        logMessage(broadcastMessage);
+        size_t sent = 0;
+        if (sizes[part] == 0)
+        {
+            continue;
+        }
+        if (!queue.hasWire() && !sendSome(client->getSocket(), parts[part], sizes[part], sent))
+        {
+            return false;
+        }
+        if (sent < sizes[part])
+        {
+            queue.appendWire(parts[part] + sent, sizes[part] - sent);
+        }
     }
     return true;
 }
 
-void Server::sendToSpecificClient(std::string message, Client* client) {
+void Server::sendError(Session* client, const std::string& code, const std::string& detail) {
+    reply(client, "ERROR " + code + " " + detail);
+}
+
+void Server::reply(Session* client, std::string_view message) {
+    if (client != requestClient)
+    {
+        sendToSpecificClient(message, client);
+        return;
+    }
+    requestReplied = true;
+    writeFrame(client, arena.frame(requestTag, message));
+}
+
+void Server::broadcastPresence(const PresenceEvent& event, Session* leaving) {
+    // Only registered sessions get presence events; the others fetch a snapshot once registered.
+    std::string message = Roster::encodeEvent(event);
+    for (auto& client : clients)
+    {
+        if (client->getSocket() != INVALID_SOCKET && client != leaving && !client->getUsername().empty())
+        {
+            sendToSpecificClient(message, client, OUTBOUND_CHAT);
+        }
+    }
+}
+
+void Server::sendFrame(SOCKET socket, const std::string& message) {
     // Send the size of the message first
     //uint32_t messageSize = htonl(static_cast<uint32_t>(message.size()));
     uint32_t messageSize = static_cast<uint32_t>(message.size());
-    send(client->getSocket(), (const char*)&messageSize, sizeof(messageSize), 0);
+    send(socket, (const char*)&messageSize, sizeof(messageSize), 0);
 
     // Send the actual message
-    send(client->getSocket(), message.c_str(), message.size(), 0);
+    send(socket, message.c_str(), message.size(), 0);
+}
+
+void Server::sendToAllClients(std::string_view message, Session* sender) {
+    broadcastFrame(arena.frame(message), sender);
 }
 
-void Server::sendToAllClients(std::string message, Client* sender) {
-    // Send message size to all clients except sender
-    int messageSize = static_cast<int>(message.length());
+void Server::broadcastFrame(std::string_view frame, Session* sender) {
+    // Send size and message to all clients except sender, in one write each
     for (auto& client : clients)
     {
-        if (client->getSocket() != tcpServerSocket && client->getSocket() != sender->getSocket())
+        if (client->getSocket() != INVALID_SOCKET && client != sender)
         {
-            int result = send(client->getSocket(), reinterpret_cast<char*>(&messageSize), sizeof(messageSize), 0);
-            if (result == SOCKET_ERROR)
-            {
-                throw std::runtime_error("Failed to send message size: " + std::to_string(WSAGetLastError()));
-            }
+            writeFrame(client, frame, OUTBOUND_CHAT);
+        }
+    }
+}
 
-            // Send message to client
-            result = send(client->getSocket(), message.c_str(), messageSize, 0);
-            if (result == SOCKET_ERROR)
-            {
-                throw std::runtime_error("Failed to send message: " + std::to_string(WSAGetLastError()));
-            }
+void Server::broadcastChat(std::string_view frame, Session* sender) {
+    if (!multicast.isOpen())
+    {
+        broadcastFrame(frame, sender);
+        return;
+    }
+    // One publish for all members, TCP only for the sessions that didn't join
+    multicast.publish(frame.substr(sizeof(uint32_t)), sender->getMulticastId());
+    for (auto& client : clients)
+    {
+        if (client->getSocket() != INVALID_SOCKET && client != sender && client->getMulticastId() == 0)
+        {
+            writeFrame(client, frame, OUTBOUND_CHAT);
+        }
+    }
+}
+
+void Server::handleNack(Session* client, std::string_view message) {
+    // "$nack <from> <to>": resent over TCP, or reported lost once out of the history
+    uint64_t from = 0;
+    uint64_t to = 0;
+    const char* end = message.data() + message.size();
+    auto parsedFrom = std::from_chars(message.data() + 6, end, from);
+    auto parsedTo = std::from_chars((std::min)(parsedFrom.ptr + 1, end), end, to);
+    if (!multicast.isOpen() || parsedFrom.ec != std::errc() || parsedTo.ec != std::errc() || to < from)
+    {
+        sendError(client, "BAD_REQUEST", "malformed nack");
+        return;
+    }
+    to = (std::min)(to, (std::min)(from + MULTICAST_MAX_NACK_RANGE - 1, multicast.getNextSequence() - 1));
+    uint64_t oldest = multicast.getOldestSequence();
+    if (from < oldest)
+    {
+        uint64_t lostTo = (std::min)(to, oldest - 1);
+        multicast.getStats().repairsLost += lostTo - from + 1;
+        sendToSpecificClient("REPAIR_LOST " + std::to_string(from) + " " + std::to_string(lostTo), client, OUTBOUND_CHAT);
+        from = lostTo + 1;
+    }
+    for (uint64_t sequence = from; sequence <= to; sequence++)
+    {
+        std::string_view repaired;
+        uint32_t origin = 0;
+        if (multicast.find(sequence, repaired, origin))
+        {
+            char header[64];
+            int headerSize = snprintf(header, sizeof(header), "REPAIR %llu %u\n", static_cast<unsigned long long>(sequence), origin);
+            writeFrame(client, arena.frame(std::string_view(header, headerSize), repaired), OUTBOUND_CHAT);
+            multicast.getStats().repairs++;
         }
     }
 }
 
-void Server::logMessage(std::string message) {
-    std::ofstream logFile(logFileName, std::ios::app);
-    if (!logFile.good()) {
+void Server::enableMulticast(const std::string& group, u_short port) {
+    multicastGroup = group;
+    multicastPort = port;
+}
+
+void Server::logMessage(std::string_view message) {
+    // Opened once and kept open; every line is flushed so $getlog sees it right away.
+    if (!logStream.is_open())
+    {
+        logStream.open(logFileName, std::ios::app);
+    }
+    if (!logStream.good()) {
         std::cerr << "Error opening log file." << std::endl;
+        logStream.close();
+        logStream.clear();
         return;
     }
     std::time_t now = std::time(nullptr);
     std::tm* localTime = std::localtime(&now);
     char timeBuffer[80];
     std::strftime(timeBuffer, sizeof(timeBuffer), "[%Y-%m-%d %H:%M:%S]", localTime);
-    logFile << timeBuffer << " " << message << std::endl;
-    logFile.close();
+    logStream << timeBuffer << " " << message << std::endl;
+}
+
+void Server::setAdmissionConfig(const AdmissionConfig& config) {
+    admission.configure(config);
+}
+
+void Server::enableTls(const std::string& certificateSubject) {
+    // Throws if the certificate can't be found or loaded.
+    tlsCredentials = TlsCredentials::forServer(certificateSubject);
+}
+
+void Server::enableContentFilter(const std::string& path) {
+    contentFilter = ContentFilter::load(path);
+    filterPath = path;
+    std::cout << "Content filter: " << contentFilter->getTermCount() << " terms from " << path << std::endl;
+}
+
+void Server::watchContentFilter() {
+    // Compiling thousands of terms takes a while, so it happens here and the loop only swaps pointers
+    std::error_code error;
+    auto lastWrite = std::filesystem::last_write_time(filterPath, error);
+    while (running)
+    {
+        std::this_thread::sleep_for(std::chrono::seconds(FILTER_RELOAD_CHECK_SECONDS));
+        auto written = std::filesystem::last_write_time(filterPath, error);
+        if (error || written == lastWrite)
+        {
+            continue;
+        }
+        lastWrite = written;
+        try
+        {
+            std::shared_ptr<ContentFilter> filter = ContentFilter::load(filterPath);
+            std::cout << "Content filter reloaded: " << filter->getTermCount() << " terms" << std::endl;
+            std::lock_guard<std::mutex> lock(filterMutex);
+            reloadedFilter = std::move(filter);
+            filterReloaded = true;
+        }
+        catch (const std::exception& ex)
+        {
+            std::cerr << ex.what() << ", keeping the current terms" << std::endl;
+        }
+    }
+}
+
+bool Server::passesContentFilter(Session* client, std::string_view text) {
+    if (!contentFilter)
+    {
+        return true;
+    }
+    auto start = std::chrono::steady_clock::now();
+    FilterVerdict verdict = contentFilter->check(text);
+    unsigned long long elapsed = static_cast<unsigned long long>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+    filterStats.checked++;
+    filterStats.totalNanoseconds += elapsed;
+    filterStats.maxNanoseconds = (std::max)(filterStats.maxNanoseconds, elapsed);
+    if (verdict.action == FILTER_BLOCK)
+    {
+        filterStats.blocked++;
+        sendError(client, "MESSAGE_BLOCKED", "contains a banned term");
+        return false;
+    }
+    if (verdict.action == FILTER_FLAG)
+    {
+        filterStats.flagged++;
+        std::cerr << "(" << client->getUsername() << ") flagged for \"" << contentFilter->getTerm(verdict.term) << "\"" << std::endl;
+    }
+    return true;
+}
+
+void Server::setIoEngine(IoEngineType engine) {
+    // Takes effect when run() starts; falls back to select if RIO is unavailable.
+    ioEngine = engine;
+}
+
+void Server::setSessionLimits(const SessionLimits& limits) {
+    // Applies to sessions accepted from now on.
+    sessionLimits = limits;
+}
+
+void Server::setCompressionThreshold(size_t threshold) {
+    compression.setThreshold(threshold);
+}
+
+void Server::setBusyPoll(const BusyPollConfig& config) {
+    busyPoll.configure(config);
+}
+
+void Server::setMemoryConfig(const MemoryConfig& config) {
+    memory.configure(config);
+}
+
+void Server::reclaimSession(Session* client) {
+    size_t released = client->reclaimBuffers(memory.getPool());
+    if (released > 0)
+    {
+        memory.recordReclaim(released);
+    }
+}
+
+void Server::sweepMemory() {
+    // Sessions quiet for idleSeconds give their buffers back, the rest are only counted
+    const MemoryConfig& config = memory.getConfig();
+    uint32_t idleSweeps = static_cast<uint32_t>((std::max)(1, config.idleSeconds / MEMORY_SWEEP_SECONDS));
+    size_t inUse = 0;
+    for (Session* client : clients)
+    {
+        if (client->getSocket() == INVALID_SOCKET)
+        {
+            continue;
+        }
+        if (client->countQuietSweep() >= idleSweeps)
+        {
+            reclaimSession(client);
+        }
+        inUse += client->getMemoryUsage();
+    }
+    memory.recordSweep(inUse);
+    if (!memory.isOver())
+    {
+        return;
+    }
+
+    // Over budget: every session with nothing pending gives its buffers back, quiet or not
+    std::vector<std::pair<size_t, Session*>> heaviest;
+    inUse = 0;
+    for (Session* client : clients)
+    {
+        if (client->getSocket() == INVALID_SOCKET)
+        {
+            continue;
+        }
+        reclaimSession(client);
+        size_t usage = client->getMemoryUsage();
+        inUse += usage;
+        if (usage >= config.shedFloor)
+        {
+            heaviest.emplace_back(usage, client);
+        }
+    }
+    memory.recordSweep(inUse);
+
+    // Then the biggest go until we are back under, the ones sitting on large backlogs or
+    // frames. Idle sessions are far below the floor and are never shed.
+    std::sort(heaviest.begin(), heaviest.end(), [](const auto& a, const auto& b) { return a.first > b.first; });
+    for (const auto& entry : heaviest)
+    {
+        if (!memory.isOver())
+        {
+            break;
+        }
+        std::cerr << "(" << entry.second->getUsername() << ") holds " << entry.first << " bytes over the memory budget, disconnecting" << std::endl;
+        disconnectClient(entry.second);
+        memory.recordShed(entry.first);
+    }
+}
+
+std::string Server::buildStatsReport() const {
+    std::string report = "clients=" + std::to_string(clients.size()) + "/" + std::to_string(maxClients) + "\n";
+    report += admission.report() + "\n";
+    report += "tls: enabled=" + std::string(tlsCredentials ? "yes" : "no")
+        + " handshakes=" + std::to_string(tlsHandshakes)
+        + " resumed=" + std::to_string(tlsResumed)
+        + " failed=" + std::to_string(tlsFailures) + "\n";
+    report += "roster: version=" + std::to_string(roster.getVersion()) + " users=" + std::to_string(roster.size()) + "\n";
+    report += "inbound: max_frame=" + std::to_string(sessionLimits.maxFrameSize)
+        + " too_large=" + std::to_string(framesTooLarge)
+        + " rate_limited=" + std::to_string(framesRateLimited)
+        + " dropped=" + std::to_string(framesDropped)
+        + " tagged=" + std::to_string(taggedRequests) + "\n";
+    size_t backlogged = 0;
+    size_t backlog = 0;
+    for (const Session* client : clients)
+    {
+        backlog += client->getOutbound().getBacklog();
+        backlogged += client->getOutbound().isEmpty() ? 0 : 1;
+    }
+    report += "outbound: control=" + std::to_string(framesSent[OUTBOUND_CONTROL])
+        + " chat=" + std::to_string(framesSent[OUTBOUND_CHAT])
+        + " bulk=" + std::to_string(framesSent[OUTBOUND_BULK])
+        + " queued=" + std::to_string(framesQueued)
+        + " backlogged=" + std::to_string(backlogged)
+        + " backlog_bytes=" + std::to_string(backlog)
+        + " overflows=" + std::to_string(outboundOverflows) + "\n";
+    report += "io: engine=" + std::string(ioEngine == IO_ENGINE_RIO ? "rio" : "select");
+    if (ioEngine == IO_ENGINE_RIO)
+    {
+        const RioStats& io = rio.getStats();
+        report += " receives=" + std::to_string(io.receives)
+            + " sends=" + std::to_string(io.sends)
+            + " commits=" + std::to_string(io.commits)
+            + " refused=" + std::to_string(io.refused)
+            + " bytes_out=" + std::to_string(io.bytesSent);
+    }
+    report += "\n";
+    report += "busy_poll: " + busyPoll.report() + "\n";
+    if (multicast.isOpen())
+    {
+        size_t members = std::count_if(clients.begin(), clients.end(), [](const Session* client) { return client->getMulticastId() != 0; });
+        const MulticastStats& delivery = multicast.getStats();
+        report += "multicast: group=" + multicast.getGroup() + ":" + std::to_string(multicast.getPort())
+            + " members=" + std::to_string(members)
+            + " messages=" + std::to_string(delivery.messages)
+            + " datagrams=" + std::to_string(delivery.datagrams)
+            + " heartbeats=" + std::to_string(delivery.heartbeats)
+            + " repairs=" + std::to_string(delivery.repairs)
+            + " repairs_lost=" + std::to_string(delivery.repairsLost) + "\n";
+    }
+    else
+    {
+        report += "multicast: off\n";
+    }
+    if (compression.isEnabled())
+    {
+        size_t compressing = std::count_if(clients.begin(), clients.end(), [](const Session* client) { return client->isCompressing(); });
+        report += "compression: sessions=" + std::to_string(compressing) + " " + compression.report() + "\n";
+    }
+    else
+    {
+        report += "compression: off\n";
+    }
+    if (localServerSocket != INVALID_SOCKET)
+    {
+        size_t local = 0;
+        size_t shared = 0;
+        unsigned long long wakeUps = 0;
+        unsigned long long fullWaits = 0;
+        for (const Session* client : clients)
+        {
+            local += client->isLocal() ? 1 : 0;
+            if (client->getShared() != NULL)
+            {
+                shared++;
+                wakeUps += client->getShared()->getStats().wakeUps;
+                fullWaits += client->getShared()->getStats().fullWaits;
+            }
+        }
+        report += "local: path=" + localPath
+            + " sessions=" + std::to_string(local)
+            + " shared=" + std::to_string(shared)
+            + " attached=" + std::to_string(sharedAttached)
+            + " wakeups=" + std::to_string(wakeUps)
+            + " full_waits=" + std::to_string(fullWaits) + "\n";
+    }
+    else
+    {
+        report += "local: off\n";
+    }
+    report += "memory: arena=" + std::to_string(arena.getCapacity()) + " " + memory.report();
+    if (allocationCountingEnabled())
+    {
+        report += " allocations=" + std::to_string(allocationCount());
+    }
+    report += "\n";
+    if (contentFilter)
+    {
+        report += "filter: terms=" + std::to_string(contentFilter->getTermCount())
+            + " states=" + std::to_string(contentFilter->getStateCount())
+            + " prefilter=" + std::string(contentFilter->hasPrefilter() ? "yes" : "no")
+            + " checked=" + std::to_string(filterStats.checked)
+            + " blocked=" + std::to_string(filterStats.blocked)
+            + " flagged=" + std::to_string(filterStats.flagged)
+            + " avg_ns=" + std::to_string(filterStats.checked > 0 ? filterStats.totalNanoseconds / filterStats.checked : 0)
+            + " max_ns=" + std::to_string(filterStats.maxNanoseconds)
+            + " reloads=" + std::to_string(filterStats.reloads) + "\n";
+    }
+    else
+    {
+        report += "filter: off\n";
+    }
+    report += "transfers: active=" + std::to_string(transfers.size())
+        + " completed=" + std::to_string(transfersCompleted)
+        + " cancelled=" + std::to_string(transfersCancelled)
+        + " relayed_bytes=" + std::to_string(transferBytes) + "\n";
+    return report;
 }
 
 void Server::initialize() {
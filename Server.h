@@ -2,37 +2,189 @@
 
 #include <vector>
 #include <string>
+#include <string_view>
+#include <fstream>
+#include <chrono>
+#include <memory>
+#include <map>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 #include <winsock2.h>
 #include <ws2tcpip.h>
-#include "Client.h"
+#include "Session.h"
+#include "AdmissionControl.h"
+#include "MemoryBudget.h"
+#include "Roster.h"
+#include "FileTransfer.h"
+#include "RioEngine.h"
+#include "FrameArena.h"
+#include "Multicast.h"
+#include "ContentFilter.h"
+#include "Compression.h"
+#include "BusyPoll.h"
 //#include <sys/time.h>
 
 #pragma comment(lib, "Ws2_32.lib")
 
+enum IoEngineType {
+    IO_ENGINE_SELECT = 0,
+    IO_ENGINE_RIO = 1,
+};
+
 class Server {
 public:
     Server(int maxClients, const char* port);
     ~Server();
     void run();
     void acceptClient();
-    bool handleClientRequest(Client* client);
-    void sendToSpecificClient(std::string message, Client* client);
-    void sendToAllClients(std::string message, Client* sender);
-    void logMessage(std::string message);
+    bool handleClientRequest(Session* client);
+    void sendToSpecificClient(std::string_view message, Session* client, OutboundClass priority = OUTBOUND_CONTROL);
+    void sendToAllClients(std::string_view message, Session* sender);
+    void logMessage(std::string_view message);
     void sendUdpBroadcast();
+    void setAdmissionConfig(const AdmissionConfig& config);
+    void setSessionLimits(const SessionLimits& limits);
+    void setMemoryConfig(const MemoryConfig& config);
+    // Frames this big or bigger may be compressed for clients that ask, 0 turns it off
+    void setCompressionThreshold(size_t threshold);
+    void enableTls(const std::string& certificateSubject);
+    void setIoEngine(IoEngineType engine);
+    void setBusyPoll(const BusyPollConfig& config);
+    void setTakeOver(bool enabled);
+    void enableMulticast(const std::string& group, u_short port);
+    // Throws if the term file can't be read; changes to it are picked up while running
+    void enableContentFilter(const std::string& path);
+    std::string buildStatsReport() const;
 private:
     int maxClients;
-    std::vector<Client*> clients;
+    std::vector<Session*> clients;
     fd_set master;
     fd_set read_fds;
+    fd_set write_fds;
     SOCKET tcpServerSocket;
     SOCKET udpServerSocket;
     int fdmax;
     const char* port;
     std::string logFileName;
+    std::ofstream logStream;
     int logFile;
     void initialize();
+    void openListener();
+    void openLocalListener();
+    void acceptLocalClient();
+    void attachShared(Session* client);
+    bool receiveShared(Session* client);
+    bool addSession(Session* session);
+    void listenForUpgrades();
+    void handOff();
+    bool takeOverRunningServer(std::vector<Session*>& adopted);
+    void runSelect();
+    void runRio();
+    void finishIteration();
+    bool handleReceived(Session* client, const char* data, int nbytes);
+    bool writeSocket(Session* client, const char* data, size_t size, const char* more = NULL, size_t moreSize = 0);
+    bool writeFrame(Session* client, std::string_view frame, OutboundClass priority = OUTBOUND_CONTROL);
+    bool commitOrQueue(Session* client, std::string_view bytes, OutboundClass priority);
+    void sendCloseNotify(Session* client);
+    bool canCommit(Session* client, size_t size);
+    void flushOutbound(Session* client);
+    void sendLog(Session* client);
+    void broadcastFrame(std::string_view frame, Session* sender);
+    void broadcastChat(std::string_view frame, Session* sender);
+    void handleNack(Session* client, std::string_view message);
+    void disconnectClient(Session* client);
+    bool processInbound(Session* client);
+    bool processFrame(Session* client, std::string_view message);
+    void sendError(Session* client, const std::string& code, const std::string& detail);
+    void reply(Session* client, std::string_view message);
+    void broadcastPresence(const PresenceEvent& event, Session* leaving);
+    bool receiveTls(Session* client, const char* data, int nbytes);
+    bool transmit(Session* client, const char* data, int size);
+    void sendFrame(SOCKET socket, const std::string& message);
+    void handleFileCommand(Session* client, std::string_view message);
+    void relayFileChunk(Session* client, uint32_t ref, uint64_t offset, const char* data, size_t size);
+    void updateTransfer(uint32_t id);
+    void completeTransfer(std::map<uint32_t, FileTransfer>::iterator transfer);
+    void cancelTransfer(std::map<uint32_t, FileTransfer>::iterator transfer, const std::string& reason);
+    void expireFileOffers(std::chrono::steady_clock::time_point now);
+    void sweepMemory();
+    void watchContentFilter();
+    bool passesContentFilter(Session* client, std::string_view text);
+    void reclaimSession(Session* client);
+    void dropFileTransfers(Session* client);
+    std::map<uint32_t, FileTransfer>::iterator findTransfer(Session* sender, uint32_t ref);
+    static int CALLBACK admissionCondition(LPWSABUF callerId, LPWSABUF callerData, LPQOS sqos, LPQOS gqos,
+        LPWSABUF calleeId, LPWSABUF calleeData, GROUP* group, DWORD_PTR callbackData);
     timeval timeout;
+    //Admission control for the accept path
+    AdmissionControl admission;
+    std::chrono::steady_clock::time_point lastAdmissionPrune;
+    //Inbound framing and per-session rate limits
+    SessionLimits sessionLimits;
+    std::vector<char> recvBuffer;
+    //Outbound frames built during one loop iteration, reset at its end
+    FrameArena arena;
+    unsigned long long framesTooLarge;
+    unsigned long long framesRateLimited;
+    unsigned long long framesDropped;
+    //Outbound scheduling: frames per class, how many had to wait, sessions cut off for not reading
+    unsigned long long framesSent[3];
+    unsigned long long framesQueued;
+    unsigned long long outboundOverflows;
+    //Compression negotiated per session, with compressed log parts cached for every requester
+    FrameCompressor compression;
+    std::string compressScratch;
+    //Memory held by sessions, summed once a sweep, and the pool their inbound buffers come from
+    MemoryBudget memory;
+    std::chrono::steady_clock::time_point lastMemorySweep;
+    //Correlation tag ("@<id> ") of the request being processed, echoed on its replies
+    Session* requestClient;
+    std::string_view requestTag;
+    bool requestReplied;
+    unsigned long long taggedRequests;
+    //Registered users, versioned so clients can fetch deltas
+    Roster roster;
+    //Optional TLS, shared credentials for every session
+    std::shared_ptr<TlsCredentials> tlsCredentials;
+    std::string tlsScratch;
+    unsigned long long tlsHandshakes;
+    unsigned long long tlsResumed;
+    unsigned long long tlsFailures;
+    //File transfers relayed chunk by chunk, keyed by server-assigned id
+    std::map<uint32_t, FileTransfer> transfers;
+    uint32_t nextTransferId;
+    unsigned long long transfersCompleted;
+    unsigned long long transfersCancelled;
+    unsigned long long transferBytes;
+    //Socket I/O: select() readiness, or Registered I/O completions
+    IoEngineType ioEngine;
+    RioEngine rio;
+    //Optional spinning before the loop parks, and the cores it is pinned to
+    BusyPoll busyPoll;
+    //Same-host clients: a local socket, and shared memory negotiated over it
+    SOCKET localServerSocket;
+    std::string localPath;
+    unsigned long long sharedAttached;
+    //Optional multicast delivery of chat to the sessions that joined it
+    std::string multicastGroup;
+    u_short multicastPort;
+    MulticastPublisher multicast;
+    //Banned terms checked before chat is relayed or logged, recompiled off the loop when the file changes
+    std::string filterPath;
+    std::shared_ptr<ContentFilter> contentFilter;
+    std::mutex filterMutex;
+    std::shared_ptr<ContentFilter> reloadedFilter;
+    std::atomic<bool> filterReloaded;
+    FilterStats filterStats;
+    //Hot upgrade: handing sessions to, or taking them over from, another process
+    std::atomic<bool> running;
+    bool takeOver;
+    std::atomic<bool> upgradeRequested;
+    std::mutex upgradeMutex;
+    std::condition_variable upgradeSignal;
+    HANDLE upgradePipe;
+    ULONG upgradeProcessId;
     //Server information
     std::string serverIP;
 };
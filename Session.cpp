@@ -0,0 +1,372 @@
+#include "Session.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+
+namespace {
+size_t heapSize(const std::string& text)
+{
+    // Short strings live inside the object
+    return text.capacity() >= sizeof(std::string) ? text.capacity() + 1 : 0;
+}
+}
+
+Session::Session(SOCKET socket, u_long address, const SessionLimits& limits)
+    : socket(socket), address(address), chatPrefix("(): "), closing(false), local(false), compressing(false), limits(limits), inboundOffset(0),
+      discardRemaining(0), lastRejectedSize(0), limitNotified(false), transferThrottled(false), multicastId(0),
+      quietSweeps(0)
+{
+    messageBucket.configure(limits.messagesPerSecond, limits.messageBurst);
+    byteBucket.configure(limits.bytesPerSecond, limits.byteBurst);
+    transferBucket.configure(limits.transferBytesPerSecond, limits.transferBurst);
+    chunkBucket.configure(limits.transferChunksPerSecond, limits.transferChunkBurst);
+}
+
+SOCKET Session::getSocket() const
+{
+    return socket;
+}
+
+void Session::setSocket(SOCKET newSocket)
+{
+    socket = newSocket;
+}
+
+u_long Session::getAddress() const
+{
+    return address;
+}
+
+const std::string& Session::getUsername() const
+{
+    return username;
+}
+
+void Session::setUsername(const std::string& newUsername)
+{
+    username = newUsername;
+    chatPrefix = "(" + username + "): ";
+}
+
+const std::string& Session::getChatPrefix() const
+{
+    return chatPrefix;
+}
+
+uint32_t Session::getMulticastId() const
+{
+    return multicastId;
+}
+
+void Session::setMulticastId(uint32_t id)
+{
+    multicastId = id;
+}
+
+bool Session::isClosing() const
+{
+    return closing;
+}
+
+void Session::setClosing(bool newClosing)
+{
+    closing = newClosing;
+}
+
+TlsChannel* Session::getTls() const
+{
+    return tls.get();
+}
+
+void Session::setTls(TlsChannel* channel)
+{
+    tls.reset(channel);
+}
+
+bool Session::isLocal() const
+{
+    return local;
+}
+
+void Session::setLocal(bool newLocal)
+{
+    local = newLocal;
+}
+
+bool Session::isCompressing() const
+{
+    return compressing;
+}
+
+void Session::setCompressing(bool newCompressing)
+{
+    compressing = newCompressing;
+}
+
+SharedChannel* Session::getShared() const
+{
+    return shared.get();
+}
+
+void Session::setShared(SharedChannel* channel)
+{
+    shared.reset(channel);
+}
+
+OutboundQueue& Session::getOutbound()
+{
+    return outbound;
+}
+
+const OutboundQueue& Session::getOutbound() const
+{
+    return outbound;
+}
+
+void Session::appendInbound(const char* data, int size, BufferPool& pool)
+{
+    quietSweeps = 0;
+    if (inbound.capacity() == 0)
+    {
+        inbound = pool.acquire();
+    }
+    // Reclaim the consumed prefix before growing the buffer.
+    if (inboundOffset > 0 && inboundOffset == inbound.size())
+    {
+        inbound.clear();
+        inboundOffset = 0;
+    }
+    else if (inboundOffset > inbound.size() / 2 || (inboundOffset > 0 && inbound.size() + size > inbound.capacity()))
+    {
+        inbound.erase(inbound.begin(), inbound.begin() + inboundOffset);
+        inboundOffset = 0;
+    }
+    if (inbound.size() + size > inbound.capacity())
+    {
+        // At least doubled, so a steady flow of full reads behind partial frames settles after
+        // a growth or two instead of growing a little on every bigger read
+        inbound.reserve((std::max)(inbound.capacity() * 2, inbound.size() + size));
+    }
+    inbound.insert(inbound.end(), data, data + size);
+}
+
+bool Session::hasPendingInbound() const
+{
+    return pendingBytes() > 0;
+}
+
+std::string_view Session::getPendingInbound() const
+{
+    return std::string_view(inbound.data() + inboundOffset, pendingBytes());
+}
+
+void Session::getChatTokens(double& messages, double& bytes)
+{
+    messages = messageBucket.available();
+    bytes = byteBucket.available();
+}
+
+void Session::setChatTokens(double messages, double bytes)
+{
+    messageBucket.setAvailable(messages);
+    byteBucket.setAvailable(bytes);
+}
+
+uint64_t Session::getDiscardRemaining() const
+{
+    return discardRemaining;
+}
+
+void Session::setDiscardRemaining(uint64_t remaining)
+{
+    discardRemaining = remaining;
+}
+
+size_t Session::pendingBytes() const
+{
+    return inbound.size() - inboundOffset;
+}
+
+void Session::consume(size_t count)
+{
+    inboundOffset += count;
+}
+
+bool Session::isTransferChunk(uint32_t frameSize) const
+{
+    // Only a chunk of a transfer the server has started for this session; anything else
+    // that looks like one is an ordinary message
+    static const char prefix[] = "$file chunk ";
+    const size_t prefixSize = sizeof(prefix) - 1;
+    const char* payload = inbound.data() + inboundOffset + sizeof(frameSize);
+    if (frameSize < prefixSize || memcmp(payload, prefix, prefixSize) != 0)
+    {
+        return false;
+    }
+    uint32_t ref = 0;
+    auto parsed = std::from_chars(payload + prefixSize, payload + frameSize, ref);
+    return parsed.ec == std::errc() && std::find(transferRefs.begin(), transferRefs.end(), ref) != transferRefs.end();
+}
+
+void Session::addTransfer(uint32_t ref)
+{
+    transferRefs.push_back(ref);
+}
+
+void Session::removeTransfer(uint32_t ref)
+{
+    auto it = std::find(transferRefs.begin(), transferRefs.end(), ref);
+    if (it != transferRefs.end())
+    {
+        transferRefs.erase(it);
+    }
+}
+
+FrameStatus Session::nextFrame(std::string_view& frame)
+{
+    // Skip the payload of a frame that was rejected for its size.
+    if (discardRemaining > 0)
+    {
+        size_t skipped = static_cast<size_t>(std::min<uint64_t>(discardRemaining, pendingBytes()));
+        consume(skipped);
+        discardRemaining -= skipped;
+        byteBucket.forceConsume(static_cast<double>(skipped));
+        if (discardRemaining > 0)
+        {
+            return FRAME_INCOMPLETE;
+        }
+    }
+
+    if (pendingBytes() < sizeof(uint32_t))
+    {
+        return FRAME_INCOMPLETE;
+    }
+    uint32_t frameSize = 0;
+    memcpy(&frameSize, inbound.data() + inboundOffset, sizeof(frameSize));
+
+    // Enforce the size cap on the header alone, before a single payload byte is buffered.
+    if (frameSize > limits.maxFrameSize)
+    {
+        consume(sizeof(frameSize));
+        discardRemaining = frameSize;
+        lastRejectedSize = frameSize;
+        return FRAME_TOO_LARGE;
+    }
+    if (pendingBytes() < sizeof(frameSize) + frameSize)
+    {
+        return FRAME_INCOMPLETE;
+    }
+
+    if (isTransferChunk(frameSize))
+    {
+        // File chunks have their own byte and frame budgets so a transfer never eats the chat
+        // allowance, and tiny chunks can't get round it either. They are always delayed, never
+        // dropped: a hole would break the stream.
+        if (transferBucket.available() <= 0.0 || chunkBucket.available() < 1.0)
+        {
+            auto wait = std::max(transferBucket.timeUntilAvailable(1.0), chunkBucket.timeUntilAvailable(1.0));
+            throttledUntil = std::chrono::steady_clock::now() + wait;
+            transferThrottled = true;
+            return FRAME_RATE_LIMITED;
+        }
+        transferBucket.forceConsume(static_cast<double>(frameSize));
+        chunkBucket.tryConsume(1.0);
+    }
+    else if (messageBucket.available() < 1.0 || byteBucket.available() <= 0.0)
+    {
+        if (limits.rejectWhenLimited)
+        {
+            consume(sizeof(frameSize) + frameSize);
+            lastRejectedSize = frameSize;
+            return FRAME_DROPPED;
+        }
+        // Leave the frame buffered and stop reading until the buckets have refilled.
+        auto wait = std::max(messageBucket.timeUntilAvailable(1.0), byteBucket.timeUntilAvailable(1.0));
+        throttledUntil = std::chrono::steady_clock::now() + wait;
+        transferThrottled = false;
+        return FRAME_RATE_LIMITED;
+    }
+    else
+    {
+        messageBucket.tryConsume(1.0);
+        byteBucket.forceConsume(static_cast<double>(frameSize));
+    }
+
+    // A view into the inbound buffer, valid until the next appendInbound()
+    frame = std::string_view(inbound.data() + inboundOffset + sizeof(frameSize), frameSize);
+    consume(sizeof(frameSize) + frameSize);
+    if (pendingBytes() == 0)
+    {
+        // Backlog drained, the next time the client is limited it hears about it again.
+        limitNotified = false;
+    }
+    return FRAME_READY;
+}
+
+bool Session::isThrottled(std::chrono::steady_clock::time_point now) const
+{
+    return now < throttledUntil;
+}
+
+std::chrono::steady_clock::time_point Session::getThrottledUntil() const
+{
+    return throttledUntil;
+}
+
+bool Session::takeLimitNotice()
+{
+    // Only the first limited frame of a backlog gets an error frame back. Paced file
+    // chunks get none, flow control already keeps the sender in step.
+    if (limitNotified || transferThrottled)
+    {
+        return false;
+    }
+    limitNotified = true;
+    return true;
+}
+
+uint32_t Session::getLastRejectedSize() const
+{
+    return lastRejectedSize;
+}
+
+uint32_t Session::countQuietSweep()
+{
+    return ++quietSweeps;
+}
+
+size_t Session::getMemoryUsage() const
+{
+    size_t usage = sizeof(Session) + inbound.capacity() + heapSize(username) + heapSize(chatPrefix) + outbound.getMemoryUsage()
+        + transferRefs.capacity() * sizeof(uint32_t);
+    if (tls)
+    {
+        usage += tls->getMemoryUsage();
+    }
+    if (shared)
+    {
+        usage += shared->getMappedSize();
+    }
+    return usage;
+}
+
+size_t Session::reclaimBuffers(BufferPool& pool)
+{
+    if (pendingBytes() > 0 || discardRemaining > 0 || !outbound.isEmpty())
+    {
+        return 0;
+    }
+    size_t before = getMemoryUsage();
+    if (inbound.capacity() > 0)
+    {
+        pool.release(inbound);
+        inboundOffset = 0;
+    }
+    outbound.shrink();
+    if (tls)
+    {
+        tls->trim();
+    }
+    return before - getMemoryUsage();
+}
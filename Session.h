@@ -0,0 +1,115 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <winsock2.h>
+#include "TokenBucket.h"
+#include "TlsChannel.h"
+#include "SharedChannel.h"
+#include "OutboundQueue.h"
+#include "MemoryBudget.h"
+
+// Inbound limits applied to every session. A rate of zero disables that limit.
+struct SessionLimits {
+    uint32_t maxFrameSize = 64 * 1024;      // largest payload a client may announce
+    double messagesPerSecond = 20.0;
+    double messageBurst = 40.0;
+    double bytesPerSecond = 64.0 * 1024;
+    double byteBurst = 256.0 * 1024;
+    bool rejectWhenLimited = false;         // drop over-limit frames instead of delaying them
+    double transferBytesPerSecond = 8.0 * 1024 * 1024;  // file chunks, paced separately from chat
+    double transferBurst = 1024.0 * 1024;
+    double transferChunksPerSecond = 1024.0;            // twice what full chunks need at the byte rate
+    double transferChunkBurst = 128.0;
+};
+
+enum FrameStatus {
+    FRAME_READY = 0,
+    FRAME_INCOMPLETE = 1,
+    FRAME_TOO_LARGE = 2,
+    FRAME_RATE_LIMITED = 3,
+    FRAME_DROPPED = 4,
+};
+
+// Server-side state of one connected client: socket, identity, the inbound frame buffer and the outbound queue.
+class Session {
+public:
+    Session(SOCKET socket, u_long address, const SessionLimits& limits);
+    SOCKET getSocket() const;
+    void setSocket(SOCKET newSocket);
+    u_long getAddress() const;
+    const std::string& getUsername() const;
+    void setUsername(const std::string& newUsername);
+    const std::string& getChatPrefix() const;
+    uint32_t getMulticastId() const;
+    void setMulticastId(uint32_t id);
+    bool isClosing() const;
+    void setClosing(bool closing);
+    TlsChannel* getTls() const;
+    void setTls(TlsChannel* channel);
+    bool isLocal() const;
+    void setLocal(bool local);
+    bool isCompressing() const;
+    void setCompressing(bool compressing);
+    SharedChannel* getShared() const;
+    void setShared(SharedChannel* channel);
+    OutboundQueue& getOutbound();
+    const OutboundQueue& getOutbound() const;
+
+    void appendInbound(const char* data, int size, BufferPool& pool);
+    bool hasPendingInbound() const;
+    std::string_view getPendingInbound() const;
+    uint64_t getDiscardRemaining() const;
+    void setDiscardRemaining(uint64_t remaining);
+    FrameStatus nextFrame(std::string_view& frame);
+    // Chat limit levels, so a hot upgrade doesn't hand a flooding client full buckets
+    void getChatTokens(double& messages, double& bytes);
+    void setChatTokens(double messages, double bytes);
+    bool isThrottled(std::chrono::steady_clock::time_point now) const;
+    std::chrono::steady_clock::time_point getThrottledUntil() const;
+    bool takeLimitNotice();
+    uint32_t getLastRejectedSize() const;
+    // Transfers this session is streaming, by its own ref; only their chunks skip the chat limits
+    void addTransfer(uint32_t ref);
+    void removeTransfer(uint32_t ref);
+    // Memory sweeps since the session last received anything
+    uint32_t countQuietSweep();
+    // Everything the session holds, itself included
+    size_t getMemoryUsage() const;
+    // Gives the buffers back once nothing is pending either way; bytes released
+    size_t reclaimBuffers(BufferPool& pool);
+private:
+    size_t pendingBytes() const;
+    bool isTransferChunk(uint32_t frameSize) const;
+    void consume(size_t count);
+    SOCKET socket;
+    u_long address;
+    std::string username;
+    std::string chatPrefix;     // "(username): ", built once at $register
+    bool closing;
+    std::unique_ptr<TlsChannel> tls;
+    bool local;                 // connected over the local socket
+    bool compressing;           // negotiated $compress, big frames may go out as ZIP
+    std::unique_ptr<SharedChannel> shared;  // once attached, all frames go through it
+    OutboundQueue outbound;
+
+    SessionLimits limits;
+    std::vector<char> inbound;
+    size_t inboundOffset;
+    uint64_t discardRemaining;
+    uint32_t lastRejectedSize;
+    TokenBucket messageBucket;
+    TokenBucket byteBucket;
+    TokenBucket transferBucket;
+    TokenBucket chunkBucket;
+    std::vector<uint32_t> transferRefs;
+    std::chrono::steady_clock::time_point throttledUntil;
+    bool limitNotified;
+    bool transferThrottled;
+    uint32_t multicastId;       // 0 unless chat comes to this session over multicast
+    uint32_t quietSweeps;
+};
@@ -0,0 +1,347 @@
+#include "SharedChannel.h"
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+#include <thread>
+
+namespace {
+const uint32_t SHARED_MAGIC = 0x52485343;   // "CSHR"
+
+std::string objectName(const std::string& name, const char* suffix)
+{
+    // Session-local namespace: only processes in the same logon session can find it
+    return "Local\\" + name + suffix;
+}
+}
+
+std::string localSocketPath(const std::string& port)
+{
+    char directory[MAX_PATH + 1];
+    DWORD length = GetTempPathA(sizeof(directory), directory);
+    return std::string(directory, length > 0 && length < sizeof(directory) ? length : 0) + "cppchat-" + port + ".sock";
+}
+
+SharedChannel::SharedChannel() : mapping(NULL), view(nullptr), ringSize(0), doorbell(INVALID_SOCKET), failed(false)
+{
+}
+
+SharedChannel::~SharedChannel()
+{
+    close();
+}
+
+bool SharedChannel::create(const std::string& channelName, uint32_t size)
+{
+    return map(channelName, true, size);
+}
+
+bool SharedChannel::open(const std::string& channelName)
+{
+    return map(channelName, false, 0);
+}
+
+bool SharedChannel::map(const std::string& channelName, bool create, uint32_t size)
+{
+    // [client-to-server header][data][server-to-client header][data]
+    close();
+    name = channelName;
+    if (create)
+    {
+        uint64_t total = 2 * (sizeof(RingHeader) + static_cast<uint64_t>(size));
+        mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+            static_cast<DWORD>(total >> 32), static_cast<DWORD>(total), objectName(name, "").c_str());
+        if (mapping != NULL && GetLastError() == ERROR_ALREADY_EXISTS)
+        {
+            // Somebody else's, never share it
+            CloseHandle(mapping);
+            mapping = NULL;
+        }
+    }
+    else
+    {
+        mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, objectName(name, "").c_str());
+    }
+    if (mapping == NULL)
+    {
+        return false;
+    }
+    view = static_cast<char*>(MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0));
+    if (view == nullptr)
+    {
+        close();
+        return false;
+    }
+
+    // The server's own size is what it uses; the client takes the server's word once
+    RingHeader* toServer = reinterpret_cast<RingHeader*>(view);
+    if (create)
+    {
+        new (toServer) RingHeader{ SHARED_MAGIC, size, {0}, {0}, {0}, {0} };
+    }
+    else if (toServer->magic != SHARED_MAGIC || toServer->size == 0)
+    {
+        close();
+        return false;
+    }
+    ringSize = create ? size : toServer->size;
+    RingHeader* toClient = reinterpret_cast<RingHeader*>(view + sizeof(RingHeader) + ringSize);
+    if (create)
+    {
+        new (toClient) RingHeader{ SHARED_MAGIC, ringSize, {0}, {0}, {0}, {0} };
+    }
+
+    Ring& serverRing = create ? inbound : outbound;
+    Ring& clientRing = create ? outbound : inbound;
+    serverRing.header = toServer;
+    serverRing.data = view + sizeof(RingHeader);
+    clientRing.header = toClient;
+    clientRing.data = view + 2 * sizeof(RingHeader) + ringSize;
+    // The server may have written before we got here
+    inbound.position = inbound.header->head.load();
+    outbound.position = outbound.header->tail.load();
+    const char* suffixes[4] = { "-to-server-data", "-to-server-space", "-to-client-data", "-to-client-space" };
+    HANDLE* events[4] = { &serverRing.dataEvent, &serverRing.spaceEvent, &clientRing.dataEvent, &clientRing.spaceEvent };
+    for (int i = 0; i < 4; i++)
+    {
+        std::string eventName = objectName(name, suffixes[i]);
+        *events[i] = create ? CreateEventA(NULL, FALSE, FALSE, eventName.c_str())
+            : OpenEventA(EVENT_MODIFY_STATE | SYNCHRONIZE, FALSE, eventName.c_str());
+        if (*events[i] == NULL)
+        {
+            close();
+            return false;
+        }
+    }
+    return true;
+}
+
+void SharedChannel::close()
+{
+    for (Ring* ring : { &inbound, &outbound })
+    {
+        if (ring->dataEvent != NULL)
+        {
+            CloseHandle(ring->dataEvent);
+        }
+        if (ring->spaceEvent != NULL)
+        {
+            CloseHandle(ring->spaceEvent);
+        }
+        *ring = Ring();
+    }
+    ringSize = 0;
+    if (view != nullptr)
+    {
+        UnmapViewOfFile(view);
+        view = nullptr;
+    }
+    if (mapping != NULL)
+    {
+        CloseHandle(mapping);
+        mapping = NULL;
+    }
+}
+
+const std::string& SharedChannel::getName() const
+{
+    return name;
+}
+
+void SharedChannel::setDoorbell(SOCKET socket)
+{
+    doorbell = socket;
+}
+
+bool SharedChannel::send(const char* data, size_t size, const char* more, size_t moreSize)
+{
+    // After one timeout the stream may hold half a frame, nothing more goes in
+    if (failed)
+    {
+        return false;
+    }
+    DWORD deadline = GetTickCount() + SHARED_SEND_TIMEOUT_MS;
+    failed = !write(data, size, deadline) || !write(more, moreSize, deadline);
+    if (outbound.header->readerWaiting.exchange(0) != 0)
+    {
+        wakePeer();
+    }
+    return !failed;
+}
+
+size_t SharedChannel::writable()
+{
+    uint64_t head = outbound.header->head.load();
+    return failed || !isInRing(head, outbound.position) ? 0 : static_cast<size_t>(ringSize - (outbound.position - head));
+}
+
+bool SharedChannel::hasFailed() const
+{
+    return failed;
+}
+
+bool SharedChannel::isInRing(uint64_t head, uint64_t tail)
+{
+    if (tail - head > ringSize)
+    {
+        failed = true;
+    }
+    return !failed;
+}
+
+bool SharedChannel::write(const char* data, size_t size, DWORD deadline)
+{
+    RingHeader* header = outbound.header;
+    uint64_t tail = outbound.position;
+    while (size > 0)
+    {
+        uint64_t head = header->head.load(std::memory_order_acquire);
+        if (!isInRing(head, tail))
+        {
+            return false;
+        }
+        uint64_t space = ringSize - (tail - head);
+        if (space == 0)
+        {
+            // What is already in the ring must reach the reader, or neither of us moves
+            stats.fullWaits++;
+            if (header->readerWaiting.exchange(0) != 0)
+            {
+                wakePeer();
+            }
+            header->writerWaiting.store(1);
+            if (header->head.load() == head)
+            {
+                DWORD remaining = deadline - GetTickCount();
+                if (static_cast<int32_t>(remaining) <= 0 || WaitForSingleObject(outbound.spaceEvent, remaining) != WAIT_OBJECT_0)
+                {
+                    header->writerWaiting.store(0);
+                    return false;
+                }
+            }
+            header->writerWaiting.store(0);
+            continue;
+        }
+        size_t count = static_cast<size_t>((std::min)(space, static_cast<uint64_t>(size)));
+        size_t offset = static_cast<size_t>(tail % ringSize);
+        size_t first = (std::min)(count, ringSize - offset);
+        memcpy(outbound.data + offset, data, first);
+        memcpy(outbound.data, data + first, count - first);
+        tail += count;
+        outbound.position = tail;
+        header->tail.store(tail);
+        data += count;
+        size -= count;
+        stats.bytesSent += count;
+    }
+    return true;
+}
+
+void SharedChannel::wakePeer()
+{
+    stats.wakeUps++;
+    if (doorbell != INVALID_SOCKET)
+    {
+        char ring = 0;
+        ::send(doorbell, &ring, 1, 0);
+    }
+    else
+    {
+        SetEvent(outbound.dataEvent);
+    }
+}
+
+size_t SharedChannel::receive(char* buffer, size_t size)
+{
+    RingHeader* header = inbound.header;
+    uint64_t head = inbound.position;
+    uint64_t tail = header->tail.load(std::memory_order_acquire);
+    if (failed || !isInRing(head, tail))
+    {
+        return 0;
+    }
+    uint64_t available = tail - head;
+    size_t count = static_cast<size_t>((std::min)(available, static_cast<uint64_t>(size)));
+    if (count == 0)
+    {
+        return 0;
+    }
+    size_t offset = static_cast<size_t>(head % ringSize);
+    size_t first = (std::min)(count, ringSize - offset);
+    memcpy(buffer, inbound.data + offset, first);
+    memcpy(buffer + first, inbound.data, count - first);
+    inbound.position = head + count;
+    header->head.store(inbound.position);
+    stats.bytesReceived += count;
+    if (header->writerWaiting.exchange(0) != 0)
+    {
+        SetEvent(inbound.spaceEvent);
+    }
+    return count;
+}
+
+bool SharedChannel::hasData() const
+{
+    return inbound.header->tail.load() != inbound.position;
+}
+
+bool SharedChannel::armWakeUp()
+{
+    inbound.header->readerWaiting.store(1);
+    if (hasData())
+    {
+        inbound.header->readerWaiting.store(0);
+        return false;
+    }
+    return true;
+}
+
+void SharedChannel::disarmWakeUp()
+{
+    inbound.header->readerWaiting.store(0);
+}
+
+bool SharedChannel::waitForData(HANDLE other, DWORD timeoutMs)
+{
+    // A writer that is in the middle of a burst usually comes back within microseconds,
+    // and catching that by spinning saves both sides the kernel round trip of a wake-up.
+    // With a single processor the writer can't run while we spin.
+    static const int spinCount = std::thread::hardware_concurrency() > 1 ? SHARED_SPIN_COUNT : 0;
+    for (int spin = 0; spin < spinCount; spin++)
+    {
+        if (hasData())
+        {
+            return true;
+        }
+        YieldProcessor();
+    }
+    // The event can be left over from a wake-up that turned out not to be needed
+    DWORD deadline = GetTickCount() + timeoutMs;
+    while (armWakeUp())
+    {
+        DWORD remaining = timeoutMs == INFINITE ? INFINITE : deadline - GetTickCount();
+        if (timeoutMs != INFINITE && static_cast<int32_t>(remaining) <= 0)
+        {
+            disarmWakeUp();
+            break;
+        }
+        HANDLE handles[2] = { inbound.dataEvent, other };
+        DWORD woken = WaitForMultipleObjects(other != NULL ? 2 : 1, handles, FALSE, remaining);
+        disarmWakeUp();
+        if (woken != WAIT_OBJECT_0)
+        {
+            break;
+        }
+    }
+    return hasData();
+}
+
+const SharedChannelStats& SharedChannel::getStats() const
+{
+    return stats;
+}
+
+size_t SharedChannel::getMappedSize() const
+{
+    return inbound.header == nullptr ? 0 : 2 * (sizeof(RingHeader) + static_cast<size_t>(ringSize));
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <winsock2.h>
+#include <windows.h>
+
+#pragma comment(lib, "Ws2_32.lib")
+
+// Path of the server's local (AF_UNIX) socket, in the temp directory
+std::string localSocketPath(const std::string& port);
+
+const uint32_t SHARED_RING_SIZE = 1024 * 1024;     // per direction
+const DWORD SHARED_SEND_TIMEOUT_MS = 5000;          // a full ring is waited on this long, like a blocked send
+const int SHARED_SPIN_COUNT = 4000;                 // polls of an empty ring before sleeping, a few microseconds
+
+struct SharedChannelStats {
+    unsigned long long bytesSent = 0;
+    unsigned long long bytesReceived = 0;
+    unsigned long long wakeUps = 0;         // times the peer was asleep and had to be woken
+    unsigned long long fullWaits = 0;       // times a send found the ring full
+};
+
+// Shared-memory transport between the server and a client on the same machine, set up over
+// the local socket ("$shm attach" -> "SHM <name>"). One mapping holds a single-producer,
+// single-consumer byte ring per direction, carrying exactly the bytes the socket would:
+// the same 4-byte size and payload frames.
+//
+// Nobody is woken while the reader is busy. A reader about to sleep says so in its ring
+// header and checks once more; the first writer to take the flag after publishing wakes it,
+// with the ring's event or, for a reader that sleeps in select(), one byte on the local socket.
+//
+// The peer can write anything into the mapping. The ring size and each side's own index are
+// kept in the object, and the peer's index is checked against them on every load: a ring
+// that claims more than its size is in use fails the channel, like a broken connection.
+class SharedChannel {
+public:
+    SharedChannel();
+    ~SharedChannel();
+    bool create(const std::string& name, uint32_t size = SHARED_RING_SIZE);      // server side
+    bool open(const std::string& name);                                          // client side
+    const std::string& getName() const;
+    // Wake the server with a byte on this socket instead of the ring's event
+    void setDoorbell(SOCKET socket);
+    bool send(const char* data, size_t size, const char* more = NULL, size_t moreSize = 0);
+    // Bytes send() can take right now without waiting for the reader
+    size_t writable();
+    // 0 when there is nothing to read, or when the channel failed
+    size_t receive(char* buffer, size_t size);
+    // A send timed out or the peer broke a ring, nothing more goes either way
+    bool hasFailed() const;
+    bool hasData() const;
+    // Reader about to sleep: false if there is data after all, and it must not
+    bool armWakeUp();
+    void disarmWakeUp();
+    // Client side: until there is data, or other is signalled
+    bool waitForData(HANDLE other, DWORD timeoutMs);
+    const SharedChannelStats& getStats() const;
+    // Both rings with their headers
+    size_t getMappedSize() const;
+private:
+    struct alignas(64) RingHeader {
+        uint32_t magic;
+        uint32_t size;                                      // read once by the client, never by the server
+        alignas(64) std::atomic<uint64_t> head;             // advanced by the reader
+        std::atomic<uint32_t> readerWaiting;
+        alignas(64) std::atomic<uint64_t> tail;             // advanced by the writer
+        std::atomic<uint32_t> writerWaiting;
+    };
+    struct Ring {
+        RingHeader* header = nullptr;
+        char* data = nullptr;
+        HANDLE dataEvent = NULL;        // set by the writer for a sleeping reader
+        HANDLE spaceEvent = NULL;       // set by the reader for a writer waiting on a full ring
+        uint64_t position = 0;          // our own index, head when reading and tail when writing
+    };
+    bool map(const std::string& name, bool create, uint32_t size);
+    bool write(const char* data, size_t size, DWORD deadline);
+    // Of the peer's index against ours, false if it claims more than the ring holds
+    bool isInRing(uint64_t head, uint64_t tail);
+    void wakePeer();
+    void close();
+
+    std::string name;
+    HANDLE mapping;
+    char* view;
+    uint32_t ringSize;
+    Ring inbound;
+    Ring outbound;
+    SOCKET doorbell;
+    bool failed;
+    SharedChannelStats stats;
+};
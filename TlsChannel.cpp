@@ -0,0 +1,415 @@
+#include "TlsChannel.h"
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+
+#ifndef ASC_REQ_SESSION_TICKET
+#define ASC_REQ_SESSION_TICKET 0x40000000
+#endif
+
+static const unsigned long SERVER_CONTEXT_FLAGS = ASC_REQ_SEQUENCE_DETECT | ASC_REQ_REPLAY_DETECT | ASC_REQ_CONFIDENTIALITY
+    | ASC_REQ_EXTENDED_ERROR | ASC_REQ_ALLOCATE_MEMORY | ASC_REQ_STREAM | ASC_REQ_SESSION_TICKET;
+static const unsigned long CLIENT_CONTEXT_FLAGS = ISC_REQ_SEQUENCE_DETECT | ISC_REQ_REPLAY_DETECT | ISC_REQ_CONFIDENTIALITY
+    | ISC_REQ_EXTENDED_ERROR | ISC_REQ_ALLOCATE_MEMORY | ISC_REQ_STREAM;
+
+TlsCredentials::TlsCredentials(bool server, bool verifyServer) : certificate(NULL), server(server), verifyServer(verifyServer)
+{
+    SecInvalidateHandle(&handle);
+}
+
+TlsCredentials::~TlsCredentials()
+{
+    if (SecIsValidHandle(&handle))
+    {
+        FreeCredentialsHandle(&handle);
+    }
+    if (certificate != NULL)
+    {
+        CertFreeCertificateContext(certificate);
+    }
+}
+
+std::shared_ptr<TlsCredentials> TlsCredentials::forServer(const std::string& certificateSubject)
+{
+    std::shared_ptr<TlsCredentials> credentials(new TlsCredentials(true, false));
+
+    // Look the certificate up by subject in the current user's personal store.
+    HCERTSTORE store = CertOpenSystemStoreA(0, "MY");
+    if (store == NULL)
+    {
+        throw std::runtime_error("Failed to open certificate store: " + std::to_string(GetLastError()));
+    }
+    credentials->certificate = CertFindCertificateInStore(store, X509_ASN_ENCODING | PKCS_7_ASN_ENCODING, 0,
+        CERT_FIND_SUBJECT_STR_A, certificateSubject.c_str(), NULL);
+    CertCloseStore(store, 0);
+    if (credentials->certificate == NULL)
+    {
+        throw std::runtime_error("No certificate matching \"" + certificateSubject + "\" in the personal store");
+    }
+
+    SCHANNEL_CRED schannelCred{};
+    schannelCred.dwVersion = SCHANNEL_CRED_VERSION;
+    schannelCred.cCreds = 1;
+    schannelCred.paCred = &credentials->certificate;
+    schannelCred.dwFlags = SCH_USE_STRONG_CRYPTO;
+    SECURITY_STATUS status = AcquireCredentialsHandleA(NULL, (LPSTR)UNISP_NAME_A, SECPKG_CRED_INBOUND, NULL,
+        &schannelCred, NULL, NULL, &credentials->handle, NULL);
+    if (status != SEC_E_OK)
+    {
+        throw std::runtime_error("Failed to acquire server TLS credentials: " + std::to_string(status));
+    }
+    return credentials;
+}
+
+std::shared_ptr<TlsCredentials> TlsCredentials::forClient(bool verifyServer)
+{
+    // Reusing the handle across connections is what lets Schannel resume sessions on reconnect.
+    static std::mutex cacheMutex;
+    static std::map<bool, std::shared_ptr<TlsCredentials>> cache;
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    auto it = cache.find(verifyServer);
+    if (it != cache.end())
+    {
+        return it->second;
+    }
+
+    std::shared_ptr<TlsCredentials> credentials(new TlsCredentials(false, verifyServer));
+    SCHANNEL_CRED schannelCred{};
+    schannelCred.dwVersion = SCHANNEL_CRED_VERSION;
+    schannelCred.dwFlags = SCH_USE_STRONG_CRYPTO | SCH_CRED_NO_DEFAULT_CREDS
+        | (verifyServer ? SCH_CRED_AUTO_CRED_VALIDATION : SCH_CRED_MANUAL_CRED_VALIDATION);
+    SECURITY_STATUS status = AcquireCredentialsHandleA(NULL, (LPSTR)UNISP_NAME_A, SECPKG_CRED_OUTBOUND, NULL,
+        &schannelCred, NULL, NULL, &credentials->handle, NULL);
+    if (status != SEC_E_OK)
+    {
+        throw std::runtime_error("Failed to acquire client TLS credentials: " + std::to_string(status));
+    }
+    cache[verifyServer] = credentials;
+    return credentials;
+}
+
+CredHandle* TlsCredentials::getHandle()
+{
+    return &handle;
+}
+
+bool TlsCredentials::isServer() const
+{
+    return server;
+}
+
+bool TlsCredentials::verifiesServer() const
+{
+    return verifyServer;
+}
+
+TlsChannel::TlsChannel(std::shared_ptr<TlsCredentials> credentials, const std::string& serverName)
+    : credentials(credentials), serverName(serverName), hasContext(false), established(false), resumed(false),
+    withoutCertificate(false)
+{
+    SecInvalidateHandle(&context);
+    ZeroMemory(&sizes, sizeof(sizes));
+}
+
+TlsChannel::~TlsChannel()
+{
+    if (hasContext)
+    {
+        DeleteSecurityContext(&context);
+    }
+}
+
+TlsResult TlsChannel::startHandshake(std::string& toSend)
+{
+    // Only the client speaks first; the server waits for its hello.
+    if (credentials->isServer())
+    {
+        return TLS_OK;
+    }
+    return handshake(toSend);
+}
+
+TlsResult TlsChannel::handshake(std::string& toSend)
+{
+    while (true)
+    {
+        SecBuffer inBuffers[2];
+        inBuffers[0].BufferType = SECBUFFER_TOKEN;
+        inBuffers[0].pvBuffer = incoming.data();
+        inBuffers[0].cbBuffer = static_cast<unsigned long>(incoming.size());
+        inBuffers[1].BufferType = SECBUFFER_EMPTY;
+        inBuffers[1].pvBuffer = NULL;
+        inBuffers[1].cbBuffer = 0;
+        SecBufferDesc inDesc = { SECBUFFER_VERSION, 2, inBuffers };
+
+        SecBuffer outBuffers[1];
+        outBuffers[0].BufferType = SECBUFFER_TOKEN;
+        outBuffers[0].pvBuffer = NULL;
+        outBuffers[0].cbBuffer = 0;
+        SecBufferDesc outDesc = { SECBUFFER_VERSION, 1, outBuffers };
+
+        unsigned long attributes = 0;
+        SECURITY_STATUS status;
+        if (credentials->isServer())
+        {
+            status = AcceptSecurityContext(credentials->getHandle(), hasContext ? &context : NULL, &inDesc,
+                SERVER_CONTEXT_FLAGS, 0, &context, &outDesc, &attributes, NULL);
+        }
+        else
+        {
+            unsigned long flags = CLIENT_CONTEXT_FLAGS | (credentials->verifiesServer() ? 0 : ISC_REQ_MANUAL_CRED_VALIDATION)
+                | (withoutCertificate ? ISC_REQ_USE_SUPPLIED_CREDS : 0);
+            status = InitializeSecurityContextA(credentials->getHandle(), hasContext ? &context : NULL,
+                (SEC_CHAR*)serverName.c_str(), flags, 0, 0, hasContext ? &inDesc : NULL, 0,
+                &context, &outDesc, &attributes, NULL);
+        }
+
+        // Whatever Schannel wants on the wire (handshake flight or alert) goes out even on failure.
+        if (outBuffers[0].pvBuffer != NULL)
+        {
+            toSend.append(static_cast<const char*>(outBuffers[0].pvBuffer), outBuffers[0].cbBuffer);
+            FreeContextBuffer(outBuffers[0].pvBuffer);
+        }
+
+        if (status == SEC_E_INCOMPLETE_MESSAGE)
+        {
+            return TLS_OK;
+        }
+        if (status != SEC_E_OK && status != SEC_I_CONTINUE_NEEDED && status != SEC_I_INCOMPLETE_CREDENTIALS)
+        {
+            return TLS_FAILED;
+        }
+        hasContext = true;
+
+        // The server asked for a client certificate. We have none, so the same input goes in
+        // once more with the supplied (empty) credentials; asked again, the handshake fails
+        // rather than going round on it forever.
+        if (status == SEC_I_INCOMPLETE_CREDENTIALS)
+        {
+            if (withoutCertificate)
+            {
+                return TLS_FAILED;
+            }
+            withoutCertificate = true;
+            continue;
+        }
+
+        // Keep only the bytes Schannel did not consume.
+        size_t extra = inBuffers[1].BufferType == SECBUFFER_EXTRA ? inBuffers[1].cbBuffer : 0;
+        incoming.erase(incoming.begin(), incoming.end() - extra);
+
+        if (status == SEC_E_OK)
+        {
+            established = true;
+            if (QueryContextAttributesA(&context, SECPKG_ATTR_STREAM_SIZES, &sizes) != SEC_E_OK)
+            {
+                return TLS_FAILED;
+            }
+            SecPkgContext_SessionInfo sessionInfo{};
+            if (QueryContextAttributesA(&context, SECPKG_ATTR_SESSION_INFO, &sessionInfo) == SEC_E_OK)
+            {
+                resumed = (sessionInfo.dwFlags & SSL_SESSION_RECONNECT) != 0;
+            }
+            return TLS_OK;
+        }
+        // SEC_I_CONTINUE_NEEDED: loop only if the peer already sent the next flight.
+        if (status == SEC_I_CONTINUE_NEEDED && incoming.empty())
+        {
+            return TLS_OK;
+        }
+    }
+}
+
+TlsResult TlsChannel::receive(const char* data, size_t size, std::string& toSend, std::string& plaintext)
+{
+    incoming.insert(incoming.end(), data, data + size);
+    if (!established)
+    {
+        TlsResult result = handshake(toSend);
+        if (result != TLS_OK || !established)
+        {
+            return result;
+        }
+    }
+    return decryptIncoming(toSend, plaintext);
+}
+
+TlsResult TlsChannel::decryptIncoming(std::string& toSend, std::string& plaintext)
+{
+    while (!incoming.empty())
+    {
+        SecBuffer buffers[4];
+        buffers[0].BufferType = SECBUFFER_DATA;
+        buffers[0].pvBuffer = incoming.data();
+        buffers[0].cbBuffer = static_cast<unsigned long>(incoming.size());
+        for (int i = 1; i < 4; i++)
+        {
+            buffers[i].BufferType = SECBUFFER_EMPTY;
+            buffers[i].pvBuffer = NULL;
+            buffers[i].cbBuffer = 0;
+        }
+        SecBufferDesc desc = { SECBUFFER_VERSION, 4, buffers };
+
+        SECURITY_STATUS status = DecryptMessage(&context, &desc, 0, NULL);
+        if (status == SEC_E_INCOMPLETE_MESSAGE)
+        {
+            return TLS_OK;
+        }
+        if (status == SEC_I_CONTEXT_EXPIRED)
+        {
+            return TLS_CLOSED;
+        }
+        if (status != SEC_E_OK && status != SEC_I_RENEGOTIATE)
+        {
+            return TLS_FAILED;
+        }
+
+        // Records are decrypted in place, so copy the plaintext out before trimming the buffer.
+        size_t extra = 0;
+        for (int i = 1; i < 4; i++)
+        {
+            if (buffers[i].BufferType == SECBUFFER_DATA)
+            {
+                plaintext.append(static_cast<const char*>(buffers[i].pvBuffer), buffers[i].cbBuffer);
+            }
+            else if (buffers[i].BufferType == SECBUFFER_EXTRA)
+            {
+                extra = buffers[i].cbBuffer;
+            }
+        }
+        incoming.erase(incoming.begin(), incoming.end() - extra);
+
+        if (status == SEC_I_RENEGOTIATE)
+        {
+            // Post-handshake messages (new session tickets, key updates) go back through the handshake call.
+            established = false;
+            TlsResult result = handshake(toSend);
+            if (result != TLS_OK || !established)
+            {
+                return result;
+            }
+        }
+    }
+    return TLS_OK;
+}
+
+bool TlsChannel::encrypt(const char* data, size_t size, std::string& out)
+{
+    if (!established)
+    {
+        return false;
+    }
+    // Records are built back to back in `out`, so a bulk payload still leaves in a single send.
+    size_t offset = 0;
+    do
+    {
+        size_t chunk = (std::min)(size - offset, static_cast<size_t>(sizes.cbMaximumMessage));
+        size_t start = out.size();
+        out.resize(start + sizes.cbHeader + chunk + sizes.cbTrailer);
+        char* record = &out[start];
+        memcpy(record + sizes.cbHeader, data + offset, chunk);
+
+        SecBuffer buffers[4];
+        buffers[0].BufferType = SECBUFFER_STREAM_HEADER;
+        buffers[0].pvBuffer = record;
+        buffers[0].cbBuffer = sizes.cbHeader;
+        buffers[1].BufferType = SECBUFFER_DATA;
+        buffers[1].pvBuffer = record + sizes.cbHeader;
+        buffers[1].cbBuffer = static_cast<unsigned long>(chunk);
+        buffers[2].BufferType = SECBUFFER_STREAM_TRAILER;
+        buffers[2].pvBuffer = record + sizes.cbHeader + chunk;
+        buffers[2].cbBuffer = sizes.cbTrailer;
+        buffers[3].BufferType = SECBUFFER_EMPTY;
+        buffers[3].pvBuffer = NULL;
+        buffers[3].cbBuffer = 0;
+        SecBufferDesc desc = { SECBUFFER_VERSION, 4, buffers };
+
+        if (EncryptMessage(&context, 0, &desc, 0) != SEC_E_OK)
+        {
+            out.resize(start);
+            return false;
+        }
+        // The trailer can come out shorter than its maximum size.
+        out.resize(start + buffers[0].cbBuffer + buffers[1].cbBuffer + buffers[2].cbBuffer);
+        offset += chunk;
+    } while (offset < size);
+    return true;
+}
+
+size_t TlsChannel::encryptedSize(size_t size) const
+{
+    // At most: one record per cbMaximumMessage bytes, each with a full header and trailer
+    if (!established)
+    {
+        return size;
+    }
+    size_t records = (std::max)(static_cast<size_t>(1), (size + sizes.cbMaximumMessage - 1) / sizes.cbMaximumMessage);
+    return size + records * (sizes.cbHeader + sizes.cbTrailer);
+}
+
+void TlsChannel::close(std::string& toSend)
+{
+    if (!hasContext)
+    {
+        return;
+    }
+    // Ask Schannel for a close_notify alert.
+    DWORD shutdownToken = SCHANNEL_SHUTDOWN;
+    SecBuffer tokenBuffer;
+    tokenBuffer.BufferType = SECBUFFER_TOKEN;
+    tokenBuffer.pvBuffer = &shutdownToken;
+    tokenBuffer.cbBuffer = sizeof(shutdownToken);
+    SecBufferDesc tokenDesc = { SECBUFFER_VERSION, 1, &tokenBuffer };
+    if (ApplyControlToken(&context, &tokenDesc) != SEC_E_OK)
+    {
+        return;
+    }
+
+    SecBuffer outBuffers[1];
+    outBuffers[0].BufferType = SECBUFFER_TOKEN;
+    outBuffers[0].pvBuffer = NULL;
+    outBuffers[0].cbBuffer = 0;
+    SecBufferDesc outDesc = { SECBUFFER_VERSION, 1, outBuffers };
+    unsigned long attributes = 0;
+    if (credentials->isServer())
+    {
+        AcceptSecurityContext(credentials->getHandle(), &context, NULL, SERVER_CONTEXT_FLAGS, 0, NULL, &outDesc, &attributes, NULL);
+    }
+    else
+    {
+        InitializeSecurityContextA(credentials->getHandle(), &context, (SEC_CHAR*)serverName.c_str(), CLIENT_CONTEXT_FLAGS,
+            0, 0, NULL, 0, NULL, &outDesc, &attributes, NULL);
+    }
+    if (outBuffers[0].pvBuffer != NULL)
+    {
+        toSend.append(static_cast<const char*>(outBuffers[0].pvBuffer), outBuffers[0].cbBuffer);
+        FreeContextBuffer(outBuffers[0].pvBuffer);
+    }
+    established = false;
+}
+
+bool TlsChannel::isEstablished() const
+{
+    return established;
+}
+
+bool TlsChannel::wasResumed() const
+{
+    return resumed;
+}
+
+size_t TlsChannel::getMemoryUsage() const
+{
+    return sizeof(TlsChannel) + incoming.capacity() + serverName.capacity();
+}
+
+void TlsChannel::trim()
+{
+    if (incoming.empty())
+    {
+        std::vector<char>().swap(incoming);
+    }
+}
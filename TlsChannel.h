@@ -0,0 +1,71 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <winsock2.h>
+#include <windows.h>
+#include <wincrypt.h>
+#define SECURITY_WIN32
+#include <security.h>
+#include <schannel.h>
+
+#pragma comment(lib, "Secur32.lib")
+#pragma comment(lib, "Crypt32.lib")
+
+enum TlsResult {
+    TLS_OK = 0,
+    TLS_CLOSED = 1,
+    TLS_FAILED = 2,
+};
+
+// Schannel credentials. One handle is shared by every connection of a process:
+// Schannel keys its session cache (and tickets) on it, which is what makes reconnects cheap.
+class TlsCredentials {
+public:
+    ~TlsCredentials();
+    static std::shared_ptr<TlsCredentials> forServer(const std::string& certificateSubject);
+    static std::shared_ptr<TlsCredentials> forClient(bool verifyServer);
+    CredHandle* getHandle();
+    bool isServer() const;
+    bool verifiesServer() const;
+private:
+    TlsCredentials(bool server, bool verifyServer);
+    CredHandle handle;
+    PCCERT_CONTEXT certificate;
+    bool server;
+    bool verifyServer;
+};
+
+// One TLS connection on top of a socket the caller owns. The channel never touches
+// the socket itself: bytes read from it go in through receive(), and whatever it
+// hands back in toSend/out must be written to it as is.
+class TlsChannel {
+public:
+    TlsChannel(std::shared_ptr<TlsCredentials> credentials, const std::string& serverName);
+    ~TlsChannel();
+    TlsResult startHandshake(std::string& toSend);
+    TlsResult receive(const char* data, size_t size, std::string& toSend, std::string& plaintext);
+    bool encrypt(const char* data, size_t size, std::string& out);
+    // What encrypt makes of size bytes, at most
+    size_t encryptedSize(size_t size) const;
+    void close(std::string& toSend);
+    bool isEstablished() const;
+    bool wasResumed() const;
+    // Schannel's own state for the context isn't counted, only what the channel buffers
+    size_t getMemoryUsage() const;
+    // Frees the receive buffer if it holds nothing
+    void trim();
+private:
+    TlsResult handshake(std::string& toSend);
+    TlsResult decryptIncoming(std::string& toSend, std::string& plaintext);
+    std::shared_ptr<TlsCredentials> credentials;
+    std::string serverName;
+    CtxtHandle context;
+    bool hasContext;
+    bool established;
+    bool resumed;
+    bool withoutCertificate;    // client side, the server asked for a certificate and goes without
+    SecPkgContext_StreamSizes sizes;
+    std::vector<char> incoming;
+};
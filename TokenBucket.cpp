@@ -0,0 +1,94 @@
+#include "TokenBucket.h"
+
+#include <algorithm>
+#include <cmath>
+
+TokenBucket::TokenBucket() : TokenBucket(0.0, 0.0)
+{
+}
+
+TokenBucket::TokenBucket(double rate, double burst)
+{
+    configure(rate, burst);
+}
+
+void TokenBucket::configure(double newRate, double newBurst)
+{
+    rate = std::max(0.0, newRate);
+    // A bucket must at least hold one request or it could never admit anything.
+    burst = std::max(1.0, newBurst);
+    tokens = burst;
+    lastRefill = std::chrono::steady_clock::now();
+}
+
+void TokenBucket::refill()
+{
+    auto now = std::chrono::steady_clock::now();
+    std::chrono::duration<double> elapsed = now - lastRefill;
+    lastRefill = now;
+    tokens = std::min(burst, tokens + elapsed.count() * rate);
+}
+
+bool TokenBucket::tryConsume(double amount)
+{
+    if (isUnlimited())
+    {
+        return true;
+    }
+    refill();
+    if (tokens < amount)
+    {
+        return false;
+    }
+    tokens -= amount;
+    return true;
+}
+
+void TokenBucket::forceConsume(double amount)
+{
+    // For costs only known after the fact, e.g. the size of a frame already read.
+    // The balance may go negative, which delays the next request accordingly.
+    if (isUnlimited())
+    {
+        return;
+    }
+    refill();
+    tokens -= amount;
+}
+
+double TokenBucket::available()
+{
+    refill();
+    return tokens;
+}
+
+void TokenBucket::setAvailable(double newTokens)
+{
+    refill();
+    tokens = std::min(burst, newTokens);
+}
+
+bool TokenBucket::isFull()
+{
+    return isUnlimited() || available() >= burst;
+}
+
+bool TokenBucket::isUnlimited() const
+{
+    return rate <= 0.0;
+}
+
+std::chrono::milliseconds TokenBucket::timeUntilAvailable(double amount)
+{
+    if (isUnlimited())
+    {
+        return std::chrono::milliseconds(0);
+    }
+    refill();
+    if (tokens >= amount)
+    {
+        return std::chrono::milliseconds(0);
+    }
+    double seconds = (amount - tokens) / rate;
+    return std::chrono::milliseconds(static_cast<long long>(std::ceil(seconds * 1000.0)));
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <chrono>
+
+// Classic token bucket: refills at `rate` tokens per second up to `burst` tokens.
+// A rate of zero disables the limit and every request is allowed.
+class TokenBucket {
+public:
+    TokenBucket();
+    TokenBucket(double rate, double burst);
+    void configure(double rate, double burst);
+    bool tryConsume(double amount = 1.0);
+    void forceConsume(double amount);
+    double available();
+    // Starts over from a level kept elsewhere, e.g. by the process a session was handed over from
+    void setAvailable(double tokens);
+    bool isFull();
+    bool isUnlimited() const;
+    std::chrono::milliseconds timeUntilAvailable(double amount);
+private:
+    void refill();
+    double rate;
+    double burst;
+    double tokens;
+    std::chrono::steady_clock::time_point lastRefill;
+};
@@ -0,0 +1,33 @@
+# Creates a self-signed certificate for testing CppChat over TLS on this machine.
+#
+#   .\scripts\New-CppChatTestCertificate.ps1 -IPAddress 127.0.0.1
+#
+# The certificate goes into the current user's personal store, where the server looks it up
+# by subject ("CppChat" at the server prompt), and into the current user's trusted roots so
+# clients on this machine accept it. Clients check it against the IP address they connect to,
+# so pass every address the server will advertise.
+param(
+    [string[]]$IPAddress = @("127.0.0.1"),
+    [string]$Subject = "CN=CppChat Test Server",
+    [int]$ValidDays = 30
+)
+
+$sanEntries = @("DNS=localhost") + ($IPAddress | ForEach-Object { "IPAddress=$_" })
+$san = "2.5.29.17={text}" + ($sanEntries -join "&")
+
+$certificate = New-SelfSignedCertificate `
+    -Subject $Subject `
+    -TextExtension @($san) `
+    -KeyAlgorithm ECDSA_nistP256 `
+    -KeyExportPolicy Exportable `
+    -NotAfter (Get-Date).AddDays($ValidDays) `
+    -CertStoreLocation "Cert:\CurrentUser\My"
+
+# Trust it for this user only; Windows asks for confirmation.
+$publicPart = Join-Path $env:TEMP "cppchat-test.cer"
+Export-Certificate -Cert $certificate -FilePath $publicPart | Out-Null
+Import-Certificate -FilePath $publicPart -CertStoreLocation "Cert:\CurrentUser\Root" | Out-Null
+Remove-Item $publicPart
+
+Write-Host "Created $($certificate.Subject) ($($certificate.Thumbprint)), valid for $ValidDays days."
+Write-Host "Remove it with: Get-ChildItem Cert:\CurrentUser\My\$($certificate.Thumbprint), Cert:\CurrentUser\Root\$($certificate.Thumbprint) | Remove-Item"